@@ -0,0 +1,209 @@
+#include <algorithm>
+#include <cmath>
+#include "Grid.hpp"
+
+Grid::Grid(const std::vector<std::unique_ptr<Object> >& objects)
+{
+    std::vector<Vector3f> primMin, primMax;
+    for (int a = 0; a < 3; ++a)
+    {
+        boundsMin[a] = kInfinity;
+        boundsMax[a] = -kInfinity;
+    }
+    for (const auto& object : objects)
+    {
+        for (uint32_t k = 0; k < object->getPrimitiveCount(); ++k)
+        {
+            Vector3f pMin, pMax;
+            object->getPrimitiveBounds(k, pMin, pMax);
+            primitives.push_back({object.get(), k});
+            primMin.push_back(pMin);
+            primMax.push_back(pMax);
+            boundsMin[0] = std::min(boundsMin[0], pMin.x), boundsMax[0] = std::max(boundsMax[0], pMax.x);
+            boundsMin[1] = std::min(boundsMin[1], pMin.y), boundsMax[1] = std::max(boundsMax[1], pMax.y);
+            boundsMin[2] = std::min(boundsMin[2], pMin.z), boundsMax[2] = std::max(boundsMax[2], pMax.z);
+        }
+    }
+    primitiveCount = primitives.size();
+    if (primitives.empty())
+        return;
+
+    // 包围盒稍微放大, 避免贴在边界上的图元(如z方向厚度为0的地面)在DDA中因舍入误差被漏掉
+    float maxExtent = 0;
+    for (int a = 0; a < 3; ++a)
+        maxExtent = std::max(maxExtent, boundsMax[a] - boundsMin[a]);
+    float pad = std::max(maxExtent, 1.f) * 1e-4f;
+    for (int a = 0; a < 3; ++a)
+    {
+        boundsMin[a] -= pad;
+        boundsMax[a] += pad;
+    }
+    maxExtent += 2 * pad;
+
+    // 格子数量: 最长轴上划分3*cbrt(N)格, 其余轴按相同的格子边长划分, 使格子接近正方体且平均每格只有几个图元
+    float cellsPerUnit = 3 * std::cbrt((float)primitives.size()) / maxExtent;
+    for (int a = 0; a < 3; ++a)
+    {
+        resolution[a] = std::clamp((int)std::lround((boundsMax[a] - boundsMin[a]) * cellsPerUnit), 1, 128);
+        cellSize[a] = (boundsMax[a] - boundsMin[a]) / resolution[a];
+        invCellSize[a] = 1 / cellSize[a];
+    }
+
+    // 两遍构建压缩的格子表: 先统计每个格子的图元数, 再填入图元编号
+    auto cellRange = [&](const Vector3f& pMin, const Vector3f& pMax, int lo[3], int hi[3]) {
+        float p0[3] = {pMin.x, pMin.y, pMin.z}, p1[3] = {pMax.x, pMax.y, pMax.z};
+        for (int a = 0; a < 3; ++a)
+        {
+            lo[a] = std::clamp((int)((p0[a] - boundsMin[a]) * invCellSize[a]), 0, resolution[a] - 1);
+            hi[a] = std::clamp((int)((p1[a] - boundsMin[a]) * invCellSize[a]), 0, resolution[a] - 1);
+        }
+    };
+    size_t cellCount = (size_t)resolution[0] * resolution[1] * resolution[2];
+    cellStart.assign(cellCount + 1, 0);
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        std::vector<uint32_t> fill;
+        if (pass == 1)
+        {
+            for (size_t c = 0; c < cellCount; ++c)
+                cellStart[c + 1] += cellStart[c];
+            cellPrimitives.resize(cellStart[cellCount]);
+            fill.assign(cellStart.begin(), cellStart.end() - 1);
+        }
+        for (uint32_t p = 0; p < primitives.size(); ++p)
+        {
+            int lo[3], hi[3];
+            cellRange(primMin[p], primMax[p], lo, hi);
+            for (int z = lo[2]; z <= hi[2]; ++z)
+                for (int y = lo[1]; y <= hi[1]; ++y)
+                    for (int x = lo[0]; x <= hi[0]; ++x)
+                    {
+                        if (pass == 0)
+                            ++cellStart[cellIndex(x, y, z) + 1];
+                        else
+                            cellPrimitives[fill[cellIndex(x, y, z)]++] = p;
+                    }
+        }
+    }
+    referenceCount = cellPrimitives.size();
+}
+
+template <typename Visit>
+void Grid::traverse(const Vector3f& orig, const Vector3f& dir, float tMax, Visit visit) const
+{
+    if (primitives.empty())
+        return;
+
+    // 光线与网格包围盒求交, 得到光线在网格内的区间[t0, t1]
+    float o[3] = {orig.x, orig.y, orig.z}, d[3] = {dir.x, dir.y, dir.z};
+    float t0 = 0, t1 = tMax;
+    for (int a = 0; a < 3; ++a)
+    {
+        if (d[a] == 0)
+        {
+            if (o[a] < boundsMin[a] || o[a] > boundsMax[a])
+                return;
+            continue;
+        }
+        float tA = (boundsMin[a] - o[a]) / d[a], tB = (boundsMax[a] - o[a]) / d[a];
+        if (tA > tB)
+            std::swap(tA, tB);
+        t0 = std::max(t0, tA);
+        t1 = std::min(t1, tB);
+        if (t0 > t1)
+            return;
+    }
+
+    // 3D-DDA初始化: 起点所在格子, 沿各轴穿过下一个格子边界时的t, 以及每穿过一格t的增量
+    int cell[3], step[3], out[3];
+    float tNext[3], tDelta[3];
+    for (int a = 0; a < 3; ++a)
+    {
+        float p = o[a] + d[a] * t0;
+        cell[a] = std::clamp((int)((p - boundsMin[a]) * invCellSize[a]), 0, resolution[a] - 1);
+        if (d[a] > 0)
+        {
+            step[a] = 1;
+            out[a] = resolution[a];
+            tNext[a] = (boundsMin[a] + (cell[a] + 1) * cellSize[a] - o[a]) / d[a];
+            tDelta[a] = cellSize[a] / d[a];
+        }
+        else if (d[a] < 0)
+        {
+            step[a] = -1;
+            out[a] = -1;
+            tNext[a] = (boundsMin[a] + cell[a] * cellSize[a] - o[a]) / d[a];
+            tDelta[a] = -cellSize[a] / d[a];
+        }
+        else
+        {
+            step[a] = 0;
+            out[a] = -1;
+            tNext[a] = kInfinity;
+            tDelta[a] = 0;
+        }
+    }
+
+    while (true)
+    {
+        int c = cellIndex(cell[0], cell[1], cell[2]);
+        int axis = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+        if (visit(cellPrimitives.data() + cellStart[c], cellPrimitives.data() + cellStart[c + 1], tNext[axis]))
+            return;
+        if (tNext[axis] > t1)
+            return;
+        cell[axis] += step[axis];
+        if (cell[axis] == out[axis])
+            return;
+        tNext[axis] += tDelta[axis];
+    }
+}
+
+bool Grid::intersect(const Vector3f& orig, const Vector3f& dir, float& tNear, uint32_t& index, Vector2f& uv,
+                     Object*& hitObject) const
+{
+    bool hit = false;
+    traverse(orig, dir, kInfinity, [&](const uint32_t* begin, const uint32_t* end, float tExit) {
+        // 跨越多个格子的图元会被重复测试, 但只保留最近的交点, 结果不受影响
+        for (const uint32_t* k = begin; k != end; ++k)
+        {
+            const Primitive& prim = primitives[*k];
+            float tK = kInfinity;
+            Vector2f uvK;
+            if (prim.object->intersectPrimitive(orig, dir, prim.index, tK, uvK) && tK < tNear)
+            {
+                tNear = tK;
+                uv = uvK;
+                index = prim.index;
+                hitObject = prim.object;
+                hit = true;
+            }
+        }
+        // 交点不超过当前格子的出口时, 后面的格子中不可能有更近的交点
+        return hit && tNear <= tExit;
+    });
+    return hit;
+}
+
+bool Grid::occluded(const Vector3f& orig, const Vector3f& dir, float tMax, Object*& blocker,
+                    uint32_t& blockerIndex) const
+{
+    bool hit = false;
+    traverse(orig, dir, tMax, [&](const uint32_t* begin, const uint32_t* end, float) {
+        for (const uint32_t* k = begin; k != end; ++k)
+        {
+            const Primitive& prim = primitives[*k];
+            float tK = kInfinity;
+            Vector2f uvK;
+            if (prim.object->intersectPrimitive(orig, dir, prim.index, tK, uvK) && tK < tMax)
+            {
+                blocker = prim.object;
+                blockerIndex = prim.index;
+                hit = true;
+                return true;
+            }
+        }
+        return false;
+    });
+    return hit;
+}
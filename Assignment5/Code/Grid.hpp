@@ -0,0 +1,45 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "Object.hpp"
+
+// 均匀网格加速结构: 场景包围盒按图元数量划分为若干大小相同的格子, 每个格子记录与之重叠的图元(球/单个三角形),
+// 求交时用3D-DDA按光线经过的顺序遍历格子, 一旦找到的最近交点落在当前格子内即可停止
+class Grid
+{
+public:
+    // 由场景中全部物体的图元构建, 之后物体不能再修改
+    explicit Grid(const std::vector<std::unique_ptr<Object> >& objects);
+
+    // 与线性遍历objects的结果相同: 返回最近的交点, index/uv的含义与Object::intersect相同
+    bool intersect(const Vector3f& orig, const Vector3f& dir, float& tNear, uint32_t& index, Vector2f& uv,
+                   Object*& hitObject) const;
+
+    // 阴影光线: 只要在[0, tMax)内遇到任意一个图元即返回true, 遮挡物通过blocker/blockerIndex返回
+    bool occluded(const Vector3f& orig, const Vector3f& dir, float tMax, Object*& blocker, uint32_t& blockerIndex) const;
+
+    int resolution[3] = {0, 0, 0};
+    size_t primitiveCount = 0;
+    size_t referenceCount = 0;     // 所有格子中图元引用的总数, 一个图元跨越多个格子时被记录多次
+
+private:
+    struct Primitive
+    {
+        Object* object;
+        uint32_t index;
+    };
+
+    int cellIndex(int x, int y, int z) const { return (z * resolution[1] + y) * resolution[0] + x; }
+
+    // 3D-DDA按光线经过的顺序遍历[0, tMax]内的格子, 对每个格子调用visit(格子的图元列表, 列表末尾, 光线离开该格子的t),
+    // visit返回true时停止
+    template <typename Visit>
+    void traverse(const Vector3f& orig, const Vector3f& dir, float tMax, Visit visit) const;
+
+    float boundsMin[3], boundsMax[3];
+    float cellSize[3], invCellSize[3];
+    std::vector<Primitive> primitives;
+    std::vector<uint32_t> cellStart;        // 格子c的图元为cellPrimitives[cellStart[c], cellStart[c + 1])
+    std::vector<uint32_t> cellPrimitives;
+};
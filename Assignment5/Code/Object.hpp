@@ -22,6 +22,28 @@ public:
     virtual void getSurfaceProperties(const Vector3f&, const Vector3f&, const uint32_t&, const Vector2f&, Vector3f&,
                                       Vector2f&) const = 0;
 
+    // 供网格加速结构使用: 物体由若干可以单独求交的图元组成(球只有1个, 三角形网格每个三角形为一个图元)
+    virtual uint32_t getPrimitiveCount() const { return 1; }
+
+    // 第index个图元的包围盒
+    virtual void getPrimitiveBounds(uint32_t index, Vector3f& pMin, Vector3f& pMax) const = 0;
+
+    // 只与第index个图元求交, 结果的含义与intersect相同
+    virtual bool intersectPrimitive(const Vector3f& orig, const Vector3f& dir, uint32_t, float& tnear,
+                                    Vector2f& uv) const
+    {
+        uint32_t index;
+        return intersect(orig, dir, tnear, index, uv);
+    }
+
+    // 阴影光线: 在[0, tMax)内是否与物体相交, 不需要最近的交点. 遮挡的图元编号写入index
+    virtual bool occluded(const Vector3f& orig, const Vector3f& dir, float tMax, uint32_t& index) const
+    {
+        float tnear = kInfinity;
+        Vector2f uv;
+        return intersect(orig, dir, tnear, index, uv) && tnear < tMax;
+    }
+
     virtual Vector3f evalDiffuseColor(const Vector2f&) const
     {
         return diffuseColor;
@@ -1,4 +1,8 @@
+#include <algorithm>
+#include <atomic>
 #include <fstream>
+#include <functional>
+#include <thread>
 #include "Vector.hpp"
 #include "Renderer.hpp"
 #include "Scene.hpp"
@@ -77,7 +81,7 @@ float fresnel(const Vector3f &I, const Vector3f &N, const float &ior)
 //
 // \param orig is the ray origin
 // \param dir is the ray direction
-// \param objects is the list of objects the scene contains
+// \param scene is the scene; its uniform grid is used when one has been built
 // \param[out] tNear contains the distance to the cloesest intersected object.
 // \param[out] index stores the index of the intersect triangle if the interesected object is a mesh.
 // \param[out] uv stores the u and v barycentric coordinates of the intersected point
@@ -85,11 +89,21 @@ float fresnel(const Vector3f &I, const Vector3f &N, const float &ior)
 // \param isShadowRay is it a shadow ray. We can return from the function sooner as soon as we have found a hit.
 // [/comment]
 std::optional<hit_payload> trace(
-        const Vector3f &orig, const Vector3f &dir,
-        const std::vector<std::unique_ptr<Object> > &objects)
+        const Vector3f &orig, const Vector3f &dir, const Scene& scene)
 {
     float tNear = kInfinity;
     std::optional<hit_payload> payload;
+    if (const Grid* grid = scene.get_grid())
+    {
+        hit_payload hit;
+        if (grid->intersect(orig, dir, tNear, hit.index, hit.uv, hit.hit_obj))
+        {
+            hit.tNear = tNear;
+            payload = hit;
+        }
+        return payload;
+    }
+    const auto& objects = scene.get_objects();
     // 将当前orig起沿dir方向的光线判断与objects中的所有物体是否相交, 取最近相交的点
     for (const auto & object : objects)
     {
@@ -110,6 +124,71 @@ std::optional<hit_payload> trace(
     return payload;
 }
 
+// 每个线程各自的光线计数, 每渲染完一行累加到总数中
+struct RayStats
+{
+    uint64_t primaryRays = 0;
+    uint64_t reflectionRays = 0;
+    uint64_t refractionRays = 0;
+    uint64_t prunedRays = 0;                // 因权重低于Scene::minWeight而没有追踪的反射/折射光线
+    uint64_t totalInternalReflections = 0;  // 发生全反射, 不追踪折射光线的次数
+    uint64_t shadowRays = 0;
+    uint64_t occluderCacheHits = 0;
+};
+static thread_local RayStats rayStats;
+
+// 每个光源上一次挡住阴影光线的图元. 相邻像素的阴影光线通常被同一个物体挡住, 先单独测试它往往就能确定处于阴影中.
+// 每次Render开始时renderGeneration加1, 线程发现记录来自之前的Render时清空, 两次Render之间场景可能已经改变或被销毁
+struct OccluderCache
+{
+    uint64_t generation = 0;
+    std::vector<std::pair<Object*, uint32_t> > lastOccluder;     // 下标为光源编号, object为空表示没有记录
+};
+static thread_local OccluderCache occluderCache;
+static std::atomic<uint64_t> renderGeneration{0};
+
+// 从orig沿dir在[0, tMax)内是否被任意物体挡住. 与trace()不同, 遇到第一个遮挡物即返回, 不需要找最近的交点
+bool occluded(const Vector3f &orig, const Vector3f &dir, float tMax, const Scene& scene, size_t lightIndex)
+{
+    ++rayStats.shadowRays;
+    uint64_t generation = renderGeneration.load(std::memory_order_relaxed);
+    if (occluderCache.generation != generation)
+    {
+        occluderCache.generation = generation;
+        occluderCache.lastOccluder.assign(scene.get_lights().size(), {nullptr, 0});
+    }
+    if (lightIndex >= occluderCache.lastOccluder.size())
+        occluderCache.lastOccluder.resize(lightIndex + 1, {nullptr, 0});
+    auto& last = occluderCache.lastOccluder[lightIndex];
+    float t;
+    Vector2f uv;
+    if (last.first && last.first->intersectPrimitive(orig, dir, last.second, t, uv) && t < tMax)
+    {
+        ++rayStats.occluderCacheHits;
+        return true;
+    }
+
+    Object* blocker = nullptr;
+    uint32_t blockerIndex = 0;
+    if (const Grid* grid = scene.get_grid())
+        grid->occluded(orig, dir, tMax, blocker, blockerIndex);
+    else
+    {
+        for (const auto& object : scene.get_objects())
+        {
+            if (object->occluded(orig, dir, tMax, blockerIndex))
+            {
+                blocker = object.get();
+                break;
+            }
+        }
+    }
+    // 没有被挡住时保留原来的记录, 阴影边界附近的像素仍可能被它挡住
+    if (blocker)
+        last = {blocker, blockerIndex};
+    return blocker != nullptr;
+}
+
 // [comment]
 // Implementation of the Whitted-style light transport algorithm (E [S*] (D|G) L)
 //
@@ -126,9 +205,12 @@ std::optional<hit_payload> trace(
 // If the surface is diffuse/glossy we use the Phong illumation model to compute the color
 // at the intersection point.
 // [/comment]
+//
+// weight为这条光线的颜色最终乘到像素上的系数(沿途菲涅尔系数之积), 派生光线的权重低于scene.minWeight时不再追踪.
+// 若hitObject不为空, 返回视线直接击中的物体(未击中时为nullptr), 自适应抗锯齿据此判断像素内是否有物体边缘
 Vector3f castRay(
         const Vector3f &orig, const Vector3f &dir, const Scene& scene,
-        int depth)
+        int depth, float weight = 1, Object** hitObject = nullptr)
 {
     // 判断传播次数 最大为5次
     if (depth > scene.maxDepth) {
@@ -137,7 +219,10 @@ Vector3f castRay(
 
     // 设置着色点的默认颜色为scene的背景色, 如果光线不相交则着色点为背景色
     Vector3f hitColor = scene.backgroundColor;
-    if (auto payload = trace(orig, dir, scene.get_objects()); payload)
+    auto payload = trace(orig, dir, scene);
+    if (hitObject)
+        *hitObject = payload ? payload->hit_obj : nullptr;
+    if (payload)
     {
         // 如果视线与scene中的物体有交点hitPoint
         Vector3f hitPoint = orig + dir * payload->tNear;
@@ -150,30 +235,62 @@ Vector3f castRay(
             // 反射折射材质
             case REFLECTION_AND_REFRACTION:
             {
-                Vector3f reflectionDirection = normalize(reflect(dir, N));
-                Vector3f refractionDirection = normalize(refract(dir, N, payload->hit_obj->ior));
-                Vector3f reflectionRayOrig = (dotProduct(reflectionDirection, N) < 0) ?
-                                             hitPoint - N * scene.epsilon :
-                                             hitPoint + N * scene.epsilon;
-                Vector3f refractionRayOrig = (dotProduct(refractionDirection, N) < 0) ?
-                                             hitPoint - N * scene.epsilon :
-                                             hitPoint + N * scene.epsilon;
-                Vector3f reflectionColor = castRay(reflectionRayOrig, reflectionDirection, scene, depth + 1);
-                Vector3f refractionColor = castRay(refractionRayOrig, refractionDirection, scene, depth + 1);
                 // kr为菲尼尔方程计算出来的反射比率
                 float kr = fresnel(dir, N, payload->hit_obj->ior);
-                hitColor = reflectionColor * kr + refractionColor * (1 - kr);
+                hitColor = 0;
+                // 两个分支各自乘上kr, 1-kr, 权重过小的分支对像素几乎没有贡献, 直接跳过以免光线数随深度指数增长.
+                // 已到最大深度时派生光线本来就返回黑色, 不算作光线
+                if (depth >= scene.maxDepth)
+                    break;
+                if (weight * kr >= scene.minWeight && kr > 0)
+                {
+                    Vector3f reflectionDirection = normalize(reflect(dir, N));
+                    Vector3f reflectionRayOrig = (dotProduct(reflectionDirection, N) < 0) ?
+                                                 hitPoint - N * scene.epsilon :
+                                                 hitPoint + N * scene.epsilon;
+                    ++rayStats.reflectionRays;
+                    hitColor += castRay(reflectionRayOrig, reflectionDirection, scene, depth + 1, weight * kr) * kr;
+                }
+                else
+                    ++rayStats.prunedRays;
+                // kr为1即全反射, 没有折射光线(refract返回零向量)
+                if (kr >= 1)
+                    ++rayStats.totalInternalReflections;
+                else if (weight * (1 - kr) >= scene.minWeight)
+                {
+                    Vector3f refractionDirection = normalize(refract(dir, N, payload->hit_obj->ior));
+                    Vector3f refractionRayOrig = (dotProduct(refractionDirection, N) < 0) ?
+                                                 hitPoint - N * scene.epsilon :
+                                                 hitPoint + N * scene.epsilon;
+                    ++rayStats.refractionRays;
+                    hitColor += castRay(refractionRayOrig, refractionDirection, scene, depth + 1, weight * (1 - kr)) *
+                                (1 - kr);
+                }
+                else
+                    ++rayStats.prunedRays;
                 break;
             }
             // 反射材质
             case REFLECTION:
             {
                 float kr = fresnel(dir, N, payload->hit_obj->ior);
+                if (depth >= scene.maxDepth)
+                {
+                    hitColor = 0;
+                    break;
+                }
+                if (weight * kr < scene.minWeight || kr <= 0)
+                {
+                    ++rayStats.prunedRays;
+                    hitColor = 0;
+                    break;
+                }
                 Vector3f reflectionDirection = reflect(dir, N);
                 Vector3f reflectionRayOrig = (dotProduct(reflectionDirection, N) < 0) ?
                                              hitPoint + N * scene.epsilon :
                                              hitPoint - N * scene.epsilon;
-                hitColor = castRay(reflectionRayOrig, reflectionDirection, scene, depth + 1) * kr;
+                ++rayStats.reflectionRays;
+                hitColor = castRay(reflectionRayOrig, reflectionDirection, scene, depth + 1, weight * kr) * kr;
                 break;
             }
             // 漫反射材质
@@ -195,7 +312,8 @@ Vector3f castRay(
                 // Loop over all lights in the scene and sum their contribution up
                 // We also apply the lambert cosine law
                 // [/comment]
-                for (auto& light : scene.get_lights()) {
+                for (size_t lightIndex = 0; lightIndex < scene.get_lights().size(); ++lightIndex) {
+                    auto& light = scene.get_lights()[lightIndex];
                     // 从着色点hitPoint起算的光线方向
                     Vector3f lightDir = light->position - hitPoint;
 
@@ -204,10 +322,9 @@ Vector3f castRay(
                     lightDir = normalize(lightDir);
                     float LdotN = std::max(0.f, dotProduct(lightDir, N));
 
-                    // is the point in shadow, and is the nearest occluding object closer to the object than the light itself?
-                    auto shadow_res = trace(shadowPointOrig, lightDir, scene.get_objects());
+                    // is the point in shadow, i.e. is there any occluding object closer to the object than the light itself?
                     // 判断着色点与光源之间是否有其他物体遮挡（是否为阴影点）
-                    bool inShadow = shadow_res && (shadow_res->tNear * shadow_res->tNear < lightDistance2);
+                    bool inShadow = occluded(shadowPointOrig, lightDir, std::sqrt(lightDistance2), scene, lightIndex);
 
                     // 如果是阴影点 光强设置为0
                     lightAmt += inShadow ? 0 : light->intensity * LdotN;
@@ -233,6 +350,7 @@ Vector3f castRay(
 // [/comment]
 void Renderer::Render(const Scene& scene)
 {
+    ++renderGeneration;
     std::vector<Vector3f> framebuffer(scene.width * scene.height);
 
     float scale = std::tan(deg2rad(scene.fov * 0.5f));
@@ -240,59 +358,199 @@ void Renderer::Render(const Scene& scene)
 
     // Use this variable as the eye position to start your rays.
     Vector3f eye_pos(0);
-    int m = 0;
-    for (int j = 0; j < scene.height; ++j)
+
+    // 沿成像平面上(px, py)处发出视线, 坐标以像素为单位, 像素(i, j)覆盖[i, i+1]x[j, j+1], 中心为(i+0.5, j+0.5)
+    auto sample = [&](double px, double py, Object** hitObject)
     {
-        for (int i = 0; i < scene.width; ++i)
-        {
-            // generate primary ray direction
-            float x;
-            float y;
-            // TODO: Find the x and y positions of the current pixel to get the direction
-            // vector that passes through it.
-            // Also, don't forget to multiply both of them with the variable *scale*, and
-            // x (horizontal) variable with the *imageAspectRatio*   
+        // generate primary ray direction
+        float x;
+        float y;
+        // TODO: Find the x and y positions of the current pixel to get the direction
+        // vector that passes through it.
+        // Also, don't forget to multiply both of them with the variable *scale*, and
+        // x (horizontal) variable with the *imageAspectRatio*   
 
-            // 屏幕空间 转换为 NDC空间(标准设备空间)
-            // i/j+0.5f 是要取像素块中心点的坐标, 并将屏幕坐标系中的原点(左上角)改为中心(范围 -1到1)
-            float nx = (i+0.5)*2.0/static_cast<float>(scene.width) - 1.0;
-            float ny = 1.0f-(j+0.5)*2.0/static_cast<float>(scene.height);
+        // 屏幕空间 转换为 NDC空间(标准设备空间)
+        // i/j+0.5f 是要取像素块中心点的坐标, 并将屏幕坐标系中的原点(左上角)改为中心(范围 -1到1)
+        float nx = px*2.0/static_cast<float>(scene.width) - 1.0;
+        float ny = 1.0f-py*2.0/static_cast<float>(scene.height);
 
-            // Project matrix
-            /*
-            *   [ n/r ,0   ,0       ,0      ]
-            *   [ 0   ,n/t ,0       ,0      ]
-            *   [ 0   ,0   ,n+f/n-f ,2nf/f-n]
-            *   [ 0   ,0   ,1       ,0      ]
-            */
+        // Project matrix
+        /*
+        *   [ n/r ,0   ,0       ,0      ]
+        *   [ 0   ,n/t ,0       ,0      ]
+        *   [ 0   ,0   ,n+f/n-f ,2nf/f-n]
+        *   [ 0   ,0   ,1       ,0      ]
+        */
 
-            //  
-            // 在投影矩阵中 x 的系数为 n/r
-            // 在投影矩阵中 y 的系数为 n/t
-            // 现在要做一个逆操作，所以我们用 NDC空间的坐标分别除以投影矩阵中的系数
-            // x = nx / (n / r)
-            // y = ny / (n / t)
-            // 其中 n(相机到近投影面距离为 默认情况下为1）
-            // => 
-            // x = nx * r
-            // y = ny * t
-            // 其中 r = tan(fov/2)*aspect * |n|， t=tan(fov/2) * |n| , |n| = 1
-            // 所以可得,世界空间中坐标为
-            // x = nx * tan(fov/2)*aspect
-            // y = ny * tan(fov/2)*aspect
-            
-            x = nx * scale * imageAspectRatio;
-            y = ny * scale;
+        //  
+        // 在投影矩阵中 x 的系数为 n/r
+        // 在投影矩阵中 y 的系数为 n/t
+        // 现在要做一个逆操作，所以我们用 NDC空间的坐标分别除以投影矩阵中的系数
+        // x = nx / (n / r)
+        // y = ny / (n / t)
+        // 其中 n(相机到近投影面距离为 默认情况下为1）
+        // => 
+        // x = nx * r
+        // y = ny * t
+        // 其中 r = tan(fov/2)*aspect * |n|， t=tan(fov/2) * |n| , |n| = 1
+        // 所以可得,世界空间中坐标为
+        // x = nx * tan(fov/2)*aspect
+        // y = ny * tan(fov/2)*aspect
+    
+        x = nx * scale * imageAspectRatio;
+        y = ny * scale;
 
-            // Gong:: why z=-1 ???
-            // 我们通常设定图像平面与相机原点相距1个单位
-            // 改变为-2时候图片边大 视角拉近
-            Vector3f dir = Vector3f(x, y, -1.5); // Don't forget to normalize this direction!
-            dir = normalize(dir);
-            framebuffer[m++] = castRay(eye_pos, dir, scene, 0);
-        }
-        UpdateProgress(j / (float)scene.height);
+        // Gong:: why z=-1 ???
+        // 我们通常设定图像平面与相机原点相距1个单位
+        // 改变为-2时候图片边大 视角拉近
+        Vector3f dir = Vector3f(x, y, -1.5); // Don't forget to normalize this direction!
+        dir = normalize(dir);
+        ++rayStats.primaryRays;
+        return castRay(eye_pos, dir, scene, 0, 1, hitObject);
+    };
+
+    // 按行分配工作: 每个线程用原子计数器领取下一行, 结果直接写入该行自己的位置(各行互不重叠, 无需加锁),
+    // 每个像素的计算与串行时完全相同, 输出图像与线程数无关
+    int threadCount = threads > 0 ? threads : (int)std::max(1u, std::thread::hardware_concurrency());
+    int totalRows = scene.height + (adaptiveLevels > 0 ? scene.height + 1 : 0);
+    std::atomic<int> rowsDone{0};
+    std::atomic<uint64_t> primaryRays{0}, shadowRays{0}, occluderCacheHits{0};
+    std::atomic<uint64_t> reflectionRays{0}, refractionRays{0}, prunedRays{0}, totalInternalReflections{0};
+    int lastPercent = -1;
+    auto parallelRows = [&](int count, const std::function<void(int)>& renderRow)
+    {
+        std::atomic<int> nextRow{0};
+        auto work = [&](bool reportProgress)
+        {
+            for (int j = nextRow.fetch_add(1); j < count; j = nextRow.fetch_add(1))
+            {
+                renderRow(j);
+                primaryRays += rayStats.primaryRays;
+                reflectionRays += rayStats.reflectionRays;
+                refractionRays += rayStats.refractionRays;
+                prunedRays += rayStats.prunedRays;
+                totalInternalReflections += rayStats.totalInternalReflections;
+                shadowRays += rayStats.shadowRays;
+                occluderCacheHits += rayStats.occluderCacheHits;
+                rayStats = RayStats();
+                int done = rowsDone.fetch_add(1) + 1;
+                // 只由调用线程输出进度, 且只在整数百分比变化时输出
+                int percent = done * 100 / totalRows;
+                if (reportProgress && percent != lastPercent)
+                {
+                    lastPercent = percent;
+                    UpdateProgress(done / (float)totalRows);
+                }
+            }
+        };
+        std::vector<std::thread> workers;
+        for (int t = 1; t < std::min(threadCount, count); ++t)
+            workers.emplace_back(work, false);
+        work(true);
+        for (auto& worker : workers)
+            worker.join();
+    };
+
+    if (adaptiveLevels > 0)
+    {
+        // 自适应超采样: 先在所有像素的角点上采样(相邻像素共享角点, 共(width+1)*(height+1)条视线),
+        // 像素四个角点击中的物体不同或颜色相差超过adaptiveThreshold时, 把它分成四块并在新的角点上补充采样,
+        // 递归到adaptiveLevels层为止. 像素颜色为各小块四角颜色平均值按面积加权
+        int latticeWidth = scene.width + 1;
+        std::vector<Vector3f> cornerColor(latticeWidth * (scene.height + 1));
+        std::vector<Object*> cornerObject(cornerColor.size());
+        parallelRows(scene.height + 1, [&](int j)
+        {
+            for (int i = 0; i < latticeWidth; ++i)
+                cornerColor[j * latticeWidth + i] = sample(i, j, &cornerObject[j * latticeWidth + i]);
+        });
+
+        // 像素内部的细分点: size*size的局部网格, 每个点最多采样一次, 相邻小块共享边上的点
+        int size = (1 << adaptiveLevels) + 1;
+        parallelRows(scene.height, [&](int j)
+        {
+            std::vector<Vector3f> color(size * size);
+            std::vector<Object*> object(size * size);
+            std::vector<char> sampled(size * size);
+            for (int i = 0; i < scene.width; ++i)
+            {
+                std::fill(sampled.begin(), sampled.end(), 0);
+                int last = size - 1;
+                for (int corner = 0; corner < 4; ++corner)
+                {
+                    int dx = corner & 1, dy = corner >> 1;
+                    int k = dy * last * size + dx * last;
+                    color[k] = cornerColor[(j + dy) * latticeWidth + i + dx];
+                    object[k] = cornerObject[(j + dy) * latticeWidth + i + dx];
+                    sampled[k] = 1;
+                }
+                auto at = [&](int x, int y) -> int
+                {
+                    int k = y * size + x;
+                    if (!sampled[k])
+                    {
+                        color[k] = sample(i + x / (double)last, j + y / (double)last, &object[k]);
+                        sampled[k] = 1;
+                    }
+                    return k;
+                };
+                // 左上角为(x, y), 边长为step的小块的平均颜色
+                std::function<Vector3f(int, int, int)> refine = [&](int x, int y, int step) -> Vector3f
+                {
+                    int k[4] = {at(x, y), at(x + step, y), at(x, y + step), at(x + step, y + step)};
+                    Vector3f average = (color[k[0]] + color[k[1]] + color[k[2]] + color[k[3]]) * 0.25f;
+                    if (step == 1)
+                        return average;
+                    bool differ = false;
+                    for (int c = 1; c < 4 && !differ; ++c)
+                    {
+                        differ = object[k[c]] != object[k[0]] ||
+                                 std::max({std::fabs(clamp(0, 1, color[k[c]].x) - clamp(0, 1, color[k[0]].x)),
+                                           std::fabs(clamp(0, 1, color[k[c]].y) - clamp(0, 1, color[k[0]].y)),
+                                           std::fabs(clamp(0, 1, color[k[c]].z) - clamp(0, 1, color[k[0]].z))}) >
+                                     adaptiveThreshold;
+                    }
+                    if (!differ)
+                        return average;
+                    int half = step / 2;
+                    return (refine(x, y, half) + refine(x + half, y, half) + refine(x, y + half, half) +
+                            refine(x + half, y + half, half)) * 0.25f;
+                };
+                framebuffer[j * scene.width + i] = refine(0, 0, last);
+            }
+        });
+    }
+    else
+    {
+        // ssaa为1时只在像素中心采样一次(原来的做法), 否则在像素内均匀分布ssaa*ssaa个采样点
+        parallelRows(scene.height, [&](int j)
+        {
+            Vector3f* row = &framebuffer[j * scene.width];
+            for (int i = 0; i < scene.width; ++i)
+            {
+                if (ssaa <= 1)
+                {
+                    row[i] = sample(i + 0.5, j + 0.5, nullptr);
+                    continue;
+                }
+                Vector3f sum = 0;
+                for (int sy = 0; sy < ssaa; ++sy)
+                    for (int sx = 0; sx < ssaa; ++sx)
+                        sum += sample(i + (sx + 0.5) / ssaa, j + (sy + 0.5) / ssaa, nullptr);
+                row[i] = sum / (float)(ssaa * ssaa);
+            }
+        });
     }
+    UpdateProgress(1.f);
+    std::cout << std::endl;
+    std::cout << "Primary rays: " << primaryRays << " (" << primaryRays / (double)(scene.width * scene.height)
+              << " per pixel)\n";
+    std::cout << "Secondary rays: " << reflectionRays + refractionRays << " (reflection " << reflectionRays
+              << ", refraction " << refractionRays << "), pruned by weight: " << prunedRays
+              << ", refraction skipped for total internal reflection: " << totalInternalReflections << "\n";
+    std::cout << "Shadow rays: " << shadowRays << ", answered by the occluder cache: " << occluderCacheHits << " ("
+              << (shadowRays ? 100.0 * occluderCacheHits / shadowRays : 0.0) << "%)\n";
 
     // save framebuffer to file
     FILE* fp = fopen("binary.ppm", "wb");
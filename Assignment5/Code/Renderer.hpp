@@ -12,6 +12,15 @@ struct hit_payload
 class Renderer
 {
 public:
+    // 渲染线程数(包括调用线程), 0表示使用硬件线程数, 1即原来的串行渲染
+    int threads = 0;
+
+    // 抗锯齿: ssaa>1时每个像素均匀采样ssaa*ssaa次; adaptiveLevels>0时改用自适应超采样,
+    // 只细分角点颜色差超过adaptiveThreshold或角点击中不同物体的像素, 最多细分adaptiveLevels层
+    int ssaa = 1;
+    int adaptiveLevels = 0;
+    float adaptiveThreshold = 0.05f;
+
     void Render(const Scene& scene);
 
 private:
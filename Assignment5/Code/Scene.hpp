@@ -5,6 +5,7 @@
 #include "Vector.hpp"
 #include "Object.hpp"
 #include "Light.hpp"
+#include "Grid.hpp"
 
 class Scene
 {
@@ -16,6 +17,8 @@ public:
     Vector3f backgroundColor = Vector3f(0.235294, 0.67451, 0.843137);
     int maxDepth = 5;
     float epsilon = 0.00001;
+    // 反射/折射光线对像素颜色的权重(沿途菲涅尔系数之积)小于minWeight时不再追踪, 设为0则只跳过权重恰好为0的光线
+    float minWeight = 0.001f;
 
     Scene(int w, int h) : width(w), height(h)
     {}
@@ -23,11 +26,16 @@ public:
     void Add(std::unique_ptr<Object> object) { objects.push_back(std::move(object)); }
     void Add(std::unique_ptr<Light> light) { lights.push_back(std::move(light)); }
 
+    // 加入全部物体后调用, 之后trace()通过均匀网格求交; 不调用时仍线性遍历所有物体
+    void buildGrid() { grid = std::make_unique<Grid>(objects); }
+
     [[nodiscard]] const std::vector<std::unique_ptr<Object> >& get_objects() const { return objects; }
+    [[nodiscard]] const Grid* get_grid() const { return grid.get(); }
     [[nodiscard]] const std::vector<std::unique_ptr<Light> >&  get_lights() const { return lights; }
 
 private:
     // creating the scene (adding objects and lights)
     std::vector<std::unique_ptr<Object> > objects;
     std::vector<std::unique_ptr<Light> > lights;
+    std::unique_ptr<Grid> grid;
 };
\ No newline at end of file
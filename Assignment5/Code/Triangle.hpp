@@ -2,9 +2,10 @@
 
 #include "Object.hpp"
 
+#include <algorithm>
 #include <cstring>
 
-bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1, const Vector3f& v2, const Vector3f& orig,
+inline bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1, const Vector3f& v2, const Vector3f& orig,
                           const Vector3f& dir, float& tnear, float& u, float& v)
 {
     // TODO: Implement this function that tests whether the triangle
@@ -74,6 +75,46 @@ public:
         return intersect;
     }
 
+    // 找到任意一个距离小于tMax的三角形即返回
+    bool occluded(const Vector3f& orig, const Vector3f& dir, float tMax, uint32_t& index) const override
+    {
+        for (uint32_t k = 0; k < numTriangles; ++k)
+        {
+            float t, u, v;
+            if (rayTriangleIntersect(vertices[vertexIndex[k * 3]], vertices[vertexIndex[k * 3 + 1]],
+                                     vertices[vertexIndex[k * 3 + 2]], orig, dir, t, u, v) && t < tMax)
+            {
+                index = k;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    uint32_t getPrimitiveCount() const override { return numTriangles; }
+
+    void getPrimitiveBounds(uint32_t index, Vector3f& pMin, Vector3f& pMax) const override
+    {
+        const Vector3f& v0 = vertices[vertexIndex[index * 3]];
+        const Vector3f& v1 = vertices[vertexIndex[index * 3 + 1]];
+        const Vector3f& v2 = vertices[vertexIndex[index * 3 + 2]];
+        pMin = Vector3f(std::min({v0.x, v1.x, v2.x}), std::min({v0.y, v1.y, v2.y}), std::min({v0.z, v1.z, v2.z}));
+        pMax = Vector3f(std::max({v0.x, v1.x, v2.x}), std::max({v0.y, v1.y, v2.y}), std::max({v0.z, v1.z, v2.z}));
+    }
+
+    bool intersectPrimitive(const Vector3f& orig, const Vector3f& dir, uint32_t index, float& tnear,
+                            Vector2f& uv) const override
+    {
+        float t, u, v;
+        if (!rayTriangleIntersect(vertices[vertexIndex[index * 3]], vertices[vertexIndex[index * 3 + 1]],
+                                  vertices[vertexIndex[index * 3 + 2]], orig, dir, t, u, v))
+            return false;
+        tnear = t;
+        uv.x = u;
+        uv.y = v;
+        return true;
+    }
+
     // getSurfaceProperties函数获取法线和纹理坐标
     void getSurfaceProperties(const Vector3f&, const Vector3f&, const uint32_t& index, const Vector2f& uv, Vector3f& N,
                               Vector2f& st) const override
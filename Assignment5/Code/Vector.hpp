@@ -3,7 +3,83 @@
 #include <cmath>
 #include <iostream>
 
-class Vector3f
+// Vector3f在支持SSE(x86-64)或NEON(aarch64)时按16字节对齐, 用一个4路寄存器同时计算x, y, z,
+// 第4个分量pad只用于对齐, 不参与任何结果. 编译时定义RAYTRACING_NO_SIMD(CMake选项RAYTRACING_SIMD=OFF)
+// 则退回原来的标量实现. 不开启FMA时两种实现的结果逐位相同
+#if !defined(RAYTRACING_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || defined(__aarch64__))
+#define RAYTRACING_SIMD
+#endif
+
+#ifdef RAYTRACING_SIMD
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#else
+#include <immintrin.h>
+#endif
+
+namespace simd {
+#if defined(__aarch64__)
+typedef float32x4_t float4;
+inline float4 load(const float *p) { return vld1q_f32(p); }
+inline void store(float *p, float4 a) { vst1q_f32(p, a); }
+inline float4 set1(float a) { return vdupq_n_f32(a); }
+inline float4 add(float4 a, float4 b) { return vaddq_f32(a, b); }
+inline float4 sub(float4 a, float4 b) { return vsubq_f32(a, b); }
+inline float4 mul(float4 a, float4 b) { return vmulq_f32(a, b); }
+inline float4 div(float4 a, float4 b) { return vdivq_f32(a, b); }
+inline float4 neg(float4 a) { return vnegq_f32(a); }
+// min(a, b) = b < a ? b : a, max(a, b) = a < b ? b : a, 与std::min/std::max一致
+inline float4 min(float4 a, float4 b) { return vbslq_f32(vcltq_f32(b, a), b, a); }
+inline float4 max(float4 a, float4 b) { return vbslq_f32(vcltq_f32(a, b), b, a); }
+// a * b - c, 单次舍入
+inline float4 fmsub(float4 a, float4 b, float4 c) { return vnegq_f32(vfmsq_f32(c, a, b)); }
+// (y, z, x, pad)
+inline float4 yzx(float4 a)
+{
+    float4 t = vextq_f32(a, a, 1);
+    t = vsetq_lane_f32(vgetq_lane_f32(a, 0), t, 2);
+    return vsetq_lane_f32(vgetq_lane_f32(a, 3), t, 3);
+}
+// x + y + z, 与标量的求和顺序相同
+inline float hsum3(float4 a) { return vgetq_lane_f32(a, 0) + vgetq_lane_f32(a, 1) + vgetq_lane_f32(a, 2); }
+#else
+typedef __m128 float4;
+inline float4 load(const float *p) { return _mm_load_ps(p); }
+inline void store(float *p, float4 a) { _mm_store_ps(p, a); }
+inline float4 set1(float a) { return _mm_set1_ps(a); }
+inline float4 add(float4 a, float4 b) { return _mm_add_ps(a, b); }
+inline float4 sub(float4 a, float4 b) { return _mm_sub_ps(a, b); }
+inline float4 mul(float4 a, float4 b) { return _mm_mul_ps(a, b); }
+inline float4 div(float4 a, float4 b) { return _mm_div_ps(a, b); }
+inline float4 neg(float4 a) { return _mm_xor_ps(a, _mm_set1_ps(-0.f)); }
+// _mm_min_ps(a, b) = a < b ? a : b, 交换参数后与std::min/std::max一致
+inline float4 min(float4 a, float4 b) { return _mm_min_ps(b, a); }
+inline float4 max(float4 a, float4 b) { return _mm_max_ps(b, a); }
+// a * b - c, 有FMA时单次舍入
+inline float4 fmsub(float4 a, float4 b, float4 c)
+{
+#ifdef __FMA__
+    return _mm_fmsub_ps(a, b, c);
+#else
+    return _mm_sub_ps(_mm_mul_ps(a, b), c);
+#endif
+}
+// (y, z, x, pad)
+inline float4 yzx(float4 a) { return _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1)); }
+// x + y + z, 与标量的求和顺序相同
+inline float hsum3(float4 a)
+{
+    float4 s = _mm_add_ss(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 3, 3, 1)));
+    return _mm_cvtss_f32(_mm_add_ss(s, _mm_movehl_ps(a, a)));
+}
+#endif
+}
+#define RAYTRACING_VECTOR_ALIGN alignas(16)
+#else
+#define RAYTRACING_VECTOR_ALIGN
+#endif
+
+class RAYTRACING_VECTOR_ALIGN Vector3f
 {
 public:
     Vector3f()
@@ -21,6 +97,50 @@ public:
         , y(yy)
         , z(zz)
     {}
+#ifdef RAYTRACING_SIMD
+    explicit Vector3f(simd::float4 v)
+    {
+        simd::store(&x, v);
+    }
+    simd::float4 vec() const
+    {
+        return simd::load(&x);
+    }
+    Vector3f operator*(const float& r) const
+    {
+        return Vector3f(simd::mul(vec(), simd::set1(r)));
+    }
+    Vector3f operator/(const float& r) const
+    {
+        return Vector3f(simd::div(vec(), simd::set1(r)));
+    }
+
+    Vector3f operator*(const Vector3f& v) const
+    {
+        return Vector3f(simd::mul(vec(), v.vec()));
+    }
+    Vector3f operator-(const Vector3f& v) const
+    {
+        return Vector3f(simd::sub(vec(), v.vec()));
+    }
+    Vector3f operator+(const Vector3f& v) const
+    {
+        return Vector3f(simd::add(vec(), v.vec()));
+    }
+    Vector3f operator-() const
+    {
+        return Vector3f(simd::neg(vec()));
+    }
+    Vector3f& operator+=(const Vector3f& v)
+    {
+        simd::store(&x, simd::add(vec(), v.vec()));
+        return *this;
+    }
+    friend Vector3f operator*(const float& r, const Vector3f& v)
+    {
+        return Vector3f(simd::mul(v.vec(), simd::set1(r)));
+    }
+#else
     Vector3f operator*(const float& r) const
     {
         return Vector3f(x * r, y * r, z * r);
@@ -55,11 +175,15 @@ public:
     {
         return Vector3f(v.x * r, v.y * r, v.z * r);
     }
+#endif
     friend std::ostream& operator<<(std::ostream& os, const Vector3f& v)
     {
         return os << v.x << ", " << v.y << ", " << v.z;
     }
     float x, y, z;
+#ifdef RAYTRACING_SIMD
+    float pad = 0;
+#endif
 };
 
 class Vector2f
@@ -93,24 +217,35 @@ inline Vector3f lerp(const Vector3f& a, const Vector3f& b, const float& t)
     return a * (1 - t) + b * t;
 }
 
+inline float dotProduct(const Vector3f& a, const Vector3f& b)
+{
+#ifdef RAYTRACING_SIMD
+    return simd::hsum3(simd::mul(a.vec(), b.vec()));
+#else
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+#endif
+}
+
 inline Vector3f normalize(const Vector3f& v)
 {
-    float mag2 = v.x * v.x + v.y * v.y + v.z * v.z;
+    float mag2 = dotProduct(v, v);
     if (mag2 > 0)
     {
         float invMag = 1 / sqrtf(mag2);
-        return Vector3f(v.x * invMag, v.y * invMag, v.z * invMag);
+        return v * invMag;
     }
 
     return v;
 }
 
-inline float dotProduct(const Vector3f& a, const Vector3f& b)
-{
-    return a.x * b.x + a.y * b.y + a.z * b.z;
-}
-
 inline Vector3f crossProduct(const Vector3f& a, const Vector3f& b)
 {
+#ifdef RAYTRACING_SIMD
+    // a x b = (a * b.yzx - a.yzx * b).yzx
+    simd::float4 va = a.vec(), vb = b.vec();
+    simd::float4 t = simd::mul(simd::yzx(va), vb);
+    return Vector3f(simd::yzx(simd::fmsub(va, simd::yzx(vb), t)));
+#else
     return Vector3f(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
-}
\ No newline at end of file
+#endif
+}
@@ -3,37 +3,148 @@
 #include "Triangle.hpp"
 #include "Light.hpp"
 #include "Renderer.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+// 用于测试加速结构的场景: count个随机分布的小球, 下方是约count个三角形组成的起伏地面.
+// lightCount为2时使用与默认场景相同的两个光源, 否则在场景上方均匀放置lightCount个光源
+static void buildBenchmarkScene(Scene& scene, int count, int lightCount)
+{
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> unit(0.f, 1.f);
+    for (int k = 0; k < count; ++k)
+    {
+        Vector3f center(-8 + 16 * unit(rng), -2.5f + 7 * unit(rng), -30 + 22 * unit(rng));
+        auto sphere = std::make_unique<Sphere>(center, 0.15f + 0.25f * unit(rng));
+        sphere->diffuseColor = Vector3f(unit(rng), unit(rng), unit(rng));
+        if (k % 10 == 0)
+            sphere->materialType = REFLECTION;
+        scene.Add(std::move(sphere));
+    }
+
+    // n*n个格子, 每格两个三角形
+    int n = std::max(1, (int)std::lround(std::sqrt(count / 2.0)));
+    std::vector<Vector3f> verts;
+    std::vector<Vector2f> st;
+    std::vector<uint32_t> vertIndex;
+    for (int j = 0; j <= n; ++j)
+        for (int i = 0; i <= n; ++i)
+        {
+            float u = i / (float)n, v = j / (float)n;
+            verts.emplace_back(-12 + 24 * u, -3.5f + 0.3f * std::sin(u * 17) * std::cos(v * 13), -4 - 30 * v);
+            st.emplace_back(u * 4, v * 4);
+        }
+    for (int j = 0; j < n; ++j)
+        for (int i = 0; i < n; ++i)
+        {
+            uint32_t v00 = j * (n + 1) + i, v10 = v00 + 1, v01 = v00 + n + 1, v11 = v01 + 1;
+            vertIndex.insert(vertIndex.end(), {v00, v10, v01, v10, v11, v01});
+        }
+    scene.Add(std::make_unique<MeshTriangle>(verts.data(), vertIndex.data(), 2 * n * n, st.data()));
+    if (lightCount == 2)
+    {
+        scene.Add(std::make_unique<Light>(Vector3f(-20, 70, 20), 0.5));
+        scene.Add(std::make_unique<Light>(Vector3f(30, 50, -12), 0.5));
+        return;
+    }
+    for (int k = 0; k < lightCount; ++k)
+    {
+        float angle = 2 * M_PI * k / lightCount;
+        scene.Add(std::make_unique<Light>(Vector3f(40 * std::cos(angle), 60, -18 + 40 * std::sin(angle)), 1.f / lightCount));
+    }
+}
 
 // In the main function of the program, we create the scene (create objects and lights)
 // as well as set the options for the render (image width and height, maximum recursion
 // depth, field-of-view, etc.). We then call the render function().
-int main()
+int main(int argc, char** argv)
 {
-    Scene scene(1280, 960);
-
-    auto sph1 = std::make_unique<Sphere>(Vector3f(-1, 0, -12), 2);
-    sph1->materialType = DIFFUSE_AND_GLOSSY;
-    sph1->diffuseColor = Vector3f(0.6, 0.7, 0.8);
-
-    auto sph2 = std::make_unique<Sphere>(Vector3f(0.5, -0.5, -8), 1.5);
-    sph2->ior = 1.5;                // 材质属性
-    sph2->materialType = REFLECTION_AND_REFRACTION;
-    // 添加球形物体
-    scene.Add(std::move(sph1));
-    scene.Add(std::move(sph2));
-
-    Vector3f verts[4] = {{-5,-3,-6}, {5,-3,-6}, {5,-3,-16}, {-5,-3,-16}};
-    uint32_t vertIndex[6] = {0, 1, 3, 1, 2, 3};
-    Vector2f st[4] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
-    auto mesh = std::make_unique<MeshTriangle>(verts, vertIndex, 2, st);            
-    mesh->materialType = DIFFUSE_AND_GLOSSY;
-    // 添加三角形物体与光源
-    scene.Add(std::move(mesh));
-    scene.Add(std::make_unique<Light>(Vector3f(-20, 70, 20), 0.5));
-    scene.Add(std::make_unique<Light>(Vector3f(30, 50, -12), 0.5));    
-
     Renderer r;
+    bool useGrid = false;
+    float minWeight = -1;
+    int benchmarkCount = 0, lightCount = 2, width = 1280, height = 960;
+    for (int i = 1; i < argc; ++i)
+    {
+        // --threads N: 渲染线程数, 默认使用全部硬件线程, 1为串行渲染
+        if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+            r.threads = std::atoi(argv[++i]);
+        // --grid: 用均匀网格求交, 默认线性遍历所有物体
+        else if (!strcmp(argv[i], "--grid"))
+            useGrid = true;
+        // --bench N: 改为渲染N个小球与约N个三角形的测试场景
+        else if (!strcmp(argv[i], "--bench") && i + 1 < argc)
+            benchmarkCount = std::atoi(argv[++i]);
+        // --lights N: 测试场景中的光源数
+        else if (!strcmp(argv[i], "--lights") && i + 1 < argc)
+            lightCount = std::max(1, std::atoi(argv[++i]));
+        // --ssaa N: 每个像素均匀采样N*N次
+        else if (!strcmp(argv[i], "--ssaa") && i + 1 < argc)
+            r.ssaa = std::max(1, std::atoi(argv[++i]));
+        // --adaptive L [--aa-threshold T]: 自适应超采样, 最多细分L层(L=2时像素内最密为4x4个小块)
+        else if (!strcmp(argv[i], "--adaptive") && i + 1 < argc)
+            r.adaptiveLevels = std::clamp(std::atoi(argv[++i]), 0, 8);
+        else if (!strcmp(argv[i], "--aa-threshold") && i + 1 < argc)
+            r.adaptiveThreshold = std::atof(argv[++i]);
+        // --min-weight W: 权重低于W的反射/折射光线不再追踪
+        else if (!strcmp(argv[i], "--min-weight") && i + 1 < argc)
+            minWeight = std::atof(argv[++i]);
+        else if (!strcmp(argv[i], "--size") && i + 1 < argc && sscanf(argv[i + 1], "%dx%d", &width, &height) == 2)
+            ++i;
+        else
+        {
+            std::cerr << "usage: " << argv[0] << " [--threads N] [--grid] [--bench N] [--lights N] [--size WxH] [--min-weight W]"
+                      << " [--ssaa N | --adaptive L [--aa-threshold T]]\n";
+            return 1;
+        }
+    }
+
+    Scene scene(width, height);
+    if (minWeight >= 0)
+        scene.minWeight = minWeight;
+    if (benchmarkCount > 0)
+        buildBenchmarkScene(scene, benchmarkCount, lightCount);
+    else
+    {
+        auto sph1 = std::make_unique<Sphere>(Vector3f(-1, 0, -12), 2);
+        sph1->materialType = DIFFUSE_AND_GLOSSY;
+        sph1->diffuseColor = Vector3f(0.6, 0.7, 0.8);
+
+        auto sph2 = std::make_unique<Sphere>(Vector3f(0.5, -0.5, -8), 1.5);
+        sph2->ior = 1.5;                // 材质属性
+        sph2->materialType = REFLECTION_AND_REFRACTION;
+        // 添加球形物体
+        scene.Add(std::move(sph1));
+        scene.Add(std::move(sph2));
+
+        Vector3f verts[4] = {{-5,-3,-6}, {5,-3,-6}, {5,-3,-16}, {-5,-3,-16}};
+        uint32_t vertIndex[6] = {0, 1, 3, 1, 2, 3};
+        Vector2f st[4] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
+        auto mesh = std::make_unique<MeshTriangle>(verts, vertIndex, 2, st);            
+        mesh->materialType = DIFFUSE_AND_GLOSSY;
+        // 添加三角形物体与光源
+        scene.Add(std::move(mesh));
+        scene.Add(std::make_unique<Light>(Vector3f(-20, 70, 20), 0.5));
+        scene.Add(std::make_unique<Light>(Vector3f(30, 50, -12), 0.5));    
+    }
+
+    if (useGrid)
+    {
+        auto buildStart = std::chrono::steady_clock::now();
+        scene.buildGrid();
+        const Grid& grid = *scene.get_grid();
+        std::cout << "Grid: " << grid.resolution[0] << "x" << grid.resolution[1] << "x" << grid.resolution[2] << " cells, "
+                  << grid.primitiveCount << " primitives, " << grid.referenceCount << " references, built in "
+                  << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - buildStart).count()
+                  << " ms\n";
+    }
+
+    auto start = std::chrono::steady_clock::now();
     r.Render(scene);
+    auto stop = std::chrono::steady_clock::now();
+    std::cout << "Render time: " << std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count() << " ms\n";
 
     return 0;
 }
\ No newline at end of file
@@ -1,6 +1,5 @@
 #include <algorithm>
-#include <cassert>
-#include <map>
+#include <chrono>
 #include "BVH.hpp"
 
 BVHAccel::BVHAccel(std::vector<Object *> p, int maxPrimsInNode,
@@ -8,196 +7,240 @@ BVHAccel::BVHAccel(std::vector<Object *> p, int maxPrimsInNode,
     : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod),
       primitives(std::move(p))
 {
-    time_t start, stop;
-    time(&start);
+    auto start = std::chrono::steady_clock::now();
     if (primitives.empty())
         return;
 
-    root = recursiveBuild(primitives);
+    std::vector<BVHPrimitiveInfo> info(primitives.size());
+    std::vector<int> indices(primitives.size());
+    for (size_t i = 0; i < primitives.size(); ++i)
+    {
+        info[i].bounds = primitives[i]->getBounds();
+        info[i].centroid = info[i].bounds.Centroid();
+        indices[i] = i;
+    }
 
-    time(&stop);
-    double diff = difftime(stop, start);
-    int hrs = (int)diff / 3600;
-    int mins = ((int)diff / 60) - (hrs * 60);
-    int secs = (int)diff - (hrs * 3600) - (mins * 60);
+    SplitMethod method = splitMethod;
+    if (method == SplitMethod::AUTO && (int)primitives.size() <= autoNaiveThreshold)
+        method = SplitMethod::NAIVE;
+    if (method == SplitMethod::AUTO)
+    {
+        // 两种方法各建一次, 按SAH代价保留较好的树. 建树在线性时间级别, 比渲染耗时小得多
+        BVHBuildNode *naive = recursiveBuild(info, indices, 0, indices.size(), SplitMethod::NAIVE);
+        BVHBuildNode *sah = recursiveBuild(info, indices, 0, indices.size(), SplitMethod::SAH);
+        Stats naiveStats = computeStats(naive), sahStats = computeStats(sah);
+        bool useSah = sahStats.sahCost <= naiveStats.sahCost;
+        printf("BVH AUTO: NAIVE cost %.2f, SAH cost %.2f -> %s\n", naiveStats.sahCost, sahStats.sahCost,
+               useSah ? "SAH" : "NAIVE");
+        root = useSah ? sah : naive;
+        freeTree(useSah ? naive : sah);
+        stats = useSah ? sahStats : naiveStats;
+        stats.method = useSah ? SplitMethod::SAH : SplitMethod::NAIVE;
+    }
+    else
+    {
+        root = recursiveBuild(info, indices, 0, indices.size(), method);
+        stats = computeStats(root);
+        stats.method = method;
+    }
 
-    printf(
-        "\rBVH/SAH Generation complete: \nTime Taken: %i hrs, %i mins, %i secs\n\n",
-        hrs, mins, secs);
+    auto stop = std::chrono::steady_clock::now();
+    stats.buildMs = std::chrono::duration<double, std::milli>(stop - start).count();
+    printf("\rBVH/SAH Generation complete: \nTime Taken: %.3f ms (%zu primitives)\n", stats.buildMs,
+           primitives.size());
+    printf("BVH quality: method %s, SAH cost %.2f, depth %d, %d interior / %d leaf nodes, %.2f primitives per leaf, "
+           "sibling overlap %.3f\n\n",
+           methodName(stats.method), stats.sahCost, stats.depth, stats.interiorNodes, stats.leafNodes,
+           stats.averageLeafSize, stats.siblingOverlap);
 }
 
-BVHBuildNode *BVHAccel::recursiveBuild(std::vector<Object *> objects)
+BVHAccel::~BVHAccel()
 {
-    BVHBuildNode *node = new BVHBuildNode();
+    freeTree(root);
+}
 
-    // Compute bounds of all primitives in BVH node
-    Bounds3 bounds; // 这个和MeshTriangle中的bounding_box一致 就是求所有格网点构成的最大包围和
-    for (int i = 0; i < objects.size(); ++i)
-        bounds = Union(bounds, objects[i]->getBounds());
+void BVHAccel::freeTree(BVHBuildNode *node)
+{
+    if (!node)
+        return;
+    freeTree(node->left);
+    freeTree(node->right);
+    delete node;
+}
 
-    if (objects.size() == 1)
+const char *BVHAccel::methodName(SplitMethod method)
+{
+    switch (method)
+    {
+        case SplitMethod::NAIVE: return "NAIVE";
+        case SplitMethod::SAH: return "SAH";
+        default: return "AUTO";
+    }
+}
+
+BVHAccel::Stats BVHAccel::computeStats(BVHBuildNode *tree)
+{
+    Stats stats;
+    if (!tree)
+        return stats;
+    double rootArea = tree->bounds.SurfaceArea();
+    double interiorArea = 0, leafArea = 0, overlap = 0;
+    int primitivesInLeaves = 0;
+    // 显式栈遍历, 记录每个节点的深度
+    std::vector<std::pair<BVHBuildNode *, int>> stack{{tree, 0}};
+    while (!stack.empty())
+    {
+        auto [node, depth] = stack.back();
+        stack.pop_back();
+        stats.depth = std::max(stats.depth, depth);
+        if (!node->left && !node->right)
+        {
+            // 叶子节点只存一个物体
+            stats.leafNodes++;
+            primitivesInLeaves++;
+            leafArea += node->bounds.SurfaceArea();
+            continue;
+        }
+        stats.interiorNodes++;
+        double area = node->bounds.SurfaceArea();
+        interiorArea += area;
+        const Bounds3 &l = node->left->bounds, &r = node->right->bounds;
+        Vector3f lo(std::max(l.pMin.x, r.pMin.x), std::max(l.pMin.y, r.pMin.y), std::max(l.pMin.z, r.pMin.z));
+        Vector3f hi(std::min(l.pMax.x, r.pMax.x), std::min(l.pMax.y, r.pMax.y), std::min(l.pMax.z, r.pMax.z));
+        if (lo.x <= hi.x && lo.y <= hi.y && lo.z <= hi.z && area > 0)
+            overlap += Bounds3(lo, hi).SurfaceArea() / area;
+        stack.push_back({node->left, depth + 1});
+        stack.push_back({node->right, depth + 1});
+    }
+    if (rootArea > 0)
+        stats.sahCost = (interiorArea + leafArea) / rootArea;
+    stats.averageLeafSize = stats.leafNodes ? primitivesInLeaves / (double)stats.leafNodes : 0;
+    stats.siblingOverlap = stats.interiorNodes ? overlap / stats.interiorNodes : 0;
+    return stats;
+}
+
+BVHBuildNode *BVHAccel::recursiveBuild(const std::vector<BVHPrimitiveInfo> &info, std::vector<int> &indices,
+                                       int start, int end, SplitMethod method)
+{
+    BVHBuildNode *node = new BVHBuildNode();
+    int count = end - start;
+
+    if (count == 1)
     {
         // Create leaf _BVHBuildNode_
-        node->bounds = objects[0]->getBounds();
-        node->object = objects[0];
+        node->bounds = info[indices[start]].bounds;
+        node->object = primitives[indices[start]];
         node->left = nullptr;
         node->right = nullptr;
         return node;
     }
-    else if (objects.size() == 2)
+    else if (count == 2)
     {
-        node->left = recursiveBuild(std::vector{objects[0]});
-        node->right = recursiveBuild(std::vector{objects[1]});
+        node->left = recursiveBuild(info, indices, start, start + 1, method);
+        node->right = recursiveBuild(info, indices, start + 1, end, method);
 
         node->bounds = Union(node->left->bounds, node->right->bounds);
         return node;
     }
-    else
-    {
-        Bounds3 centroidBounds;
-        for (int i = 0; i < objects.size(); ++i) // 确定划分的分界点位
-            centroidBounds =
-                Union(centroidBounds, objects[i]->getBounds().Centroid());
 
-        std::vector<Object*> leftshapes;
-        std::vector<Object*> rightshapes;
+    Bounds3 centroidBounds;
+    for (int i = start; i < end; ++i) // 确定划分的分界点位
+        centroidBounds = Union(centroidBounds, info[indices[i]].centroid);
 
-        switch (splitMethod)
+    int mid = start + count / 2;
+    switch (method)
+    {
+        case SplitMethod::NAIVE:
         {
-            case SplitMethod::NAIVE:
-            {
-                int dim = centroidBounds.maxExtent(); // 确定当前范围最大的一维 用作划分objects
-                switch (dim)
-                { // 按照Bounds的中心进行排序
-                case 0:
-                    std::sort(objects.begin(), objects.end(), [](auto f1, auto f2)
-                            { return f1->getBounds().Centroid().x <
-                                    f2->getBounds().Centroid().x; });
-                    break;
-                case 1:
-                    std::sort(objects.begin(), objects.end(), [](auto f1, auto f2)
-                            { return f1->getBounds().Centroid().y <
-                                    f2->getBounds().Centroid().y; });
-                    break;
-                case 2:
-                    std::sort(objects.begin(), objects.end(), [](auto f1, auto f2)
-                            { return f1->getBounds().Centroid().z <
-                                    f2->getBounds().Centroid().z; });
-                    break;
-                }
-
-                auto beginning = objects.begin();
-                auto middling = objects.begin() + (objects.size() / 2);
-                auto ending = objects.end();
+            // 确定当前范围最大的一维, 按照Bounds的中心把前一半与后一半分开(只需部分排序)
+            int dim = centroidBounds.maxExtent();
+            std::nth_element(&indices[start], &indices[mid], &indices[0] + end, [&](int a, int b) {
+                return info[a].centroid[dim] < info[b].centroid[dim];
+            });
+            break;
+        }
+        case SplitMethod::SAH:
+        {
+            // 当前所有物体中心点包围盒的表面积
+            float nArea = centroidBounds.SurfaceArea();
 
-                leftshapes = std::vector<Object *>(beginning, middling);
-                rightshapes = std::vector<Object *>(middling, ending);
+            // 以此遍历三个轴, 每个轴把中心点范围均匀分成12个桶, 在桶之间找代价最小的分界
+            // 目的是划分后，使两边objects包围和的总表面积尽量相等 S(A)/S(C)+S(B)/S(C)越小（越接近S(C)-父节点表面积）
+            constexpr int bucketCount = 12;
+            // 与centroidBounds.Offset(centroid)[axis]的计算相同, 只算需要的一个分量
+            auto bucketOf = [&](int prim, int axis) {
+                float lo = centroidBounds.pMin[axis], hi = centroidBounds.pMax[axis];
+                float offset = info[prim].centroid[axis] - lo;
+                if (hi > lo)
+                    offset /= hi - lo;
+                // 是根据每个objects中心点至整体包围和pMin的位置来 均匀 划分 12分份
+                int bid = bucketCount * offset;
+                return std::min(bid, bucketCount - 1);
+            };
 
-                break;
-            }
-            case SplitMethod::SAH:
+            int minCostCoor = 0;
+            int mincostIndex = 0;
+            float minCost = std::numeric_limits<float>::infinity();
+            for (int axis = 0; axis < 3; axis++)
             {
-                Bounds3 nBounds;
-                for (int i = 0; i < objects.size(); ++i)
-                    nBounds = Union(nBounds, objects[i]->getBounds());
-                // 当前所有物体包围和立方体的表面积
-                float nArea = centroidBounds.SurfaceArea();
-
-                int minCostCoor = 0;
-                int mincostIndex = 0;
-                float minCost = std::numeric_limits<float>::infinity();
-                std::map<int, std::map<int, int>> indexMap;
-                
-                // 以此遍历三个轴
-                // 目的是划分后，使两边objects包围和的总表面积尽量相等 S(A)/S(C)+S(B)/S(C)越小（越接近S(C)-父节点表面积）
-                for(int i = 0; i < 3; i++)
+                Bounds3 boundsBuckets[bucketCount];
+                int countBucket[bucketCount] = {};
+                for (int i = start; i < end; ++i)
                 {
-                    // 将当前区域划分为12个子区域，在这12个子区域内分为两块
-                    int bucketCount = 12;
-                    std::vector<Bounds3> boundsBuckets;
-                    std::vector<int> countBucket;
-                    for(int j = 0; j < bucketCount; j++)
-                    {
-                        boundsBuckets.push_back(Bounds3());
-                        countBucket.push_back(0);
-                    }
-
-                    std::map<int, int> objMap;
-
-                    // 依次取所有的objects
-                    for(int j = 0; j < objects.size(); j++)
-                    {
-                        // tmp相当于objects[j]包围和中心点在centroidBounds中的位置(长宽高比例)
-                        Vector3f tmp = centroidBounds.Offset(objects[j]->getBounds().Centroid());
-                        // 是根据每个objects中心点至整体包围和pMin的位置来 均匀 划分 12分份
-                        int bid =  bucketCount * tmp[i];
-                        if(bid > bucketCount - 1)
-                        {
-                            bid = bucketCount - 1;
-                        }
-                        Bounds3 b = boundsBuckets[bid];
-                        b = Union(b, objects[j]->getBounds().Centroid());
-                        boundsBuckets[bid] = b;
-                        countBucket[bid] = countBucket[bid] + 1;
-                        objMap.insert(std::make_pair(j, bid));
-                    }
-
-                    indexMap.insert(std::make_pair(i, objMap));
-
-                    for(int j = 1; j < boundsBuckets.size(); j++)
-                    {
-                        Bounds3 A;
-                        Bounds3 B;
-                        int countA = 0;
-                        int countB = 0;
-                        for(int k = 0; k < j; k++)
-                        {
-                            A = Union(A, boundsBuckets[k]);
-                            countA += countBucket[k];
-                        }
-
-                        for(int k = j; k < boundsBuckets.size(); k++)
-                        {
-                            B = Union(B, boundsBuckets[k]);
-                            countB += countBucket[k];
-                        }
-
-                        float cost = 1 + (countA * A.SurfaceArea() + countB * B.SurfaceArea()) / nArea;
-
-                        if(cost < minCost)
-                        {
-                            minCost = cost;
-                            mincostIndex = j;
-                            minCostCoor = i;
-                        }
-                    }
+                    int bid = bucketOf(indices[i], axis);
+                    boundsBuckets[bid] = Union(boundsBuckets[bid], info[indices[i]].centroid);
+                    countBucket[bid]++;
                 }
 
-                for(int i = 0; i < objects.size(); i++)
+                // 从右往左累积得到每个分界右侧的包围盒与数量, 再从左往右扫描一遍计算代价
+                Bounds3 suffixBounds[bucketCount];
+                int suffixCount[bucketCount];
+                suffixBounds[bucketCount - 1] = boundsBuckets[bucketCount - 1];
+                suffixCount[bucketCount - 1] = countBucket[bucketCount - 1];
+                for (int j = bucketCount - 2; j > 0; --j)
                 {
-                    if(indexMap[minCostCoor][i] < mincostIndex)
-                    {
-                        leftshapes.push_back(objects[i]);
-                    }
-                    else
+                    suffixBounds[j] = Union(boundsBuckets[j], suffixBounds[j + 1]);
+                    suffixCount[j] = countBucket[j] + suffixCount[j + 1];
+                }
+                Bounds3 A;
+                int countA = 0;
+                for (int j = 1; j < bucketCount; j++)
+                {
+                    A = Union(A, boundsBuckets[j - 1]);
+                    countA += countBucket[j - 1];
+                    const Bounds3 &B = suffixBounds[j];
+                    int countB = suffixCount[j];
+
+                    float cost = 1 + (countA * A.SurfaceArea() + countB * B.SurfaceArea()) / nArea;
+
+                    if (cost < minCost)
                     {
-                        rightshapes.push_back(objects[i]);
+                        minCost = cost;
+                        mincostIndex = j;
+                        minCostCoor = axis;
                     }
                 }
-                break;
             }
-            
-            default:
-                break;
-        }
-        assert(objects.size() == (leftshapes.size() + rightshapes.size()));
 
-        node->left = recursiveBuild(leftshapes);
-        node->right = recursiveBuild(rightshapes);
+            // 在indices中原地划分: 桶编号小于分界的放到前面
+            int *pmid = std::partition(&indices[start], &indices[0] + end,
+                                       [&](int prim) { return bucketOf(prim, minCostCoor) < mincostIndex; });
+            mid = pmid - &indices[0];
+            // 所有中心点落在同一侧时(如中心点重合)退化为对半划分
+            if (mid == start || mid == end)
+                mid = start + count / 2;
+            break;
+        }
 
-        node->bounds = Union(node->left->bounds, node->right->bounds);
+        default:
+            break;
     }
 
+    node->left = recursiveBuild(info, indices, start, mid, method);
+    node->right = recursiveBuild(info, indices, mid, end, method);
+
+    node->bounds = Union(node->left->bounds, node->right->bounds);
+
     return node;
 }
 
@@ -17,7 +17,11 @@
 
 struct BVHBuildNode;
 // BVHAccel Forward Declarations
-struct BVHPrimitiveInfo;
+// 构建时每个图元的包围盒与中心, 只计算一次
+struct BVHPrimitiveInfo {
+    Bounds3 bounds;
+    Vector3f centroid;
+};
 
 // BVHAccel Declarations
 inline int leafNodes, totalLeafNodes, totalPrimitives, interiorNodes;
@@ -25,25 +29,50 @@ class BVHAccel {
 
 public:
     // BVHAccel Public Types
-    enum class SplitMethod { NAIVE, SAH };
+    // AUTO: 图元较少时直接用NAIVE; 否则NAIVE与SAH各建一次, 保留SAH代价较低的树
+    enum class SplitMethod { NAIVE, SAH, AUTO };
+
+    // 建树后的质量统计. sahCost按遍历一个节点代价为1, 与一个图元求交代价为1计算:
+    // sum(内部节点表面积)/根节点表面积 + sum(叶子表面积*叶子图元数)/根节点表面积, 越小说明平均每条光线要做的测试越少
+    struct Stats {
+        SplitMethod method = SplitMethod::NAIVE;   // 实际使用的划分方法(AUTO时为选中的方法)
+        double buildMs = 0;
+        double sahCost = 0;
+        int depth = 0;
+        int interiorNodes = 0;
+        int leafNodes = 0;
+        double averageLeafSize = 0;
+        double siblingOverlap = 0;  // 各内部节点左右子节点包围盒交集的表面积与该节点表面积之比的平均值
+    };
+
+    // AUTO模式下图元数不超过该值时只用NAIVE建树
+    static constexpr int autoNaiveThreshold = 64;
 
     // BVHAccel Public Methods 一个包围和节点中最多多一个物体
-    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::SAH);
+    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::AUTO);
     Bounds3 WorldBound() const;
     ~BVHAccel();
 
     Intersection Intersect(const Ray &ray) const;
     Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
     bool IntersectP(const Ray &ray) const;
-    BVHBuildNode* root;
+    const Stats& getStats() const { return stats; }
+    static const char* methodName(SplitMethod method);
+    BVHBuildNode* root = nullptr;
 
     // BVHAccel Private Methods
-    BVHBuildNode* recursiveBuild(std::vector<Object*>objects);
+    // 对indices[start, end)中的图元建树, 划分时原地重排indices, 不复制图元数组
+    BVHBuildNode* recursiveBuild(const std::vector<BVHPrimitiveInfo>& info, std::vector<int>& indices, int start,
+                                 int end, SplitMethod method);
+    // 计算以node为根的树的统计量(不含method与buildMs)
+    static Stats computeStats(BVHBuildNode* node);
+    static void freeTree(BVHBuildNode* node);
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
     const SplitMethod splitMethod;
     std::vector<Object*> primitives;
+    Stats stats;
 };
 
 struct BVHBuildNode {
@@ -0,0 +1,64 @@
+//
+// SAH k-d tree over the scene primitives, an alternative to the scene BVH.
+//
+
+#ifndef RAYTRACING_KDTREE_H
+#define RAYTRACING_KDTREE_H
+
+#include <cstdint>
+#include <vector>
+#include "Object.hpp"
+#include "Ray.hpp"
+#include "Bounds3.hpp"
+#include "Intersection.hpp"
+
+// k-d树: 用SAH选择的轴对齐平面递归划分空间, 跨越划分平面的图元同时放入两侧.
+// 遍历时用栈按光线经过的顺序访问叶子, 找到的交点比下一个节点的入口更近时即停止,
+// 不需要像BVH那样继续检查重叠的兄弟节点
+class KDTreeAccel
+{
+public:
+    // 由物体展开(Object::getPrimitives)得到的图元构建, 网格中的三角形直接作为k-d树的图元
+    explicit KDTreeAccel(const std::vector<Object*>& objects);
+
+    // 与BVHAccel::Intersect相同, 叶子中的图元用getIntersection求交, 返回最近的交点
+    Intersection Intersect(const Ray& ray) const;
+
+    Bounds3 WorldBound() const { return bounds; }
+    // 节点与叶子图元列表占用的字节数
+    size_t NodeMemory() const;
+
+    // 构建统计
+    double buildMs = 0;
+    size_t primitiveCount = 0;
+    size_t references = 0;      // 所有叶子中图元引用的总数
+    int leaves = 0, emptyLeaves = 0, depth = 0;
+
+private:
+    // 8字节的节点, 子节点按深度优先顺序存放: 内部节点的below子节点紧随其后, above子节点由下标给出
+    struct Node {
+        union {
+            float split;        // 内部节点: 划分平面的坐标
+            uint32_t primOffset;  // 叶子: 图元在leafPrims中的起始下标
+        };
+        uint32_t bits;          // 低2位为划分轴(0/1/2), 3表示叶子; 其余位为above子节点的下标或叶子的图元数
+
+        bool isLeaf() const { return (bits & 3) == 3; }
+        int axis() const { return bits & 3; }
+        uint32_t aboveChild() const { return bits >> 2; }
+        uint32_t primCount() const { return bits >> 2; }
+    };
+
+    struct BoundEdge;
+    void buildNode(const Bounds3& nodeBounds, std::vector<uint32_t>& prims, int depthLeft, int badRefines);
+    void makeLeaf(const std::vector<uint32_t>& prims);
+
+    std::vector<Object*> primitives;
+    std::vector<Bounds3> primBounds;
+    std::vector<Node> nodes;
+    std::vector<Object*> leafPrims;
+    Bounds3 bounds;
+    int maxDepth = 0;
+};
+
+#endif //RAYTRACING_KDTREE_H
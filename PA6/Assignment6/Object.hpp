@@ -5,6 +5,7 @@
 #ifndef RAYTRACING_OBJECT_H
 #define RAYTRACING_OBJECT_H
 
+#include <vector>
 #include "Vector.hpp"
 #include "global.hpp"
 #include "Bounds3.hpp"
@@ -22,6 +23,8 @@ public:
     virtual void getSurfaceProperties(const Vector3f &, const Vector3f &, const uint32_t &, const Vector2f &, Vector3f &, Vector2f &) const = 0;
     virtual Vector3f evalDiffuseColor(const Vector2f &) const =0;
     virtual Bounds3 getBounds()=0;
+    // 展开为加速结构使用的图元, 默认物体本身就是一个图元
+    virtual void getPrimitives(std::vector<Object*>& prims) { prims.push_back(this); }
 };
 
 
@@ -5,13 +5,20 @@
 #include "Scene.hpp"
 
 
-void Scene::buildBVH() {
+void Scene::buildBVH(Accelerator accelerator) {
+    if (accelerator == Accelerator::KDTREE) {
+        printf(" - Generating k-d tree/SAH...\n\n");
+        this->kdtree = new KDTreeAccel(objects);
+        return;
+    }
     printf(" - Generating BVH/SAH...\n\n");
-    this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::SAH);     // 该scene的bvh在这里和Meshtriangle中的bvh一致(场景中的物体只有Meshtriangle)
+    this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::AUTO);     // 该scene的bvh在这里和Meshtriangle中的bvh一致(场景中的物体只有Meshtriangle)
 }
 
 Intersection Scene::intersect(const Ray &ray) const
 {
+    if (this->kdtree)
+        return this->kdtree->Intersect(ray);
     return this->bvh->Intersect(ray);
 }
 
@@ -130,7 +137,7 @@ Vector3f Scene::castRay(const Ray &ray, int depth) const
                         Object *shadowHitObject = nullptr;
                         float tNearShadow = kInfinity;
                         // is the point in shadow, and is the nearest occluding object closer to the object than the light itself?
-                        bool inShadow = bvh->Intersect(Ray(shadowPointOrig, lightDir)).happened;
+                        bool inShadow = intersect(Ray(shadowPointOrig, lightDir)).happened;
                         lightAmt += (1 - inShadow) * get_lights()[i]->intensity * LdotN;
                         Vector3f reflectionDirection = reflect(-lightDir, N);
                         specularColor += powf(std::max(0.f, -dotProduct(reflectionDirection, ray.direction)),
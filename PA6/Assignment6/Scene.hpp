@@ -10,6 +10,7 @@
 #include "Light.hpp"
 #include "AreaLight.hpp"
 #include "BVH.hpp"
+#include "KDTree.hpp"
 #include "Ray.hpp"
 
 
@@ -32,8 +33,11 @@ public:
     const std::vector<Object*>& get_objects() const { return objects; }
     const std::vector<std::unique_ptr<Light> >&  get_lights() const { return lights; }
     Intersection intersect(const Ray& ray) const;
-    BVHAccel *bvh;
-    void buildBVH();
+    BVHAccel *bvh = nullptr;
+    KDTreeAccel *kdtree = nullptr;
+    // 场景使用的加速结构: BVH建在物体上(网格内部再用自己的BVH); KDTREE把网格展开为三角形建一棵k-d树
+    enum class Accelerator { BVH, KDTREE };
+    void buildBVH(Accelerator accelerator = Accelerator::BVH);
     Vector3f castRay(const Ray &ray, int depth) const;
     bool trace(const Ray &ray, const std::vector<Object*> &objects, float &tNear, uint32_t &index, Object **hitObject);
     std::tuple<Vector3f, Vector3f> HandleAreaLight(const AreaLight &light, const Vector3f &hitPoint, const Vector3f &N,
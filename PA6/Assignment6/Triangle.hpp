@@ -153,6 +153,13 @@ public:
 
     Bounds3 getBounds() { return bounding_box; }
 
+    // 网格中的三角形直接作为图元, 不经过网格自己的BVH
+    void getPrimitives(std::vector<Object*>& prims)
+    {
+        for (auto& tri : triangles)
+            prims.push_back(&tri);
+    }
+
     void getSurfaceProperties(const Vector3f& P, const Vector3f& I,
                               const uint32_t& index, const Vector2f& uv,
                               Vector3f& N, Vector2f& st) const
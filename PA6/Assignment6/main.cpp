@@ -4,6 +4,7 @@
 #include "Vector.hpp"
 #include "global.hpp"
 #include <chrono>
+#include <cstring>
 
 // In the main function of the program, we create the scene (create objects and
 // lights) as well as set the options for the render (image width and height,
@@ -11,6 +12,20 @@
 // function().
 int main(int argc, char** argv)
 {
+    // --accel bvh|kdtree 选择场景的加速结构, 默认为BVH
+    Scene::Accelerator accelerator = Scene::Accelerator::BVH;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--accel") && i + 1 < argc) {
+            ++i;
+            if (!strcmp(argv[i], "kdtree"))
+                accelerator = Scene::Accelerator::KDTREE;
+            else if (strcmp(argv[i], "bvh")) {
+                std::cerr << "unknown accelerator: " << argv[i] << " (bvh|kdtree)\n";
+                return 1;
+            }
+        }
+    }
+
     Scene scene(1280, 960);
 
     // 创建MeshTriangle过程中 默认生成了BVHAccel
@@ -21,7 +36,7 @@ int main(int argc, char** argv)
     scene.Add(std::make_unique<Light>(Vector3f(20, 70, 20), 2));
 
     // 根据scene中的场景生成包围和BVHAccel（与上面MeshTriangle重复？单个物体对象确实是一样的，若考虑多个objects加入scene就需要重新计算BVH）
-    scene.buildBVH();
+    scene.buildBVH(accelerator);
 
     Renderer r;
 
@@ -1,28 +1,280 @@
 #include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <type_traits>
+#include <unordered_map>
 #include "BVH.hpp"
+#include "PrimitiveDispatch.hpp"
+#include "RayCounters.hpp"
+#include "Trace.hpp"
+
+namespace {
+
+// SAH代价中遍历一个内部节点与求交一个图元的相对代价
+constexpr float kTraversalCost = 1.f;
+constexpr float kIntersectCost = 1.f;
+// 物体划分的桶数与空间划分的分箱数
+constexpr int kObjectBuckets = 12;
+constexpr int kSpatialBins = 16;
+// 物体划分两侧包围盒的重叠面积超过根节点表面积的kSpatialAlpha倍时才尝试空间划分
+constexpr float kSpatialAlpha = 1e-5f;
+// 空间划分允许的额外引用数占图元数的比例
+constexpr float kDuplicationBudget = 0.3f;
+
+// 量化坐标的步长: 取 (hi - lo) / levels 并向上微调, 保证 lo + levels * step >= hi, 即量化值levels解码后不小于hi
+inline float quantStep(float lo, float hi, float levels)
+{
+    float step = (hi - lo) * (1.f / levels);
+    while (lo + levels * step < hi)
+        step = std::nextafter(step, std::numeric_limits<float>::infinity());
+    return step;
+}
+
+// 把子节点包围盒child编码为相对box的量化坐标, 返回解码后的包围盒(包含child)
+template <typename Q>
+Bounds3 encodeBounds(const Bounds3 &child, const Bounds3 &box, Q lo[3], Q hi[3])
+{
+    Bounds3 ret;
+    if constexpr (std::is_same_v<Q, float>) {
+        for (int a = 0; a < 3; ++a) {
+            lo[a] = child.pMin[a];
+            hi[a] = child.pMax[a];
+        }
+        return child;
+    }
+    else {
+        const int levels = std::numeric_limits<Q>::max();
+        for (int a = 0; a < 3; ++a) {
+            float base = box.pMin[a], step = quantStep(base, box.pMax[a], levels);
+            int qlo = 0, qhi = levels;
+            if (step > 0) {
+                qlo = std::clamp((int)std::floor((child.pMin[a] - base) / step), 0, levels);
+                qhi = std::clamp((int)std::ceil((child.pMax[a] - base) / step), 0, levels);
+                // 除法的舍入可能使边界向内偏一格, 按解码结果再向外修正
+                while (qlo > 0 && base + qlo * step > child.pMin[a])
+                    --qlo;
+                while (qhi < levels && base + qhi * step < child.pMax[a])
+                    ++qhi;
+            }
+            lo[a] = qlo;
+            hi[a] = qhi;
+            ret.pMin[a] = base + qlo * step;
+            ret.pMax[a] = base + qhi * step;
+        }
+        return ret;
+    }
+}
+
+// 解码节点两个子节点的包围盒(pMin.xyz, pMax.xyz), box为本节点解码后的包围盒. 与encodeBounds使用相同的计算
+template <typename Q>
+void decodeChildren(const CompactNode<Q> &node, const float box[6], float child[2][6])
+{
+    for (int a = 0; a < 3; ++a) {
+        if constexpr (std::is_same_v<Q, float>) {
+            for (int k = 0; k < 2; ++k) {
+                child[k][a] = node.lo[k][a];
+                child[k][a + 3] = node.hi[k][a];
+            }
+        }
+        else {
+            float base = box[a], step = quantStep(base, box[a + 3], std::numeric_limits<Q>::max());
+            for (int k = 0; k < 2; ++k) {
+                child[k][a] = base + node.lo[k][a] * step;
+                child[k][a + 3] = base + node.hi[k][a] * step;
+            }
+        }
+    }
+}
+
+// 与Bounds3::IntersectP相同的slab测试, 包围盒为(pMin.xyz, pMax.xyz), 相交时tEnter为进入距离
+inline bool slabTest(const float b[6], const Ray &ray, const Vector3f &invDir, const std::array<int, 3> &dirIsNeg,
+                     float tMin, float tMax, float &tEnter)
+{
+    float t0[3], t1[3];
+    for (int a = 0; a < 3; ++a) {
+        float n = (b[a] - ray.origin[a]) * invDir[a], f = (b[a + 3] - ray.origin[a]) * invDir[a];
+        t0[a] = dirIsNeg[a] ? n : f;
+        t1[a] = dirIsNeg[a] ? f : n;
+    }
+    tEnter = std::max(t0[0], std::max(t0[1], t0[2]));
+    float tExit = std::min(t1[0], std::min(t1[1], t1[2]));
+    return tEnter <= tExit && tExit >= tMin && tEnter <= tMax;
+}
+
+// 紧凑布局遍历栈的元素: 节点, 进入其包围盒的距离与解码后的包围盒
+struct CompactEntry {
+    uint32_t code;
+    float tEnter;
+    float box[6];
+};
+
+constexpr uint32_t kLeafFlag = 0x80000000u;
+// 每访问一个内部节点弹出一项并压入至多两个子节点, 深度为D的树遍历时栈中最多D+1项.
+// compact()拒绝更深的树, 遍历时仍检查, 栈满时改用指针树完成这条光线
+constexpr int kCompactStackSize = 256;
+
+bool isValid(const Bounds3 &b)
+{
+    return b.pMin.x <= b.pMax.x && b.pMin.y <= b.pMax.y && b.pMin.z <= b.pMax.z;
+}
+
+// 两个包围盒的交集, 不相交时结果为空(isValid为false). Bounds3::Intersect会重新排序两个角点, 不能用于判断空集
+Bounds3 overlap(const Bounds3 &a, const Bounds3 &b)
+{
+    Bounds3 ret;
+    ret.pMin = Vector3f::Max(a.pMin, b.pMin);
+    ret.pMax = Vector3f::Min(a.pMax, b.pMax);
+    return ret;
+}
+
+float surfaceArea(const Bounds3 &b) { return isValid(b) ? b.SurfaceArea() : 0; }
+
+}
 
 BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
-                   SplitMethod splitMethod)
+                   SplitMethod splitMethod, bool verbose)
     : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod),
       primitives(std::move(p))
 {
-    time_t start, stop;
-    time(&start);
+    auto start = std::chrono::steady_clock::now();
     if (primitives.empty())
         return;
 
-    root = recursiveBuild(primitives);
+    build();
+
+    auto stop = std::chrono::steady_clock::now();
+    if (verbose)
+        printf(
+            "\rBVH Generation complete: \nTime Taken: %.3f ms, %zu primitives, %d references, SAH cost %.2f\n\n",
+            std::chrono::duration<double, std::milli>(stop - start).count(), primitives.size(),
+            splitMethod == SplitMethod::NAIVE ? (int)primitives.size() : numReferences, buildCost);
+}
+
+void BVHAccel::build()
+{
+    TRACE_SCOPE("BVH build", primitives.size());
+    if (splitMethod == SplitMethod::NAIVE) {
+        root = recursiveBuild(primitives);
+    } else {
+        orderedPrims.clear();
+        std::vector<Reference> refs;
+        Bounds3 bounds;
+        for (auto object : primitives) {
+            refs.push_back({object, object->getBounds()});
+            bounds = Union(bounds, refs.back().bounds);
+        }
+        numReferences = refs.size();
+        maxReferences = splitMethod == SplitMethod::SBVH ? refs.size() * (1 + kDuplicationBudget) : refs.size();
+        root = recursiveBuildSAH(std::move(refs), bounds);
+
+        // 图元被引用了几次, 采样时每个引用的面积就按几分之一计
+        std::unordered_map<Object*, int> refCount;
+        for (auto object : orderedPrims)
+            ++refCount[object];
+        orderedPrimWeights.resize(orderedPrims.size());
+        for (size_t i = 0; i < orderedPrims.size(); ++i)
+            orderedPrimWeights[i] = 1.f / refCount[orderedPrims[i]];
+        computeArea(root);
+    }
+    buildCost = SAHCost();
+}
+
+BVHAccel::~BVHAccel()
+{
+    freeNodes(root);
+}
+
+void BVHAccel::freeNodes(BVHBuildNode* node)
+{
+    if (!node)
+        return;
+    freeNodes(node->left);
+    freeNodes(node->right);
+    delete node;
+}
+
+void BVHAccel::Rebuild()
+{
+    freeNodes(root);
+    root = nullptr;
+    if (!primitives.empty())
+        build();
+    compact();
+}
+
+void BVHAccel::Refit()
+{
+    TRACE_SCOPE("BVH refit");
+    if (root)
+        refitNode(root);
+    compact();
+}
+
+void BVHAccel::refitNode(BVHBuildNode* node)
+{
+    if (node->left == nullptr && node->right == nullptr) {
+        if (node->nPrimitives == 0) {
+            node->bounds = node->object->getBounds();
+            node->area = node->object->getArea();
+            return;
+        }
+        // SBVH的裁剪包围盒在图元移动后失效, 退回到图元完整的包围盒
+        node->bounds = Bounds3();
+        for (int i = node->firstPrimOffset; i < node->firstPrimOffset + node->nPrimitives; ++i)
+            node->bounds = Union(node->bounds, orderedPrims[i]->getBounds());
+        computeArea(node);
+        return;
+    }
+    refitNode(node->left);
+    refitNode(node->right);
+    node->bounds = Union(node->left->bounds, node->right->bounds);
+    node->area = node->left->area + node->right->area;
+}
+
+float BVHAccel::computeArea(BVHBuildNode* node)
+{
+    if (node->left == nullptr && node->right == nullptr) {
+        node->area = 0;
+        for (int i = node->firstPrimOffset; i < node->firstPrimOffset + node->nPrimitives; ++i)
+            node->area += orderedPrims[i]->getArea() * orderedPrimWeights[i];
+        return node->area;
+    }
+    node->area = computeArea(node->left) + computeArea(node->right);
+    return node->area;
+}
 
-    time(&stop);
-    double diff = difftime(stop, start);
-    int hrs = (int)diff / 3600;
-    int mins = ((int)diff / 60) - (hrs * 60);
-    int secs = (int)diff - (hrs * 3600) - (mins * 60);
+bool BVHAccel::Update(float rebuildThreshold)
+{
+    if (root)
+        refitNode(root);
+    if (root && SAHCost() > buildCost * rebuildThreshold) {
+        Rebuild();
+        return true;
+    }
+    compact();
+    return false;
+}
 
-    printf(
-        "\rBVH Generation complete: \nTime Taken: %i hrs, %i mins, %i secs\n\n",
-        hrs, mins, secs);
+float BVHAccel::SAHCost() const
+{
+    if (!root)
+        return 0;
+    float rootArea = root->bounds.SurfaceArea();
+    if (rootArea <= 0)
+        return 0;
+    // 遍历到某个节点的概率近似为其表面积与根节点表面积之比, 每个节点做一次包围盒测试, 叶子节点再做一次图元求交
+    float cost = 0;
+    std::vector<const BVHBuildNode*> stack{root};
+    while (!stack.empty()) {
+        const BVHBuildNode* node = stack.back();
+        stack.pop_back();
+        bool leaf = node->left == nullptr && node->right == nullptr;
+        cost += node->bounds.SurfaceArea() / rootArea *
+                (leaf ? kTraversalCost + kIntersectCost * std::max(1, node->nPrimitives) : kTraversalCost);
+        if (node->left) stack.push_back(node->left);
+        if (node->right) stack.push_back(node->right);
+    }
+    return cost;
 }
 
 BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
@@ -97,45 +349,580 @@ BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
     return node;
 }
 
+BVHBuildNode* BVHAccel::createLeaf(const std::vector<Reference>& refs)
+{
+    BVHBuildNode* node = new BVHBuildNode();
+    node->firstPrimOffset = orderedPrims.size();
+    node->nPrimitives = refs.size();
+    for (auto& ref : refs) {
+        node->bounds = Union(node->bounds, ref.bounds);
+        orderedPrims.push_back(ref.object);
+    }
+    if (refs.size() == 1)
+        node->object = refs[0].object;
+    return node;
+}
+
+BVHBuildNode* BVHAccel::recursiveBuildSAH(std::vector<Reference> refs, const Bounds3& rootBounds)
+{
+    int n = refs.size();
+    if (n <= maxPrimsInNode)
+        return createLeaf(refs);
+
+    Bounds3 bounds, centroidBounds;
+    for (auto& ref : refs) {
+        bounds = Union(bounds, ref.bounds);
+        centroidBounds = Union(centroidBounds, ref.bounds.Centroid());
+    }
+    float invArea = 1.f / std::max(surfaceArea(bounds), 1e-12f);
+
+    // 物体划分: 按引用包围盒的中心分桶, 在每个轴上扫描桶的边界求SAH代价最小的划分
+    float objectCost = std::numeric_limits<float>::infinity();
+    int objectAxis = -1, objectBucket = 0;
+    Bounds3 objectLeft, objectRight;
+    for (int axis = 0; axis < 3; ++axis) {
+        if (centroidBounds.pMax[axis] <= centroidBounds.pMin[axis])
+            continue;
+        Bounds3 bucketBounds[kObjectBuckets];
+        int bucketCount[kObjectBuckets] = {};
+        for (auto& ref : refs) {
+            int b = std::min(kObjectBuckets - 1, (int)(kObjectBuckets * centroidBounds.Offset(ref.bounds.Centroid())[axis]));
+            bucketBounds[b] = Union(bucketBounds[b], ref.bounds);
+            ++bucketCount[b];
+        }
+        // rightBounds[k]为桶[k, kObjectBuckets)的包围盒
+        Bounds3 rightBounds[kObjectBuckets];
+        int rightCount[kObjectBuckets];
+        Bounds3 acc;
+        int count = 0;
+        for (int k = kObjectBuckets - 1; k > 0; --k) {
+            acc = Union(acc, bucketBounds[k]);
+            count += bucketCount[k];
+            rightBounds[k] = acc;
+            rightCount[k] = count;
+        }
+        acc = Bounds3();
+        count = 0;
+        for (int split = 1; split < kObjectBuckets; ++split) {
+            acc = Union(acc, bucketBounds[split - 1]);
+            count += bucketCount[split - 1];
+            if (count == 0 || rightCount[split] == 0)
+                continue;
+            float cost = kTraversalCost + kIntersectCost * invArea *
+                         (count * surfaceArea(acc) + rightCount[split] * surfaceArea(rightBounds[split]));
+            if (cost < objectCost) {
+                objectCost = cost;
+                objectAxis = axis;
+                objectBucket = split;
+                objectLeft = acc;
+                objectRight = rightBounds[split];
+            }
+        }
+    }
+
+    // 空间划分: 物体划分的两侧重叠较多且引用数还有余量时, 把节点包围盒沿各轴等分成若干箱,
+    // 图元裁剪进它跨越的每个箱, 划分平面左侧的引用数按进入的箱计, 右侧按离开的箱计
+    float spatialCost = std::numeric_limits<float>::infinity();
+    int spatialAxis = -1;
+    float spatialPlane = 0;
+    if (splitMethod == SplitMethod::SBVH && numReferences < maxReferences &&
+        (objectAxis < 0 || surfaceArea(overlap(objectLeft, objectRight)) > kSpatialAlpha * surfaceArea(rootBounds))) {
+        for (int axis = 0; axis < 3; ++axis) {
+            float lo = bounds.pMin[axis], extent = bounds.pMax[axis] - lo;
+            if (extent <= 0)
+                continue;
+            float binWidth = extent / kSpatialBins;
+            auto binOf = [&](float x) { return std::max(0, std::min(kSpatialBins - 1, (int)((x - lo) / binWidth))); };
+            Bounds3 binBounds[kSpatialBins];
+            int enter[kSpatialBins] = {}, exit[kSpatialBins] = {};
+            for (auto& ref : refs) {
+                int b0 = binOf(ref.bounds.pMin[axis]), b1 = binOf(ref.bounds.pMax[axis]);
+                ++enter[b0];
+                ++exit[b1];
+                for (int b = b0; b <= b1; ++b) {
+                    Bounds3 bin = bounds;
+                    bin.pMin[axis] = b == 0 ? lo : lo + b * binWidth;
+                    bin.pMax[axis] = b == kSpatialBins - 1 ? bounds.pMax[axis] : lo + (b + 1) * binWidth;
+                    Bounds3 clipped = ref.object->getClippedBounds(overlap(ref.bounds, bin));
+                    if (isValid(clipped))
+                        binBounds[b] = Union(binBounds[b], clipped);
+                }
+            }
+            Bounds3 rightBounds[kSpatialBins];
+            int rightCount[kSpatialBins];
+            Bounds3 acc;
+            int count = 0;
+            for (int k = kSpatialBins - 1; k > 0; --k) {
+                acc = Union(acc, binBounds[k]);
+                count += exit[k];
+                rightBounds[k] = acc;
+                rightCount[k] = count;
+            }
+            acc = Bounds3();
+            count = 0;
+            for (int split = 1; split < kSpatialBins; ++split) {
+                acc = Union(acc, binBounds[split - 1]);
+                count += enter[split - 1];
+                // 两侧都必须比当前节点少, 否则可能无限划分下去
+                if (count == 0 || rightCount[split] == 0 || count == n || rightCount[split] == n ||
+                    numReferences + count + rightCount[split] - n > maxReferences)
+                    continue;
+                float cost = kTraversalCost + kIntersectCost * invArea *
+                             (count * surfaceArea(acc) + rightCount[split] * surfaceArea(rightBounds[split]));
+                if (cost < spatialCost) {
+                    spatialCost = cost;
+                    spatialAxis = axis;
+                    spatialPlane = lo + split * binWidth;
+                }
+            }
+        }
+    }
+
+    std::vector<Reference> leftRefs, rightRefs;
+    if (spatialAxis >= 0 && spatialCost < objectCost) {
+        for (auto& ref : refs) {
+            if (ref.bounds.pMax[spatialAxis] <= spatialPlane) {
+                leftRefs.push_back(ref);
+            } else if (ref.bounds.pMin[spatialAxis] >= spatialPlane) {
+                rightRefs.push_back(ref);
+            } else {
+                Bounds3 leftBox = ref.bounds, rightBox = ref.bounds;
+                leftBox.pMax[spatialAxis] = spatialPlane;
+                rightBox.pMin[spatialAxis] = spatialPlane;
+                Bounds3 l = ref.object->getClippedBounds(leftBox);
+                Bounds3 r = ref.object->getClippedBounds(rightBox);
+                if (isValid(l)) leftRefs.push_back({ref.object, l});
+                if (isValid(r)) rightRefs.push_back({ref.object, r});
+            }
+        }
+        // 裁剪后只剩一侧(图元恰好贴着划分平面)时仍可能无法划分, 此时改用物体划分
+        if (leftRefs.empty() || rightRefs.empty() || (int)leftRefs.size() == n || (int)rightRefs.size() == n) {
+            leftRefs.clear();
+            rightRefs.clear();
+        } else {
+            numReferences += leftRefs.size() + rightRefs.size() - n;
+        }
+    }
+    if (leftRefs.empty() && objectAxis >= 0) {
+        for (auto& ref : refs) {
+            int b = std::min(kObjectBuckets - 1, (int)(kObjectBuckets * centroidBounds.Offset(ref.bounds.Centroid())[objectAxis]));
+            (b < objectBucket ? leftRefs : rightRefs).push_back(ref);
+        }
+    }
+    if (leftRefs.empty()) {
+        // 所有引用的中心重合, 按数量对半划分
+        leftRefs.assign(refs.begin(), refs.begin() + n / 2);
+        rightRefs.assign(refs.begin() + n / 2, refs.end());
+    }
+    refs.clear();
+    refs.shrink_to_fit();
+
+    BVHBuildNode* node = new BVHBuildNode();
+    node->left = recursiveBuildSAH(std::move(leftRefs), rootBounds);
+    node->right = recursiveBuildSAH(std::move(rightRefs), rootBounds);
+    node->bounds = Union(node->left->bounds, node->right->bounds);
+    return node;
+}
+
 Intersection BVHAccel::Intersect(const Ray& ray) const
 {
-    Intersection isect;
+    HitRecord hit;
+    if (!IntersectHit(ray, hit))
+        return {};
+    // 只对最终的最近交点计算位置、法线与材质
+    return hit.prim->evalHit(ray, hit);
+}
+
+bool BVHAccel::IntersectHit(const Ray& ray, HitRecord& hit) const
+{
     if (!root)
-        return isect;
-    isect = BVHAccel::getIntersection(root, ray);
-    return isect;
+        return false;
+    if (ray.t_max < hit.t)
+        hit.t = ray.t_max;
+    Object* prim = hit.prim;
+    switch (layout) {
+        case NodeLayout::FLOAT: traverseCompact(nodesFloat, ray, hit); break;
+        case NodeLayout::QUANT16: traverseCompact(nodes16, ray, hit); break;
+        case NodeLayout::QUANT8: traverseCompact(nodes8, ray, hit); break;
+        default: {
+            // 光线的倒数方向与符号在整次遍历中只计算一次
+            Vector3f invDir = Vector3f{1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z};
+            std::array<int, 3> dirIsNeg = {ray.direction.x > 0, ray.direction.y > 0, ray.direction.z > 0};
+            getIntersection(root, ray, invDir, dirIsNeg, hit);
+        }
+    }
+    return hit.prim != prim;
+}
+
+void BVHAccel::getIntersection(const BVHBuildNode* node, const Ray& ray, const Vector3f& invDir,
+                               const std::array<int, 3>& dirIsNeg, HitRecord& hit) const
+{
+    // 先判断与当前的包围和节点是否相交, 比已有交点更远的节点同样跳过 相交则递归对当前节点的左右节点求交
+    ++rayCounters.nodes;
+    if (!node->bounds.IntersectP(ray, invDir, dirIsNeg, ray.t_min, hit.t))
+        return;
+
+    if (node->left == nullptr && node->right == nullptr)
+    {
+        // 如果是叶子节点中的BVH相交，调用BVH节点Node中的物体进行求交，更近时更新hit
+        if (node->object)
+            intersectPrimitive(node->object, ray, hit);
+        else
+            for (int i = node->firstPrimOffset; i < node->firstPrimOffset + node->nPrimitives; ++i)
+                intersectPrimitive(orderedPrims[i], ray, hit);
+        return;
+    }
+
+    getIntersection(node->left, ray, invDir, dirIsNeg, hit);
+    getIntersection(node->right, ray, invDir, dirIsNeg, hit);
 }
 
-Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
+bool BVHAccel::IntersectP(const Ray& ray) const
 {
-    // TODO Traverse the BVH to find intersection
+    if (!root)
+        return false;
+    switch (layout) {
+        case NodeLayout::FLOAT: return occludedCompact(nodesFloat, ray);
+        case NodeLayout::QUANT16: return occludedCompact(nodes16, ray);
+        case NodeLayout::QUANT8: return occludedCompact(nodes8, ray);
+        default: break;
+    }
     Vector3f invDir = Vector3f{1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z};
     std::array<int, 3> dirIsNeg = {ray.direction.x > 0, ray.direction.y > 0, ray.direction.z > 0};
+    return getOcclusion(root, ray, invDir, dirIsNeg);
+}
+
+bool BVHAccel::getOcclusion(const BVHBuildNode* node, const Ray& ray, const Vector3f& invDir,
+                            const std::array<int, 3>& dirIsNeg) const
+{
+    ++rayCounters.nodes;
+    if (!node->bounds.IntersectP(ray, invDir, dirIsNeg, ray.t_min, ray.t_max))
+        return false;
 
-    // 先判断与当前的包围和节点是否相交 不相交则返回 相交则递归对当前节点的左右节点求交
-    if (!node->bounds.IntersectP(ray, invDir, dirIsNeg))
+    if (node->left == nullptr && node->right == nullptr)
     {
-        return {};
+        if (node->object)
+            return occludedPrimitive(node->object, ray);
+        for (int i = node->firstPrimOffset; i < node->firstPrimOffset + node->nPrimitives; ++i)
+            if (occludedPrimitive(orderedPrims[i], ray))
+                return true;
+        return false;
+    }
+
+    return getOcclusion(node->left, ray, invDir, dirIsNeg) || getOcclusion(node->right, ray, invDir, dirIsNeg);
+}
+
+void BVHAccel::IntersectBatch(const Ray* rays, HitRecord* hits, int count, bool stream) const
+{
+    assert(count <= kStreamSize);
+    if (!stream) {
+        for (int i = 0; i < count; ++i) {
+            hits[i] = HitRecord();
+            IntersectHit(rays[i], hits[i]);
+        }
+        return;
+    }
+
+    RayStream s;
+    s.rays = rays;
+    s.hits = hits;
+    s.anyHit = false;
+    int active[kStreamSize];
+    for (int i = 0; i < count; ++i) {
+        const Vector3f &d = rays[i].direction;
+        s.invDir[i] = Vector3f{1.0f / d.x, 1.0f / d.y, 1.0f / d.z};
+        s.dirIsNeg[i] = {d.x > 0, d.y > 0, d.z > 0};
+        hits[i] = HitRecord();
+        hits[i].t = std::min(hits[i].t, (float)rays[i].t_max);
+        active[i] = i;
     }
+    if (root && count > 0)
+        getIntersectionStream(root, s, active, count);
+}
+
+void BVHAccel::OccludedBatch(const Ray* rays, uint8_t* occluded, int count, bool stream) const
+{
+    assert(count <= kStreamSize);
+    if (!stream) {
+        for (int i = 0; i < count; ++i)
+            occluded[i] = IntersectP(rays[i]);
+        return;
+    }
+
+    HitRecord hits[kStreamSize];
+    RayStream s;
+    s.rays = rays;
+    s.hits = hits;
+    s.anyHit = true;
+    int active[kStreamSize];
+    for (int i = 0; i < count; ++i) {
+        const Vector3f &d = rays[i].direction;
+        s.invDir[i] = Vector3f{1.0f / d.x, 1.0f / d.y, 1.0f / d.z};
+        s.dirIsNeg[i] = {d.x > 0, d.y > 0, d.z > 0};
+        hits[i].t = std::min(hits[i].t, (float)rays[i].t_max);
+        active[i] = i;
+    }
+    if (root && count > 0)
+        getIntersectionStream(root, s, active, count);
+    for (int i = 0; i < count; ++i)
+        occluded[i] = hits[i].t == -std::numeric_limits<float>::infinity();
+}
+
+void BVHAccel::getIntersectionStream(const BVHBuildNode* node, RayStream& s, const int* active, int n) const
+{
+    // 只保留与节点包围盒相交且交点不比当前最近交点远的光线; 被遮挡的光线t为-inf, 不会再通过测试
+    int alive[kStreamSize];
+    int m = 0;
+    for (int i = 0; i < n; ++i) {
+        int r = active[i];
+        if (node->bounds.IntersectP(s.rays[r], s.invDir[r], s.dirIsNeg[r], s.rays[r].t_min, s.hits[r].t))
+            alive[m++] = r;
+    }
+    if (m == 0)
+        return;
 
     if (node->left == nullptr && node->right == nullptr)
     {
-        // 如果是叶子节点中的BVH相交，调用BVH节点Node中的物体进行求交，计算光线与物体的交点hitPoint
-        return node->object->getIntersection(ray);
+        for (int i = 0; i < m; ++i) {
+            int r = alive[i];
+            const Ray &ray = s.rays[r];
+            if (s.anyHit) {
+                // 遮挡查询的光线范围为(t_min, t_max)
+                bool hit = false;
+                if (node->object)
+                    hit = occludedPrimitive(node->object, ray);
+                else
+                    for (int k = node->firstPrimOffset; !hit && k < node->firstPrimOffset + node->nPrimitives; ++k)
+                        hit = occludedPrimitive(orderedPrims[k], ray);
+                if (hit)
+                    s.hits[r].t = -std::numeric_limits<float>::infinity();
+            }
+            else if (node->object)
+                intersectPrimitive(node->object, ray, s.hits[r]);
+            else
+                for (int k = node->firstPrimOffset; k < node->firstPrimOffset + node->nPrimitives; ++k)
+                    intersectPrimitive(orderedPrims[k], ray, s.hits[r]);
+        }
+        return;
+    }
+
+    getIntersectionStream(node->left, s, alive, m);
+    getIntersectionStream(node->right, s, alive, m);
+}
+
+void BVHAccel::SetLayout(NodeLayout newLayout)
+{
+    layout = newLayout;
+    compact();
+}
+
+size_t BVHAccel::NodeMemory() const
+{
+    size_t prims = compactPrims.size() * sizeof(Object*) + compactLeaves.size() * sizeof(compactLeaves[0]);
+    switch (layout) {
+        case NodeLayout::FLOAT: return nodesFloat.size() * sizeof(nodesFloat[0]) + prims;
+        case NodeLayout::QUANT16: return nodes16.size() * sizeof(nodes16[0]) + prims;
+        case NodeLayout::QUANT8: return nodes8.size() * sizeof(nodes8[0]) + prims;
+        default: break;
+    }
+    size_t nodes = 0;
+    std::vector<const BVHBuildNode*> stack;
+    if (root)
+        stack.push_back(root);
+    while (!stack.empty()) {
+        const BVHBuildNode* node = stack.back();
+        stack.pop_back();
+        ++nodes;
+        if (node->left)
+            stack.push_back(node->left);
+        if (node->right)
+            stack.push_back(node->right);
     }
+    return nodes * sizeof(BVHBuildNode) + orderedPrims.size() * (sizeof(Object*) + sizeof(float));
+}
 
-    Intersection h1 = getIntersection(node->left, ray);
-    Intersection h2 = getIntersection(node->right, ray);
+int BVHAccel::Depth() const
+{
+    int depth = 0;
+    std::vector<std::pair<const BVHBuildNode*, int>> stack;
+    if (root)
+        stack.emplace_back(root, 0);
+    while (!stack.empty()) {
+        const BVHBuildNode* node = stack.back().first;
+        int d = stack.back().second;
+        stack.pop_back();
+        depth = std::max(depth, d);
+        if (node->left)
+            stack.emplace_back(node->left, d + 1);
+        if (node->right)
+            stack.emplace_back(node->right, d + 1);
+    }
+    return depth;
+}
 
-    return h1.distance < h2.distance ? h1 : h2;
+void BVHAccel::compact()
+{
+    TRACE_SCOPE("BVH compact");
+    nodesFloat.clear();
+    nodes16.clear();
+    nodes8.clear();
+    compactLeaves.clear();
+    compactPrims.clear();
+    if (!root || layout == NodeLayout::TREE)
+        return;
+    int depth = Depth();
+    if (depth + 1 > kCompactStackSize) {
+        fprintf(stderr, "BVH depth %d exceeds the %d-entry traversal stack of the flat layouts, using the tree layout\n",
+                depth, kCompactStackSize);
+        layout = NodeLayout::TREE;
+        return;
+    }
+    compactBounds = root->bounds;
+    switch (layout) {
+        case NodeLayout::FLOAT: compactRoot = compactNode(root, compactBounds, nodesFloat); break;
+        case NodeLayout::QUANT16: compactRoot = compactNode(root, compactBounds, nodes16); break;
+        default: compactRoot = compactNode(root, compactBounds, nodes8); break;
+    }
 }
 
+template <typename Q>
+uint32_t BVHAccel::compactNode(const BVHBuildNode* node, const Bounds3& box, std::vector<CompactNode<Q>>& nodes)
+{
+    if (node->left == nullptr && node->right == nullptr) {
+        uint32_t leaf = compactLeaves.size();
+        if (node->object) {
+            compactLeaves.emplace_back(compactPrims.size(), 1);
+            compactPrims.push_back(node->object);
+        } else {
+            compactLeaves.emplace_back(compactPrims.size(), node->nPrimitives);
+            compactPrims.insert(compactPrims.end(), orderedPrims.begin() + node->firstPrimOffset,
+                                orderedPrims.begin() + node->firstPrimOffset + node->nPrimitives);
+        }
+        return kLeafFlag | leaf;
+    }
+
+    // 子节点相对本节点解码后的包围盒量化, 子节点的子节点再相对子节点解码后的包围盒量化
+    uint32_t index = nodes.size();
+    nodes.emplace_back();
+    const BVHBuildNode* children[2] = {node->left, node->right};
+    Bounds3 childBox[2];
+    for (int k = 0; k < 2; ++k)
+        childBox[k] = encodeBounds(children[k]->bounds, box, nodes[index].lo[k], nodes[index].hi[k]);
+    for (int k = 0; k < 2; ++k) {
+        uint32_t child = compactNode(children[k], childBox[k], nodes);
+        nodes[index].child[k] = child;
+    }
+    return index;
+}
+
+template <typename Q>
+void BVHAccel::traverseCompact(const std::vector<CompactNode<Q>>& nodes, const Ray& ray, HitRecord& hit) const
+{
+    Vector3f invDir = Vector3f{1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z};
+    std::array<int, 3> dirIsNeg = {ray.direction.x > 0, ray.direction.y > 0, ray.direction.z > 0};
+    CompactEntry stack[kCompactStackSize];
+    int top = 0;
+    CompactEntry& root = stack[top++];
+    root.code = compactRoot;
+    for (int a = 0; a < 3; ++a) {
+        root.box[a] = compactBounds.pMin[a];
+        root.box[a + 3] = compactBounds.pMax[a];
+    }
+    ++rayCounters.nodes;
+    if (!slabTest(root.box, ray, invDir, dirIsNeg, ray.t_min, hit.t, root.tEnter))
+        return;
+    while (top > 0) {
+        const CompactEntry& e = stack[--top];
+        // 入栈之后找到了更近的交点
+        if (e.tEnter > hit.t)
+            continue;
+        if (e.code & kLeafFlag) {
+            const auto& leaf = compactLeaves[e.code & ~kLeafFlag];
+            for (uint32_t i = leaf.first; i < leaf.first + leaf.second; ++i)
+                intersectPrimitive(compactPrims[i], ray, hit);
+            continue;
+        }
+        // 在父节点处解码并测试两个子节点, 只压入相交的子节点, 较近的后压入以先访问
+        const CompactNode<Q>& node = nodes[e.code];
+        float child[2][6], t[2];
+        decodeChildren(node, e.box, child);
+        rayCounters.nodes += 2;
+        bool h0 = slabTest(child[0], ray, invDir, dirIsNeg, ray.t_min, hit.t, t[0]);
+        bool h1 = slabTest(child[1], ray, invDir, dirIsNeg, ray.t_min, hit.t, t[1]);
+        if (top + 2 > kCompactStackSize) {
+            // 栈不够时用指针树重新遍历, 已找到的交点作为最大距离
+            getIntersection(this->root, ray, invDir, dirIsNeg, hit);
+            return;
+        }
+        int first = h0 && h1 && t[1] < t[0] ? 0 : 1;
+        for (int k : {first, 1 - first}) {
+            if (!(k ? h1 : h0))
+                continue;
+            CompactEntry& c = stack[top++];
+            c.code = node.child[k];
+            c.tEnter = t[k];
+            std::copy(child[k], child[k] + 6, c.box);
+        }
+    }
+}
+
+template <typename Q>
+bool BVHAccel::occludedCompact(const std::vector<CompactNode<Q>>& nodes, const Ray& ray) const
+{
+    Vector3f invDir = Vector3f{1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z};
+    std::array<int, 3> dirIsNeg = {ray.direction.x > 0, ray.direction.y > 0, ray.direction.z > 0};
+    CompactEntry stack[kCompactStackSize];
+    int top = 0;
+    CompactEntry& root = stack[top++];
+    root.code = compactRoot;
+    for (int a = 0; a < 3; ++a) {
+        root.box[a] = compactBounds.pMin[a];
+        root.box[a + 3] = compactBounds.pMax[a];
+    }
+    ++rayCounters.nodes;
+    if (!slabTest(root.box, ray, invDir, dirIsNeg, ray.t_min, ray.t_max, root.tEnter))
+        return false;
+    while (top > 0) {
+        const CompactEntry& e = stack[--top];
+        if (e.code & kLeafFlag) {
+            const auto& leaf = compactLeaves[e.code & ~kLeafFlag];
+            for (uint32_t i = leaf.first; i < leaf.first + leaf.second; ++i)
+                if (occludedPrimitive(compactPrims[i], ray))
+                    return true;
+            continue;
+        }
+        const CompactNode<Q>& node = nodes[e.code];
+        float child[2][6], t[2];
+        decodeChildren(node, e.box, child);
+        rayCounters.nodes += 2;
+        if (top + 2 > kCompactStackSize)
+            return getOcclusion(this->root, ray, invDir, dirIsNeg);
+        for (int k = 0; k < 2; ++k) {
+            if (!slabTest(child[k], ray, invDir, dirIsNeg, ray.t_min, ray.t_max, t[k]))
+                continue;
+            CompactEntry& c = stack[top++];
+            c.code = node.child[k];
+            c.tEnter = t[k];
+            std::copy(child[k], child[k] + 6, c.box);
+        }
+    }
+    return false;
+}
 
 void BVHAccel::getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf){
     // 达到BVH的叶子节点，对BVH中的物体进行采样
     if(node->left == nullptr || node->right == nullptr){
-        node->object->Sample(pos, pdf);
-        pdf *= node->area;
+        // SBVH的叶子可能有多个图元, 按各自(除以引用次数后的)面积再选一次
+        Object* object = node->object;
+        for (int i = node->firstPrimOffset; !object && i < node->firstPrimOffset + node->nPrimitives; ++i) {
+            float a = orderedPrims[i]->getArea() * orderedPrimWeights[i];
+            if (p < a || i == node->firstPrimOffset + node->nPrimitives - 1)
+                object = orderedPrims[i];
+            p -= a;
+        }
+        // 图元可能被多个叶子引用, 其被选中的总概率为自身面积占比, 因此pdf按图元的完整面积计算
+        object->Sample(pos, pdf);
+        pdf *= object->getArea();
         return;
     }
     if(p < node->left->area) getSample(node->left, p, pos, pdf);
@@ -16,6 +16,14 @@
 #include "Vector.hpp"
 
 struct BVHBuildNode;
+
+// 扁平化BVH的内部节点: 保存两个子节点的包围盒与下标. Q为float时直接保存坐标;
+// Q为uint16_t/uint8_t时保存相对本节点(解码后)包围盒的量化坐标, 下界向下取整、上界向上取整, 解码后的包围盒总是包含原包围盒
+template <typename Q>
+struct CompactNode {
+    Q lo[2][3], hi[2][3];
+    uint32_t child[2];  // 最高位为1时表示叶子, 其余位为compactLeaves中的下标
+};
 // BVHAccel Forward Declarations
 struct BVHPrimitiveInfo;
 
@@ -25,25 +33,106 @@ class BVHAccel {
 
 public:
     // BVHAccel Public Types
-    enum class SplitMethod { NAIVE, SAH };
+    // NAIVE: 沿最长轴按图元数量对半划分; SAH: 分桶SAH的物体划分;
+    // SBVH: 在SAH物体划分之外尝试空间划分, 把跨越划分平面的图元裁剪后同时放入两侧(Stich et al. 2009)
+    enum class SplitMethod { NAIVE, SAH, SBVH };
+    // 遍历使用的节点布局: TREE为构建得到的指针树(每个节点保存完整精度的Bounds3);
+    // FLOAT/QUANT16/QUANT8为扁平数组, 内部节点保存两个子节点的float/16位/8位包围盒, 叶子不单独占用节点
+    enum class NodeLayout { TREE, FLOAT, QUANT16, QUANT8 };
 
     // BVHAccel Public Methods
-    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
+    // verbose为false时不输出构建信息(如out-of-core网格按需载入簇时)
+    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE,
+             bool verbose = true);
     Bounds3 WorldBound() const;
     ~BVHAccel();
 
     Intersection Intersect(const Ray &ray) const;
-    Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
+    // 只求最近交点的参数, 不计算交点的表面属性; hit.t作为初始的最大距离, 命中更近的图元时返回true
+    bool IntersectHit(const Ray &ray, HitRecord &hit) const;
+    void getIntersection(const BVHBuildNode* node, const Ray& ray, const Vector3f& invDir,
+                         const std::array<int, 3>& dirIsNeg, HitRecord& hit) const;
+    // 遮挡查询: (ray.t_min, ray.t_max)内有任意交点时返回true, 找到第一个交点即停止遍历
     bool IntersectP(const Ray &ray) const;
-    BVHBuildNode* root;
+    // 批量查询rays[0, count): IntersectBatch求最近交点(hits[i].prim为nullptr表示未命中), OccludedBatch只判断是否被遮挡.
+    // stream为true时一组光线一起遍历BVH, 每个节点只访问一次并对其中仍然可能命中的光线做包围盒测试,
+    // 否则逐条光线遍历. 两种方式的结果完全相同, count不能超过kStreamSize
+    static constexpr int kStreamSize = 64;
+    void IntersectBatch(const Ray *rays, HitRecord *hits, int count, bool stream = true) const;
+    void OccludedBatch(const Ray *rays, uint8_t *occluded, int count, bool stream = true) const;
+    BVHBuildNode* root = nullptr;
+
+    // 图元移动后自底向上重新计算节点包围盒(O(n)), 树的结构不变
+    void Refit();
+    // 重新构建整棵树
+    void Rebuild();
+    // Refit之后若SAH代价相对构建时增长超过rebuildThreshold倍则Rebuild, 返回是否重建
+    bool Update(float rebuildThreshold);
+    // 树的SAH代价(遍历与求交的代价均记为1, 按相对根节点的表面积加权)
+    float SAHCost() const;
+    float buildCost = 0;    // 最近一次构建时的SAH代价
+
+    // 切换遍历使用的节点布局, 非TREE布局在每次Refit/Rebuild后重新生成.
+    // 树太深时(见Depth)退回TREE布局, 调用后用Layout()确认实际使用的布局
+    void SetLayout(NodeLayout layout);
+    NodeLayout Layout() const { return layout; }
+    // 当前布局下节点及叶子图元列表占用的字节数
+    size_t NodeMemory() const;
+    // 树的深度(根节点为0). 紧凑布局的遍历栈只能容纳有限深度, 更深的树保持TREE布局
+    int Depth() const;
 
     // BVHAccel Private Methods
+    void build();
     BVHBuildNode* recursiveBuild(std::vector<Object*>objects);
+    // SAH/SBVH构建用的图元引用, SBVH中一个图元可以有多个引用, bounds为裁剪后的包围盒
+    struct Reference {
+        Object* object;
+        Bounds3 bounds;
+    };
+    BVHBuildNode* recursiveBuildSAH(std::vector<Reference> refs, const Bounds3& rootBounds);
+    BVHBuildNode* createLeaf(const std::vector<Reference>& refs);
+    float computeArea(BVHBuildNode* node);
+    void refitNode(BVHBuildNode* node);
+    void freeNodes(BVHBuildNode* node);
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
     const SplitMethod splitMethod;
     std::vector<Object*> primitives;
+    // SAH/SBVH的叶子节点引用orderedPrims[firstPrimOffset, firstPrimOffset + nPrimitives)
+    // orderedPrimWeights为对应图元引用次数的倒数, 使按面积采样时重复引用的图元总概率不变
+    std::vector<Object*> orderedPrims;
+    std::vector<float> orderedPrimWeights;
+    int maxReferences = 0;  // SBVH引用总数的上限, 超出后只做物体划分
+    int numReferences = 0;
+
+    // 成组遍历的光线及其预先计算的倒数方向, hits[i].t为光线i当前的最远距离(遮挡查询中被遮挡后置为-inf)
+    struct RayStream {
+        const Ray *rays;
+        HitRecord *hits;
+        Vector3f invDir[kStreamSize];
+        std::array<int, 3> dirIsNeg[kStreamSize];
+        bool anyHit;
+    };
+    void getIntersectionStream(const BVHBuildNode* node, RayStream& stream, const int* active, int n) const;
+    bool getOcclusion(const BVHBuildNode* node, const Ray& ray, const Vector3f& invDir,
+                      const std::array<int, 3>& dirIsNeg) const;
+
+    NodeLayout layout = NodeLayout::TREE;
+    std::vector<CompactNode<float>> nodesFloat;
+    std::vector<CompactNode<uint16_t>> nodes16;
+    std::vector<CompactNode<uint8_t>> nodes8;
+    std::vector<std::pair<uint32_t, uint32_t>> compactLeaves;  // 叶子图元在compactPrims中的[起始, 数量)
+    std::vector<Object*> compactPrims;
+    uint32_t compactRoot = 0;   // 根节点(可能本身就是叶子)
+    Bounds3 compactBounds;      // 根节点的包围盒
+    void compact();
+    template <typename Q>
+    uint32_t compactNode(const BVHBuildNode* node, const Bounds3& box, std::vector<CompactNode<Q>>& nodes);
+    template <typename Q>
+    void traverseCompact(const std::vector<CompactNode<Q>>& nodes, const Ray& ray, HitRecord& hit) const;
+    template <typename Q>
+    bool occludedCompact(const std::vector<CompactNode<Q>>& nodes, const Ray& ray) const;
 
     void getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf);
     void Sample(Intersection &pos, float &pdf);
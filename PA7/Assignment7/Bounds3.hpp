@@ -6,6 +6,7 @@
 #define RAYTRACING_BOUNDS3_H
 #include "Ray.hpp"
 #include "Vector.hpp"
+#include <algorithm>
 #include <limits>
 #include <array>
 
@@ -84,14 +85,17 @@ class Bounds3
         return (i == 0) ? pMin : pMax;
     }
 
+    // 光线与包围盒的交区间和[tMin, tMax]有重叠时返回true, tMax可取当前最近交点的距离来剔除更远的节点
     inline bool IntersectP(const Ray& ray, const Vector3f& invDir,
-                           const std::array<int, 3>& dirisNeg) const;
+                           const std::array<int, 3>& dirisNeg,
+                           float tMin = 0, float tMax = std::numeric_limits<float>::infinity()) const;
 };
 
 
 
 inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir,
-                                const std::array<int, 3>& dirIsNeg) const
+                                const std::array<int, 3>& dirIsNeg,
+                                float tMin, float tMax) const
 {
     // invDir: ray direction(x,y,z), invDir=(1.0/x,1.0/y,1.0/z), use this because Multiply is faster that Division
     // dirIsNeg: ray direction(x,y,z), dirIsNeg=[int(x>0),int(y>0),int(z>0)], use this to simplify your logic
@@ -129,7 +133,7 @@ inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir,
     float t_enter = std::max(tx_min, std::max(ty_min, tz_min));
     float t_exit = std::min(tx_max, std::min(ty_max, tz_max));
 
-    if(t_enter <= t_exit && t_exit >= 0)
+    if(t_enter <= t_exit && t_exit >= tMin && t_enter <= tMax)
     {
         return true;
     }
@@ -152,4 +156,43 @@ inline Bounds3 Union(const Bounds3& b, const Vector3f& p)
     return ret;
 }
 
+// 用box的6个平面依次裁剪凸多边形(Sutherland-Hodgman, 最多4个顶点), 返回剩余多边形的包围盒
+inline Bounds3 ClipPolygonBounds(const Vector3f* vertices, int n, const Bounds3& box)
+{
+    Vector3f poly[2][10];
+    std::copy(vertices, vertices + n, poly[0]);
+    int cur = 0;
+    for (int axis = 0; axis < 3 && n > 0; ++axis) {
+        for (int side = 0; side < 2 && n > 0; ++side) {
+            float plane = side == 0 ? box.pMin[axis] : box.pMax[axis];
+            float sign = side == 0 ? 1 : -1;   // 保留sign * (p[axis] - plane) >= 0的部分
+            const Vector3f *in = poly[cur];
+            Vector3f *out = poly[1 - cur];
+            int m = 0;
+            for (int i = 0; i < n; ++i) {
+                const Vector3f &a = in[i], &b = in[(i + 1) % n];
+                float da = sign * (a[axis] - plane), db = sign * (b[axis] - plane);
+                if (da >= 0)
+                    out[m++] = a;
+                if ((da >= 0) != (db >= 0)) {
+                    Vector3f p = lerp(a, b, da / (da - db));
+                    p[axis] = plane;
+                    out[m++] = p;
+                }
+            }
+            n = m;
+            cur = 1 - cur;
+        }
+    }
+    Bounds3 ret;
+    for (int i = 0; i < n; ++i)
+        ret = Union(ret, poly[cur][i]);
+    // 消除插值误差, 保证结果不超出box
+    if (n > 0) {
+        ret.pMin = Vector3f::Max(ret.pMin, box.pMin);
+        ret.pMax = Vector3f::Min(ret.pMax, box.pMax);
+    }
+    return ret;
+}
+
 #endif // RAYTRACING_BOUNDS3_H
@@ -0,0 +1,37 @@
+//
+// Pinhole camera described by position, look-at point and field of view.
+//
+
+#ifndef RAYTRACING_CAMERA_H
+#define RAYTRACING_CAMERA_H
+
+#include "Vector.hpp"
+
+// 针孔相机. 默认参数即原先写死在Renderer中的cornell box视角(位于z=-800处朝+z方向看)
+struct Camera
+{
+    Vector3f position = Vector3f(278, 273, -800);
+    Vector3f lookAt = Vector3f(278, 273, 0);
+    Vector3f up = Vector3f(0, 1, 0);
+    float fov = 40;     // 竖直方向的视场角(度)
+
+    // 由position, lookAt, up计算相机坐标系, 在生成光线前调用
+    void computeBasis()
+    {
+        forward = normalize(lookAt - position);
+        right = normalize(crossProduct(forward, up));
+        upward = crossProduct(right, forward);
+    }
+
+    // (x, y)为成像平面(距相机1)上的坐标, y朝上, 返回对应的光线方向.
+    // 默认视角下forward=(0,0,1), right=(-1,0,0), upward=(0,1,0), 结果与原来的normalize(Vector3f(-x, y, 1))相同
+    Vector3f direction(float x, float y) const
+    {
+        return normalize(right * x + upward * y + forward);
+    }
+
+private:
+    Vector3f forward, right, upward;
+};
+
+#endif //RAYTRACING_CAMERA_H
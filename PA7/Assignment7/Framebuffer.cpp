@@ -0,0 +1,110 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include "Framebuffer.hpp"
+#include "global.hpp"
+
+static const char kAccumMagic[8] = {'P', 'A', '7', 'A', 'C', 'C', '0', '1'};
+
+bool AccumulationBuffer::merge(const AccumulationBuffer &other)
+{
+    if (other.width != width || other.height != height)
+        return false;
+    for (size_t i = 0; i < sum.size(); ++i) {
+        sum[i] += other.sum[i];
+        count[i] += other.count[i];
+    }
+    return true;
+}
+
+std::vector<Vector3f> AccumulationBuffer::resolve() const
+{
+    std::vector<Vector3f> framebuffer(sum.size());
+    for (size_t i = 0; i < sum.size(); ++i)
+        if (count[i] > 0)
+            framebuffer[i] = sum[i] / (float)count[i];
+    return framebuffer;
+}
+
+bool AccumulationBuffer::save(const std::string &path) const
+{
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (!fp)
+        return false;
+    int32_t size[2] = {width, height};
+    bool ok = fwrite(kAccumMagic, 1, 8, fp) == 8 && fwrite(size, sizeof(int32_t), 2, fp) == 2;
+    for (size_t i = 0; ok && i < sum.size(); ++i) {
+        float rgb[3] = {sum[i].x, sum[i].y, sum[i].z};
+        ok = fwrite(rgb, sizeof(float), 3, fp) == 3 && fwrite(&count[i], sizeof(uint32_t), 1, fp) == 1;
+    }
+    return fclose(fp) == 0 && ok;
+}
+
+bool AccumulationBuffer::load(const std::string &path)
+{
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (!fp)
+        return false;
+    char magic[8];
+    int32_t size[2];
+    if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, kAccumMagic, 8) != 0 ||
+        fread(size, sizeof(int32_t), 2, fp) != 2 || size[0] < 0 || size[1] < 0) {
+        fclose(fp);
+        return false;
+    }
+    *this = AccumulationBuffer(size[0], size[1]);
+    bool ok = true;
+    for (size_t i = 0; ok && i < sum.size(); ++i) {
+        float rgb[3];
+        ok = fread(rgb, sizeof(float), 3, fp) == 3 && fread(&count[i], sizeof(uint32_t), 1, fp) == 1;
+        sum[i] = Vector3f(rgb[0], rgb[1], rgb[2]);
+    }
+    fclose(fp);
+    return ok;
+}
+
+bool writePPM(const std::string &path, int width, int height, const std::vector<Vector3f> &framebuffer)
+{
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (!fp)
+        return false;
+    (void)fprintf(fp, "P6\n%d %d\n255\n", width, height);
+    for (auto i = 0; i < height * width; ++i) {
+        static unsigned char color[3];
+        color[0] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].x), 0.6f));
+        color[1] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].y), 0.6f));
+        color[2] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].z), 0.6f));
+        fwrite(color, 1, 3, fp);
+    }
+    return fclose(fp) == 0;
+}
+
+bool writePFM(const std::string &path, int width, int height, const std::vector<float> &values)
+{
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (!fp)
+        return false;
+    // 比例因子为负数表示小端
+    bool ok = fprintf(fp, "Pf\n%d %d\n-1.0\n", width, height) > 0;
+    for (int y = height - 1; ok && y >= 0; --y)
+        ok = fwrite(&values[y * width], sizeof(float), width, fp) == (size_t)width;
+    return fclose(fp) == 0 && ok;
+}
+
+bool writeFalseColor(const std::string &path, int width, int height, const std::vector<float> &values, float maxValue)
+{
+    static const Vector3f ramp[5] = {Vector3f(0, 0, 1), Vector3f(0, 1, 1), Vector3f(0, 1, 0), Vector3f(1, 1, 0),
+                                     Vector3f(1, 0, 0)};
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (!fp)
+        return false;
+    bool ok = fprintf(fp, "P6\n%d %d\n255\n", width, height) > 0;
+    for (int i = 0; ok && i < width * height; ++i) {
+        float t = maxValue > 0 ? clamp(0, 1, values[i] / maxValue) * 4 : 0;
+        int k = std::min(3, (int)t);
+        Vector3f c = lerp(ramp[k], ramp[k + 1], t - k);
+        unsigned char color[3] = {(unsigned char)(255 * c.x), (unsigned char)(255 * c.y), (unsigned char)(255 * c.z)};
+        ok = fwrite(color, 1, 3, fp) == 3;
+    }
+    return fclose(fp) == 0 && ok;
+}
@@ -0,0 +1,46 @@
+//
+// Accumulation buffer shared by the renderer and the merge tool.
+//
+
+#ifndef RAYTRACING_FRAMEBUFFER_H
+#define RAYTRACING_FRAMEBUFFER_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "Vector.hpp"
+
+// 多进程渲染的累积结果: 每个像素保存radiance之和与采样数, 不同进程(不同tile或不同采样)的结果按采样数加权合并
+//
+// 文件格式(小端):
+//   char[8]  "PA7ACC01"
+//   int32    width, height
+//   width*height个 { float r, g, b (radiance之和); uint32 count (采样数) }
+struct AccumulationBuffer
+{
+    int width = 0, height = 0;
+    std::vector<Vector3f> sum;
+    std::vector<uint32_t> count;
+
+    AccumulationBuffer(int w = 0, int h = 0)
+        : width(w), height(h), sum(w * h), count(w * h, 0) {}
+
+    // 累加另一部分的结果, 两者分辨率必须一致
+    bool merge(const AccumulationBuffer &other);
+    // 每个像素的平均radiance, 没有采样的像素为黑色
+    std::vector<Vector3f> resolve() const;
+
+    bool save(const std::string &path) const;
+    bool load(const std::string &path);
+};
+
+// 将framebuffer做gamma校正后保存为PPM图像
+bool writePPM(const std::string &path, int width, int height, const std::vector<Vector3f> &framebuffer);
+
+// 将单通道数据保存为灰度PFM("Pf", 小端, 行从下到上), 保留原始数值
+bool writePFM(const std::string &path, int width, int height, const std::vector<float> &values);
+
+// 将单通道数据按[0, maxValue]映射为蓝-青-绿-黄-红的伪彩色PPM图像
+bool writeFalseColor(const std::string &path, int width, int height, const std::vector<float> &values, float maxValue);
+
+#endif //RAYTRACING_FRAMEBUFFER_H
@@ -28,4 +28,13 @@ struct Intersection
     Object* obj;
     Material* m;
 };
+
+// 遍历加速结构时只记录最近交点的参数, 位置、法线、材质等在找到最终交点后由Object::evalHit一次性计算
+struct HitRecord
+{
+    float t = std::numeric_limits<float>::infinity();  // 当前最近交点的光线参数, 更远的候选直接剔除
+    Object* prim = nullptr;                            // 命中的图元
+    float u = 0, v = 0;                                // 交点在图元上的参数(三角形为重心坐标)
+    uint32_t primID = 0;                               // prim内部的子图元编号(如out-of-core网格的簇中的三角形)
+};
 #endif //RAYTRACING_INTERSECTION_H
@@ -0,0 +1,91 @@
+#include <algorithm>
+#include <cmath>
+#include "IrradianceCache.hpp"
+#include "global.hpp"
+
+IrradianceCache::IrradianceCache(const Bounds3 &b, float accuracy) : accuracy(accuracy)
+{
+    // 用包围场景的立方体作为八叉树的根节点
+    Vector3f d = b.Diagonal();
+    float diag = d.norm();
+    minRadius = 0.01f * diag;
+    maxRadius = 0.25f * diag;
+    float half = 0.5f * std::max(d.x, std::max(d.y, d.z)) * 1.01f + 1e-3f;
+    Vector3f center = 0.5 * b.pMin + 0.5 * b.pMax;
+    bounds = Bounds3(center - Vector3f(half), center + Vector3f(half));
+    clear();
+}
+
+void IrradianceCache::clear()
+{
+    records.clear();
+    nodes.assign(1, Node());
+    nodes[0].center = 0.5 * bounds.pMin + 0.5 * bounds.pMax;
+    nodes[0].half = 0.5f * (bounds.pMax.x - bounds.pMin.x);
+    lookups = hits = 0;
+}
+
+void IrradianceCache::insert(const Vector3f &p, const Vector3f &N, const Vector3f &E, float harmonicDist)
+{
+    float R = clamp(minRadius, maxRadius, harmonicDist);
+    float influence = accuracy * R;
+    int index = records.size();
+    records.push_back({p, N, E, R});
+
+    constexpr int maxDepth = 16;
+    int node = 0;
+    for (int depth = 0; depth < maxDepth && nodes[node].half * 0.5f >= influence; ++depth) {
+        Vector3f c = nodes[node].center;
+        int i = (p.x >= c.x) + 2 * (p.y >= c.y) + 4 * (p.z >= c.z);
+        if (!nodes[node].child[i]) {
+            float h = nodes[node].half * 0.5f;
+            Node child;
+            child.center = c + Vector3f(i & 1 ? h : -h, i & 2 ? h : -h, i & 4 ? h : -h);
+            child.half = h;
+            nodes[node].child[i] = nodes.size();
+            nodes.push_back(std::move(child));
+        }
+        node = nodes[node].child[i];
+    }
+    nodes[node].records.push_back(index);
+}
+
+bool IrradianceCache::lookup(const Vector3f &p, const Vector3f &N, Vector3f &E) const
+{
+    ++lookups;
+    Vector3f sumE(0);
+    float sumW = 0;
+    lookupNode(0, p, N, sumE, sumW);
+    if (sumW <= 0)
+        return false;
+    ++hits;
+    E = sumE / sumW;
+    return true;
+}
+
+void IrradianceCache::lookupNode(int node, const Vector3f &p, const Vector3f &N, Vector3f &sumE, float &sumW) const
+{
+    // 节点中记录的影响半径不超过节点的半边长, p距节点超过半边长时其中及其子节点中的记录都不会影响p
+    const Node &n = nodes[node];
+    Vector3f d = p - n.center;
+    float reach = 2 * n.half;
+    if (std::fabs(d.x) > reach || std::fabs(d.y) > reach || std::fabs(d.z) > reach)
+        return;
+
+    for (int index : n.records) {
+        const Record &r = records[index];
+        Vector3f dp = p - r.p;
+        // 记录位于着色点前方(例如在墙角的另一面)时不参与插值
+        if (dotProduct(dp, N + r.N) < -0.1f * r.R)
+            continue;
+        float error = dp.norm() / r.R + std::sqrt(std::max(0.f, 1 - dotProduct(N, r.N)));
+        if (error < accuracy) {
+            float w = 1 / std::max(error, 1e-6f);
+            sumE += r.E * w;
+            sumW += w;
+        }
+    }
+    for (int c : n.child)
+        if (c)
+            lookupNode(c, p, N, sumE, sumW);
+}
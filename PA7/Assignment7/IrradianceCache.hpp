@@ -0,0 +1,59 @@
+//
+// Irradiance cache for diffuse indirect lighting.
+//
+
+#ifndef RAYTRACING_IRRADIANCECACHE_H
+#define RAYTRACING_IRRADIANCECACHE_H
+
+#include <vector>
+#include "Bounds3.hpp"
+#include "Vector.hpp"
+
+// 缓存漫反射表面上的间接辐照度E, 相邻着色点按Ward的误差估计加权插值, 只在没有可用记录的位置计算新记录.
+// 参考 Ward et al., "A Ray Tracing Solution for Diffuse Interreflection"
+//
+// 每条记录的有效半径R为计算时半球采样光线击中距离的调和平均, 着色点(p, N)处记录i的权重为
+//   w_i = 1 / (|p - p_i| / R_i + sqrt(1 - N·N_i))
+// w_i > 1 / accuracy 的记录参与插值, 即记录只影响以p_i为中心、半径accuracy * R_i的范围
+class IrradianceCache {
+public:
+    explicit IrradianceCache(const Bounds3 &bounds, float accuracy = 0.2f);
+
+    // 在(p, N)处插值间接辐照度, 没有可用的记录时返回false
+    bool lookup(const Vector3f &p, const Vector3f &N, Vector3f &E) const;
+    // 添加一条记录, harmonicDist为采样光线击中距离的调和平均(没有击中任何物体时为无穷大)
+    void insert(const Vector3f &p, const Vector3f &N, const Vector3f &E, float harmonicDist);
+    // 清空所有记录(场景变化后原有记录不再有效)
+    void clear();
+
+    size_t size() const { return records.size(); }
+
+    float accuracy;         // 允许的插值误差, 越小记录越密
+    float minRadius;        // 有效半径的下限, 避免墙角处记录过密; 默认为场景对角线的1%
+    float maxRadius;        // 有效半径的上限, 避免开阔处的记录影响过远; 默认为场景对角线的25%
+    int samples = 256;      // 计算一条记录时的半球采样数(按sqrt(samples)*sqrt(samples)分层)
+
+    // 统计: 查询次数与其中插值成功的次数
+    mutable size_t lookups = 0, hits = 0;
+
+private:
+    struct Record {
+        Vector3f p, N, E;
+        float R;
+    };
+    // 八叉树节点: 记录存放在包含其位置、且半边长不小于其影响半径的最深节点中
+    struct Node {
+        Vector3f center;
+        float half;
+        std::vector<int> records;
+        int child[8] = {0, 0, 0, 0, 0, 0, 0, 0};   // 0表示没有该子节点(根节点0不会是任何节点的子节点)
+    };
+
+    Bounds3 bounds;
+    std::vector<Record> records;
+    std::vector<Node> nodes;
+
+    void lookupNode(int node, const Vector3f &p, const Vector3f &N, Vector3f &sumE, float &sumW) const;
+};
+
+#endif //RAYTRACING_IRRADIANCECACHE_H
@@ -0,0 +1,321 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include "KDTree.hpp"
+#include "PrimitiveDispatch.hpp"
+#include "RayCounters.hpp"
+#include "Trace.hpp"
+
+namespace {
+
+// SAH代价中遍历一个内部节点与求交一个图元的相对代价(取pbrt的经验值, k-d树的节点遍历远比图元求交便宜),
+// 一侧为空的划分可以直接剪掉空区域, 代价按kEmptyBonus打折
+constexpr float kTraversalCost = 1.f;
+constexpr float kIntersectCost = 80.f;
+constexpr float kEmptyBonus = 0.5f;
+constexpr int kMaxPrimsInLeaf = 1;
+// 遍历栈的深度即树的最大深度
+constexpr int kStackSize = 64;
+// 裁剪图元时子节点包围盒向外扩大的距离, 相对场景包围盒的最长边
+constexpr float kClipPadding = 1e-5f;
+
+bool isValid(const Bounds3 &b)
+{
+    return b.pMin.x <= b.pMax.x && b.pMin.y <= b.pMax.y && b.pMin.z <= b.pMax.z;
+}
+
+// 光线与包围盒求交, 交区间与[tMin, tMax]的重叠部分写回tMin, tMax
+bool clipRay(const Bounds3 &b, const Ray &ray, const Vector3f &invDir, float &tMin, float &tMax)
+{
+    for (int a = 0; a < 3; ++a) {
+        float t0 = (b.pMin[a] - ray.origin[a]) * invDir[a];
+        float t1 = (b.pMax[a] - ray.origin[a]) * invDir[a];
+        if (t0 > t1)
+            std::swap(t0, t1);
+        // 方向分量为0且起点在平面上时t0/t1为NaN, 此时不限制区间
+        tMin = t0 > tMin ? t0 : tMin;
+        tMax = t1 < tMax ? t1 : tMax;
+        if (tMin > tMax)
+            return false;
+    }
+    return true;
+}
+
+}
+
+// 图元包围盒在划分轴上的起点/终点, 同一位置的起点排在终点之前
+struct KDTreeAccel::BoundEdge {
+    float t;
+    uint32_t prim;      // 当前节点图元列表中的下标
+    bool start;
+
+    bool operator<(const BoundEdge &e) const { return t == e.t ? start > e.start : t < e.t; }
+};
+
+KDTreeAccel::KDTreeAccel(const std::vector<Object*>& objects, bool verbose)
+{
+    TRACE_SCOPE("k-d tree build");
+    auto start = std::chrono::steady_clock::now();
+    for (auto object : objects)
+        object->getPrimitives(primitives);
+    primitiveCount = primitives.size();
+    if (primitives.empty())
+        return;
+
+    std::vector<uint32_t> prims(primitives.size());
+    std::vector<Bounds3> primBounds(primitives.size());
+    for (uint32_t i = 0; i < primitives.size(); ++i) {
+        prims[i] = i;
+        primBounds[i] = primitives[i]->getBounds();
+        bounds = Union(bounds, primBounds[i]);
+    }
+    Vector3f extent = bounds.Diagonal();
+    clipPadding = kClipPadding * std::max(extent.x, std::max(extent.y, extent.z));
+    maxDepth = std::min(kStackSize, (int)std::lround(8 + 1.3f * std::log2((float)primitives.size())));
+    buildNode(bounds, prims, primBounds, maxDepth, 0);
+
+    buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (verbose)
+        printf("\rk-d tree Generation complete: \nTime Taken: %.3f ms, %zu primitives, %zu references, "
+               "%zu nodes (%d leaves, %d empty), depth %d\n\n",
+               buildMs, primitiveCount, references, nodes.size(), leaves, emptyLeaves, depth);
+}
+
+void KDTreeAccel::makeLeaf(const std::vector<uint32_t>& prims)
+{
+    Node node;
+    node.primOffset = leafPrims.size();
+    node.bits = 3 | (uint32_t(prims.size()) << 2);
+    nodes.push_back(node);
+    for (uint32_t p : prims)
+        leafPrims.push_back(primitives[p]);
+    references += prims.size();
+    ++leaves;
+    emptyLeaves += prims.empty();
+}
+
+Bounds3 KDTreeAccel::clippedBounds(Object* prim, const Bounds3& box) const
+{
+    Bounds3 padded = box;
+    padded.pMin = padded.pMin - Vector3f(clipPadding);
+    padded.pMax = padded.pMax + Vector3f(clipPadding);
+    return prim->getClippedBounds(padded);
+}
+
+void KDTreeAccel::buildNode(const Bounds3& nodeBounds, std::vector<uint32_t>& prims,
+                            std::vector<Bounds3>& primBounds, int depthLeft, int badRefines)
+{
+    depth = std::max(depth, maxDepth - depthLeft);
+    int n = prims.size();
+    float totalSA = nodeBounds.SurfaceArea();
+    if (n <= kMaxPrimsInLeaf || depthLeft == 0 || !(totalSA > 0)) {
+        makeLeaf(prims);
+        return;
+    }
+
+    // 沿最长轴扫描图元包围盒的边界求SAH代价最小的划分位置, 该轴上找不到可用的位置时再尝试其余两轴
+    Vector3f d = nodeBounds.Diagonal();
+    float invTotalSA = 1 / totalSA;
+    float oldCost = kIntersectCost * n;
+    float bestCost = std::numeric_limits<float>::infinity();
+    int bestAxis = -1, bestOffset = -1;
+    std::vector<BoundEdge> edges(2 * n), bestEdges;
+    int axis = nodeBounds.maxExtent();
+    for (int retries = 0; retries < 3 && bestAxis == -1; ++retries, axis = (axis + 1) % 3) {
+        for (int i = 0; i < n; ++i) {
+            edges[2 * i] = {primBounds[i].pMin[axis], uint32_t(i), true};
+            edges[2 * i + 1] = {primBounds[i].pMax[axis], uint32_t(i), false};
+        }
+        std::sort(edges.begin(), edges.end());
+
+        int axis0 = (axis + 1) % 3, axis1 = (axis + 2) % 3;
+        float lo = nodeBounds.pMin[axis], hi = nodeBounds.pMax[axis];
+        int nBelow = 0, nAbove = n;
+        for (int i = 0; i < 2 * n; ++i) {
+            if (!edges[i].start)
+                --nAbove;
+            float t = edges[i].t;
+            if (t > lo && t < hi) {
+                float belowSA = 2 * (d[axis0] * d[axis1] + (t - lo) * (d[axis0] + d[axis1]));
+                float aboveSA = 2 * (d[axis0] * d[axis1] + (hi - t) * (d[axis0] + d[axis1]));
+                float bonus = (nAbove == 0 || nBelow == 0) ? kEmptyBonus : 0;
+                float cost = kTraversalCost + kIntersectCost * (1 - bonus) *
+                             (belowSA * invTotalSA * nBelow + aboveSA * invTotalSA * nAbove);
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestOffset = i;
+                }
+            }
+            if (edges[i].start)
+                ++nBelow;
+        }
+        if (bestAxis == axis)
+            bestEdges.swap(edges);
+    }
+
+    // 代价高于直接做叶子的划分允许出现几次(后续的划分可能弥补), 次数过多或图元已经很少时停止
+    if (bestCost > oldCost)
+        ++badRefines;
+    if ((bestCost > 4 * oldCost && n < 16) || bestAxis == -1 || badRefines == 3) {
+        makeLeaf(prims);
+        return;
+    }
+
+    // 起点在划分位置之前的图元属于下侧, 终点在之后的属于上侧, 跨越划分平面的图元两侧都有.
+    // 子节点中的包围盒按子节点裁剪(可以超出子节点clipPadding), 裁剪后为空的图元(只有包围盒而非图元本身跨越平面)
+    // 不再进入该子节点
+    float split = bestEdges[bestOffset].t;
+    Bounds3 belowBounds = nodeBounds, aboveBounds = nodeBounds;
+    belowBounds.pMax[bestAxis] = split;
+    aboveBounds.pMin[bestAxis] = split;
+    std::vector<uint32_t> belowPrims, abovePrims;
+    std::vector<Bounds3> belowPrimBounds, abovePrimBounds;
+    for (int i = 0; i < bestOffset; ++i)
+        if (bestEdges[i].start) {
+            uint32_t p = prims[bestEdges[i].prim];
+            Bounds3 b = clippedBounds(primitives[p], belowBounds);
+            if (isValid(b)) {
+                belowPrims.push_back(p);
+                belowPrimBounds.push_back(b);
+            }
+        }
+    for (int i = bestOffset + 1; i < 2 * n; ++i)
+        if (!bestEdges[i].start) {
+            uint32_t p = prims[bestEdges[i].prim];
+            Bounds3 b = clippedBounds(primitives[p], aboveBounds);
+            if (isValid(b)) {
+                abovePrims.push_back(p);
+                abovePrimBounds.push_back(b);
+            }
+        }
+    // 父节点的图元列表不再需要, 递归前释放以控制构建时的内存峰值
+    std::vector<uint32_t>().swap(prims);
+    std::vector<Bounds3>().swap(primBounds);
+    std::vector<BoundEdge>().swap(bestEdges);
+    std::vector<BoundEdge>().swap(edges);
+
+    uint32_t index = nodes.size();
+    nodes.emplace_back();
+    nodes[index].split = split;
+    buildNode(belowBounds, belowPrims, belowPrimBounds, depthLeft - 1, badRefines);
+    nodes[index].bits = uint32_t(bestAxis) | (uint32_t(nodes.size()) << 2);
+    buildNode(aboveBounds, abovePrims, abovePrimBounds, depthLeft - 1, badRefines);
+}
+
+Intersection KDTreeAccel::Intersect(const Ray& ray) const
+{
+    HitRecord hit;
+    if (!IntersectHit(ray, hit))
+        return {};
+    return hit.prim->evalHit(ray, hit);
+}
+
+bool KDTreeAccel::IntersectHit(const Ray& ray, HitRecord& hit) const
+{
+    if (nodes.empty())
+        return false;
+    if (ray.t_max < hit.t)
+        hit.t = ray.t_max;
+    Vector3f invDir = Vector3f{1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z};
+    float tMin = ray.t_min, tMax = hit.t;
+    if (!clipRay(bounds, ray, invDir, tMin, tMax))
+        return false;
+
+    struct Entry { uint32_t node; float tMin, tMax; };
+    Entry stack[kStackSize];
+    int top = 0;
+    Object* prim = hit.prim;
+    uint32_t current = 0;
+    while (true) {
+        // 按光线经过的顺序访问节点, 已有交点比当前节点的入口更近时后面的节点都不可能有更近的交点
+        if (hit.t < tMin)
+            break;
+        ++rayCounters.nodes;
+        const Node& node = nodes[current];
+        if (!node.isLeaf()) {
+            // 起点所在一侧的子节点先访问, 起点恰好在平面上时按方向决定
+            int axis = node.axis();
+            float tPlane = (node.split - ray.origin[axis]) * invDir[axis];
+            bool belowFirst = ray.origin[axis] < node.split ||
+                              (ray.origin[axis] == node.split && ray.direction[axis] <= 0);
+            uint32_t first = belowFirst ? current + 1 : node.aboveChild();
+            uint32_t second = belowFirst ? node.aboveChild() : current + 1;
+            if (tPlane > tMax || tPlane <= 0)
+                current = first;
+            else if (tPlane < tMin)
+                current = second;
+            else {
+                stack[top++] = {second, tPlane, tMax};
+                current = first;
+                tMax = tPlane;
+            }
+            continue;
+        }
+
+        // 同一个图元可能被多个叶子引用而重复求交, 只保留最近的交点, 结果不受影响
+        Object* const* leaf = leafPrims.data() + node.primOffset;
+        for (uint32_t i = 0; i < node.primCount(); ++i)
+            intersectPrimitive(leaf[i], ray, hit);
+        if (top == 0)
+            break;
+        --top;
+        current = stack[top].node;
+        tMin = stack[top].tMin;
+        tMax = stack[top].tMax;
+    }
+    return hit.prim != prim;
+}
+
+bool KDTreeAccel::IntersectP(const Ray& ray) const
+{
+    if (nodes.empty())
+        return false;
+    Vector3f invDir = Vector3f{1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z};
+    float tMin = ray.t_min, tMax = ray.t_max;
+    if (!clipRay(bounds, ray, invDir, tMin, tMax))
+        return false;
+
+    struct Entry { uint32_t node; float tMin, tMax; };
+    Entry stack[kStackSize];
+    int top = 0;
+    uint32_t current = 0;
+    while (true) {
+        ++rayCounters.nodes;
+        const Node& node = nodes[current];
+        if (!node.isLeaf()) {
+            int axis = node.axis();
+            float tPlane = (node.split - ray.origin[axis]) * invDir[axis];
+            bool belowFirst = ray.origin[axis] < node.split ||
+                              (ray.origin[axis] == node.split && ray.direction[axis] <= 0);
+            uint32_t first = belowFirst ? current + 1 : node.aboveChild();
+            uint32_t second = belowFirst ? node.aboveChild() : current + 1;
+            if (tPlane > tMax || tPlane <= 0)
+                current = first;
+            else if (tPlane < tMin)
+                current = second;
+            else {
+                stack[top++] = {second, tPlane, tMax};
+                current = first;
+                tMax = tPlane;
+            }
+            continue;
+        }
+
+        Object* const* leaf = leafPrims.data() + node.primOffset;
+        for (uint32_t i = 0; i < node.primCount(); ++i)
+            if (occludedPrimitive(leaf[i], ray))
+                return true;
+        if (top == 0)
+            return false;
+        --top;
+        current = stack[top].node;
+        tMin = stack[top].tMin;
+        tMax = stack[top].tMax;
+    }
+}
+
+size_t KDTreeAccel::NodeMemory() const
+{
+    return nodes.size() * sizeof(Node) + leafPrims.size() * sizeof(Object*);
+}
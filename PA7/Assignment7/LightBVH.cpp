@@ -0,0 +1,266 @@
+#include <algorithm>
+#include <cassert>
+#include "LightBVH.hpp"
+#include "Trace.hpp"
+
+struct LightBVH::LightInfo {
+    Object* object;
+    Bounds3 bounds;
+    Vector3f centroid;
+    LightCone cone;
+    float power;
+};
+
+namespace {
+
+float safeAcos(float x) { return std::acos(clamp(-1, 1, x)); }
+
+// 将向量v绕单位轴k旋转theta角(Rodrigues公式)
+Vector3f rotate(const Vector3f &v, const Vector3f &k, float theta)
+{
+    float c = std::cos(theta), s = std::sin(theta);
+    return v * c + crossProduct(k, v) * s + k * (dotProduct(k, v) * (1 - c));
+}
+
+// 两个法线锥的最小包围锥
+LightCone coneUnion(const LightCone &a, const LightCone &b)
+{
+    LightCone ret;
+    ret.thetaE = std::max(a.thetaE, b.thetaE);
+    if (a.thetaO >= M_PI || b.thetaO >= M_PI) {
+        ret.thetaO = M_PI;
+        return ret;
+    }
+    float thetaD = safeAcos(dotProduct(a.axis, b.axis));
+    if (std::min(thetaD + b.thetaO, M_PI) <= a.thetaO) {
+        ret.axis = a.axis;
+        ret.thetaO = a.thetaO;
+        return ret;
+    }
+    if (std::min(thetaD + a.thetaO, M_PI) <= b.thetaO) {
+        ret.axis = b.axis;
+        ret.thetaO = b.thetaO;
+        return ret;
+    }
+    float thetaO = (a.thetaO + thetaD + b.thetaO) / 2;
+    Vector3f k = crossProduct(a.axis, b.axis);
+    if (thetaO >= M_PI || dotProduct(k, k) < 1e-12f) {
+        ret.thetaO = M_PI;
+        return ret;
+    }
+    ret.axis = normalize(rotate(a.axis, normalize(k), thetaO - a.thetaO));
+    ret.thetaO = thetaO;
+    return ret;
+}
+
+// 法线锥的方向测度 M_Omega, 用于SAOH代价
+float orientationMeasure(const LightCone &c)
+{
+    float thetaW = std::min(c.thetaO + c.thetaE, M_PI);
+    float cosO = std::cos(c.thetaO), sinO = std::sin(c.thetaO);
+    return 2 * M_PI * (1 - cosO) +
+           M_PI / 2 * (2 * thetaW * sinO - std::cos(c.thetaO - 2 * thetaW) -
+                       2 * c.thetaO * sinO + cosO);
+}
+
+}
+
+LightBVH::LightBVH(std::vector<Object*> e) : emitters(std::move(e))
+{
+    TRACE_SCOPE("light BVH build", emitters.size());
+    if (emitters.empty())
+        return;
+
+    std::vector<LightInfo> lights;
+    for (auto object : emitters) {
+        LightInfo info;
+        info.object = object;
+        info.bounds = object->getBounds();
+        info.centroid = info.bounds.Centroid();
+        float cosTheta;
+        object->getNormalBounds(info.cone.axis, cosTheta);
+        info.cone.thetaO = safeAcos(cosTheta);
+        Vector3f emit = object->getEmission();
+        info.power = (emit.x + emit.y + emit.z) / 3 * object->getArea();
+        if (info.power > 0)
+            lights.push_back(info);
+    }
+    if (!lights.empty())
+        root = recursiveBuild(lights, 0, lights.size());
+}
+
+LightBVH::~LightBVH()
+{
+    std::vector<LightBVHNode*> stack;
+    if (root)
+        stack.push_back(root);
+    while (!stack.empty()) {
+        LightBVHNode* node = stack.back();
+        stack.pop_back();
+        if (node->left) stack.push_back(node->left);
+        if (node->right) stack.push_back(node->right);
+        delete node;
+    }
+}
+
+LightBVHNode* LightBVH::recursiveBuild(std::vector<LightInfo> &lights, int begin, int end)
+{
+    LightBVHNode* node = new LightBVHNode();
+
+    if (end - begin == 1) {
+        node->bounds = lights[begin].bounds;
+        node->cone = lights[begin].cone;
+        node->power = lights[begin].power;
+        node->object = lights[begin].object;
+        return node;
+    }
+
+    Bounds3 bounds, centroidBounds;
+    for (int i = begin; i < end; ++i) {
+        bounds = Union(bounds, lights[i].bounds);
+        centroidBounds = Union(centroidBounds, lights[i].centroid);
+    }
+
+    // SAOH: 在三个轴上各划分12个桶, 代价同时考虑包围盒面积、功率与法线锥的方向测度
+    // 狭长的包围盒按最长边的比例放大代价, 避免沿短轴切分
+    constexpr int bucketCount = 12;
+    float minCost = std::numeric_limits<float>::infinity();
+    int minCostAxis = -1, minCostBucket = 0;
+    Vector3f d = bounds.Diagonal();
+    float maxLength = std::max(d.x, std::max(d.y, d.z));
+    for (int axis = 0; axis < 3; ++axis) {
+        float extent = axis == 0 ? d.x : (axis == 1 ? d.y : d.z);
+        float cExtent = centroidBounds.pMax[axis] - centroidBounds.pMin[axis];
+        if (cExtent <= 0)
+            continue;
+
+        Bounds3 bucketBounds[bucketCount];
+        LightCone bucketCone[bucketCount];
+        float bucketPower[bucketCount] = {};
+        bool bucketUsed[bucketCount] = {};
+        for (int i = begin; i < end; ++i) {
+            int b = bucketCount * centroidBounds.Offset(lights[i].centroid)[axis];
+            b = std::min(b, bucketCount - 1);
+            bucketBounds[b] = Union(bucketBounds[b], lights[i].bounds);
+            bucketCone[b] = bucketUsed[b] ? coneUnion(bucketCone[b], lights[i].cone) : lights[i].cone;
+            bucketPower[b] += lights[i].power;
+            bucketUsed[b] = true;
+        }
+
+        float kr = extent > 0 ? maxLength / extent : 1;
+        for (int split = 1; split < bucketCount; ++split) {
+            Bounds3 bA, bB;
+            LightCone cA, cB;
+            float pA = 0, pB = 0;
+            bool usedA = false, usedB = false;
+            for (int k = 0; k < split; ++k) {
+                if (!bucketUsed[k]) continue;
+                bA = Union(bA, bucketBounds[k]);
+                cA = usedA ? coneUnion(cA, bucketCone[k]) : bucketCone[k];
+                pA += bucketPower[k];
+                usedA = true;
+            }
+            for (int k = split; k < bucketCount; ++k) {
+                if (!bucketUsed[k]) continue;
+                bB = Union(bB, bucketBounds[k]);
+                cB = usedB ? coneUnion(cB, bucketCone[k]) : bucketCone[k];
+                pB += bucketPower[k];
+                usedB = true;
+            }
+            if (!usedA || !usedB)
+                continue;
+            float cost = kr * (pA * bA.SurfaceArea() * orientationMeasure(cA) +
+                               pB * bB.SurfaceArea() * orientationMeasure(cB));
+            if (cost < minCost) {
+                minCost = cost;
+                minCostAxis = axis;
+                minCostBucket = split;
+            }
+        }
+    }
+
+    int mid;
+    if (minCostAxis < 0) {
+        // 所有光源中心重合, 直接按数量平分
+        mid = (begin + end) / 2;
+    } else {
+        auto pmid = std::partition(lights.begin() + begin, lights.begin() + end,
+                                   [&](const LightInfo &l) {
+            int b = bucketCount * centroidBounds.Offset(l.centroid)[minCostAxis];
+            return std::min(b, bucketCount - 1) < minCostBucket;
+        });
+        mid = pmid - lights.begin();
+        assert(mid > begin && mid < end);
+    }
+
+    node->left = recursiveBuild(lights, begin, mid);
+    node->right = recursiveBuild(lights, mid, end);
+    node->bounds = Union(node->left->bounds, node->right->bounds);
+    node->cone = coneUnion(node->left->cone, node->right->cone);
+    node->power = node->left->power + node->right->power;
+    return node;
+}
+
+float LightBVH::Importance(const LightBVHNode* node, const Vector3f &p, const Vector3f &N) const
+{
+    // 以包围盒的外接球近似光源簇, 求其对着色点张开的半角thetaB
+    Vector3f pc = 0.5 * node->bounds.pMin + 0.5 * node->bounds.pMax;
+    float radius = 0.5f * node->bounds.Diagonal().norm();
+    Vector3f wi = p - pc;
+    float d2 = dotProduct(wi, wi);
+    // 着色点在外接球内时无法确定方向, 只能认为各方向都可能, 距离按外接球半径计, 避免近处的光源簇重要性发散
+    float r2 = std::max(radius * radius, 1e-8f);
+    if (d2 < r2)
+        return node->power / r2;
+    float dist = std::sqrt(d2);
+    wi = wi / dist;
+    float thetaB = std::asin(std::min(1.f, radius / dist));
+
+    // 光源发光方向与光源到着色点方向的夹角, 按法线锥与外接球张角保守地缩小
+    float thetaW = safeAcos(dotProduct(node->cone.axis, wi));
+    float thetaP = std::max(0.f, thetaW - node->cone.thetaO - thetaB);
+    if (thetaP >= node->cone.thetaE)
+        return 0;
+
+    // 着色点法线与指向光源方向的夹角, 光源完全位于着色点背面时没有贡献
+    float thetaI = safeAcos(dotProduct(N, -wi));
+    float thetaIP = std::max(0.f, thetaI - thetaB);
+    if (thetaIP >= M_PI / 2)
+        return 0;
+
+    return node->power * std::cos(thetaP) * std::cos(thetaIP) / d2;
+}
+
+void LightBVH::Sample(const Vector3f &p, const Vector3f &N, Intersection &pos, float &pdf) const
+{
+    pdf = 0;
+    if (!root)
+        return;
+
+    // 每层选择后把随机数重新映射回[0,1), 整个遍历只需要一个随机数
+    float u = get_random_float();
+    float pmf = 1;
+    const LightBVHNode* node = root;
+    while (!node->object) {
+        float iL = Importance(node->left, p, N);
+        float iR = Importance(node->right, p, N);
+        if (iL + iR <= 0)
+            return;
+        float pL = iL / (iL + iR);
+        if (u < pL) {
+            node = node->left;
+            pmf *= pL;
+            u = std::min(u / pL, 0.99999994f);
+        } else {
+            node = node->right;
+            pmf *= 1 - pL;
+            u = std::min((u - pL) / (1 - pL), 0.99999994f);
+        }
+    }
+
+    // 叶子节点也可能对着色点没有贡献(例如单个光源时不经过上面的判断)
+    if (Importance(node, p, N) <= 0)
+        return;
+    node->object->Sample(pos, pdf);
+    pdf *= pmf;
+}
@@ -0,0 +1,49 @@
+//
+// Light hierarchy for many-light sampling.
+//
+
+#ifndef RAYTRACING_LIGHTBVH_H
+#define RAYTRACING_LIGHTBVH_H
+
+#include <vector>
+#include "Object.hpp"
+#include "Bounds3.hpp"
+#include "Intersection.hpp"
+#include "Vector.hpp"
+
+// 光源的法线锥: axis为锥轴, thetaO为所有法线相对锥轴的最大夹角, thetaE为发光方向相对法线的最大夹角
+struct LightCone {
+    Vector3f axis = Vector3f(0, 0, 1);
+    float thetaO = M_PI;
+    float thetaE = M_PI / 2;
+};
+
+struct LightBVHNode {
+    Bounds3 bounds;
+    LightCone cone;
+    float power = 0;            // 子树中所有光源的发光功率之和
+    LightBVHNode *left = nullptr;
+    LightBVHNode *right = nullptr;
+    Object* object = nullptr;   // 叶子节点对应的发光图元
+};
+
+// 按光源对着色点的估计贡献(功率、距离、朝向)随机遍历光源层次结构
+// 参考 Conty Estevez & Kulla, "Importance Sampling of Many Lights with Adaptive Tree Splitting"
+class LightBVH {
+public:
+    LightBVH(std::vector<Object*> emitters);
+    ~LightBVH();
+
+    // 在着色点p(法线N)处按重要性采样一个光源点, pdf为面积测度下的概率密度; 无光源可贡献时pdf=0
+    void Sample(const Vector3f &p, const Vector3f &N, Intersection &pos, float &pdf) const;
+    float Importance(const LightBVHNode* node, const Vector3f &p, const Vector3f &N) const;
+
+    LightBVHNode* root = nullptr;
+    std::vector<Object*> emitters;
+
+private:
+    struct LightInfo;
+    LightBVHNode* recursiveBuild(std::vector<LightInfo> &lights, int begin, int end);
+};
+
+#endif //RAYTRACING_LIGHTBVH_H
@@ -0,0 +1,255 @@
+//
+// Triangle mesh loaded from an OBJ file, with its own BVH over the triangles (and merged quads).
+//
+
+#pragma once
+
+#include "BVH.hpp"
+#include "OBJ_Loader.hpp"
+#include "Quad.hpp"
+#include "Trace.hpp"
+#include "Transform.hpp"
+#include "Triangle.hpp"
+#include <cassert>
+#include <array>
+
+class MeshTriangle : public Object
+{
+public:
+    // mergeQuads为true时, 拼成平行四边形的三角形对合并为一个Quad图元(见MergeTrianglePairs)
+    // 载入时顶点先经transform变换(如把模型放到场景中的位置), 之后的setTransform以变换后的位置为rest pose
+    MeshTriangle(const std::string& filename, Material *mt = new Material(),
+                 BVHAccel::SplitMethod splitMethod = BVHAccel::SplitMethod::NAIVE, bool mergeQuads = false,
+                 const Transform& transform = Transform())
+    {
+        TRACE_SCOPE("MeshTriangle");
+        objl::Loader loader;
+        {
+            TRACE_SCOPE("load OBJ");
+            loader.LoadFile(filename);
+        }
+        area = 0;
+        m = mt;
+        assert(loader.LoadedMeshes.size() == 1);
+        auto mesh = loader.LoadedMeshes[0];
+
+        Vector3f min_vert = Vector3f{std::numeric_limits<float>::infinity(),
+                                     std::numeric_limits<float>::infinity(),
+                                     std::numeric_limits<float>::infinity()};
+        Vector3f max_vert = Vector3f{-std::numeric_limits<float>::infinity(),
+                                     -std::numeric_limits<float>::infinity(),
+                                     -std::numeric_limits<float>::infinity()};
+        std::vector<std::array<Vector3f, 3>> faces;
+        for (int i = 0; i < mesh.Vertices.size(); i += 3) {
+            std::array<Vector3f, 3> face_vertices;
+
+            for (int j = 0; j < 3; j++) {
+                auto vert = transform.point(Vector3f(mesh.Vertices[i + j].Position.X,
+                                                     mesh.Vertices[i + j].Position.Y,
+                                                     mesh.Vertices[i + j].Position.Z));
+                face_vertices[j] = vert;
+
+                min_vert = Vector3f(std::min(min_vert.x, vert.x),
+                                    std::min(min_vert.y, vert.y),
+                                    std::min(min_vert.z, vert.z));
+                max_vert = Vector3f(std::max(max_vert.x, vert.x),
+                                    std::max(max_vert.y, vert.y),
+                                    std::max(max_vert.z, vert.z));
+            }
+
+            faces.push_back(face_vertices);
+        }
+
+        std::vector<std::array<Vector3f, 3>> quadCorners;
+        if (mergeQuads)
+            MergeTrianglePairs(faces, quadCorners);
+        triangles.reserve(faces.size());
+        for (auto& face : faces)
+            triangles.emplace_back(face[0], face[1], face[2], mt);
+        quads.reserve(quadCorners.size());
+        for (auto& corners : quadCorners)
+            quads.emplace_back(corners[0], corners[1] - corners[0], corners[2] - corners[0], mt);
+
+        bounding_box = Bounds3(min_vert, max_vert);
+
+        std::vector<Object*> ptrs;
+        for (auto& tri : triangles){
+            ptrs.push_back(&tri);
+            area += tri.area;
+        }
+        for (auto& quad : quads){
+            ptrs.push_back(&quad);
+            area += quad.area;
+        }
+        bvh = new BVHAccel(ptrs, 1, splitMethod);
+    }
+
+    // 将物体从载入时的位置(rest pose)变换到新位置, 三角形BVH做refit, SAH代价增长过多时重建
+    // 返回三角形BVH是否被重建. rest pose在第一次调用时才保存, 不做动画的网格不保留顶点副本
+    bool setTransform(const Transform& transform, float rebuildThreshold = 1.5f)
+    {
+        if (rest_vertices.empty() && rest_quad_vertices.empty()) {
+            for (auto& tri : triangles)
+                rest_vertices.insert(rest_vertices.end(), {tri.v0, tri.v1, tri.v2});
+            for (auto& quad : quads)
+                rest_quad_vertices.insert(rest_quad_vertices.end(), {quad.p0, quad.p0 + quad.ea, quad.p0 + quad.eb});
+        }
+        Bounds3 bounds;
+        area = 0;
+        for (size_t i = 0; i < triangles.size(); ++i) {
+            Vector3f p0 = transform.point(rest_vertices[3 * i]);
+            Vector3f p1 = transform.point(rest_vertices[3 * i + 1]);
+            Vector3f p2 = transform.point(rest_vertices[3 * i + 2]);
+            triangles[i].setVertices(p0, p1, p2);
+            bounds = Union(Union(Union(bounds, p0), p1), p2);
+            area += triangles[i].area;
+        }
+        // 仿射变换把平行四边形变为平行四边形, 只需变换其中三个顶点
+        for (size_t i = 0; i < quads.size(); ++i) {
+            Vector3f p0 = transform.point(rest_quad_vertices[3 * i]);
+            Vector3f pa = transform.point(rest_quad_vertices[3 * i + 1]);
+            Vector3f pb = transform.point(rest_quad_vertices[3 * i + 2]);
+            quads[i].setVertices(p0, pa - p0, pb - p0);
+            bounds = Union(bounds, quads[i].getBounds());
+            area += quads[i].area;
+        }
+        bounding_box = bounds;
+        return bvh->Update(rebuildThreshold);
+    }
+
+    bool intersect(const Ray& ray) { return true; }
+
+    bool intersect(const Ray& ray, float& tnear, uint32_t& index) const
+    {
+        bool intersect = false;
+        for (uint32_t k = 0; k < numTriangles; ++k) {
+            const Vector3f& v0 = vertices[vertexIndex[k * 3]];
+            const Vector3f& v1 = vertices[vertexIndex[k * 3 + 1]];
+            const Vector3f& v2 = vertices[vertexIndex[k * 3 + 2]];
+            float t, u, v;
+            if (rayTriangleIntersect(v0, v1, v2, ray.origin, ray.direction, t,
+                                     u, v) &&
+                t < tnear) {
+                tnear = t;
+                index = k;
+                intersect |= true;
+            }
+        }
+
+        return intersect;
+    }
+
+    Bounds3 getBounds() { return bounding_box; }
+
+    // 网格位于box内部分的包围盒: 各三角形裁剪结果的并集
+    Bounds3 getClippedBounds(const Bounds3 &box)
+    {
+        Bounds3 ret;
+        for (auto& tri : triangles) {
+            Bounds3 b = tri.getBounds();
+            if (b.pMax.x < box.pMin.x || b.pMin.x > box.pMax.x || b.pMax.y < box.pMin.y ||
+                b.pMin.y > box.pMax.y || b.pMax.z < box.pMin.z || b.pMin.z > box.pMax.z)
+                continue;
+            ret = Union(ret, tri.getClippedBounds(box));
+        }
+        for (auto& quad : quads)
+            ret = Union(ret, quad.getClippedBounds(box));
+        return ret;
+    }
+
+    void getSurfaceProperties(const Vector3f& P, const Vector3f& I,
+                              const uint32_t& index, const Vector2f& uv,
+                              Vector3f& N, Vector2f& st) const
+    {
+        const Vector3f& v0 = vertices[vertexIndex[index * 3]];
+        const Vector3f& v1 = vertices[vertexIndex[index * 3 + 1]];
+        const Vector3f& v2 = vertices[vertexIndex[index * 3 + 2]];
+        Vector3f e0 = normalize(v1 - v0);
+        Vector3f e1 = normalize(v2 - v1);
+        N = normalize(crossProduct(e0, e1));
+        const Vector2f& st0 = stCoordinates[vertexIndex[index * 3]];
+        const Vector2f& st1 = stCoordinates[vertexIndex[index * 3 + 1]];
+        const Vector2f& st2 = stCoordinates[vertexIndex[index * 3 + 2]];
+        st = st0 * (1 - uv.x - uv.y) + st1 * uv.x + st2 * uv.y;
+    }
+
+    Vector3f evalDiffuseColor(const Vector2f& st) const
+    {
+        float scale = 5;
+        float pattern =
+            (fmodf(st.x * scale, 1) > 0.5) ^ (fmodf(st.y * scale, 1) > 0.5);
+        return lerp(Vector3f(0.815, 0.235, 0.031),
+                    Vector3f(0.937, 0.937, 0.231), pattern);
+    }
+
+    Intersection getIntersection(Ray ray)
+    {
+        Intersection intersec;
+
+        if (bvh) {
+            intersec = bvh->Intersect(ray);
+        }
+
+        return intersec;
+    }
+
+    bool intersectHit(const Ray& ray, HitRecord& hit)
+    {
+        return bvh && bvh->IntersectHit(ray, hit);
+    }
+
+    bool occluded(const Ray& ray)
+    {
+        return bvh && bvh->IntersectP(ray);
+    }
+
+    // hit.prim总是网格中的某个三角形, 由它计算交点属性
+    Intersection evalHit(const Ray& ray, const HitRecord& hit)
+    {
+        return hit.prim->evalHit(ray, hit);
+    }
+    
+    void Sample(Intersection &pos, float &pdf){
+        bvh->Sample(pos, pdf);
+        pos.emit = m->getEmission();
+    }
+    float getArea(){
+        return area;
+    }
+    bool hasEmit(){
+        return m->hasEmission();
+    }
+    Vector3f getEmission(){
+        return m->getEmission();
+    }
+    void getEmitters(std::vector<Object*> &emitters){
+        if (!hasEmit())
+            return;
+        for (auto& tri : triangles)
+            emitters.push_back(&tri);
+        for (auto& quad : quads)
+            emitters.push_back(&quad);
+    }
+    void getPrimitives(std::vector<Object*> &prims){
+        for (auto& tri : triangles)
+            prims.push_back(&tri);
+        for (auto& quad : quads)
+            prims.push_back(&quad);
+    }
+
+    Bounds3 bounding_box;
+    std::unique_ptr<Vector3f[]> vertices;
+    uint32_t numTriangles;
+    std::unique_ptr<uint32_t[]> vertexIndex;
+    std::unique_ptr<Vector2f[]> stCoordinates;
+
+    std::vector<Triangle> triangles;
+    std::vector<Vector3f> rest_vertices;    // 载入时的顶点位置, 每个三角形3个; 只有调用过setTransform的网格才保存
+    std::vector<Quad> quads;                // 由三角形对合并得到的平行四边形
+    std::vector<Vector3f> rest_quad_vertices;   // 载入时每个四边形的p0, p0+ea, p0+eb
+
+    BVHAccel* bvh;
+    float area;
+
+    Material* m;
+};
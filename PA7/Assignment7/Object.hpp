@@ -5,26 +5,60 @@
 #ifndef RAYTRACING_OBJECT_H
 #define RAYTRACING_OBJECT_H
 
+#include <cstdint>
+#include <vector>
 #include "Vector.hpp"
 #include "global.hpp"
 #include "Bounds3.hpp"
 #include "Ray.hpp"
 #include "Intersection.hpp"
 
+// 图元的具体类型. BVH叶子中对TRIANGLE, QUAD与SPHERE按类型直接调用(都是final类), 其余类型通过虚函数调用
+enum class PrimitiveType : uint8_t { TRIANGLE, QUAD, SPHERE, OTHER };
+
 class Object
 {
 public:
-    Object() {}
+    explicit Object(PrimitiveType type = PrimitiveType::OTHER) : primitiveType(type) {}
     virtual ~Object() {}
     virtual bool intersect(const Ray& ray) = 0;
     virtual bool intersect(const Ray& ray, float &, uint32_t &) const = 0;
     virtual Intersection getIntersection(Ray _ray) = 0;
+    // 求交时只更新HitRecord: 交点位于(ray.t_min, hit.t)内时写入t, prim与参数u, v并返回true
+    virtual bool intersectHit(const Ray& ray, HitRecord& hit) = 0;
+    // 遮挡查询: (ray.t_min, ray.t_max)内有任意交点时返回true, 不要求是最近的交点
+    virtual bool occluded(const Ray& ray)
+    {
+        HitRecord hit;
+        hit.t = ray.t_max;
+        return intersectHit(ray, hit);
+    }
+    // 由intersectHit得到的最近交点计算完整的Intersection
+    virtual Intersection evalHit(const Ray& ray, const HitRecord& hit) = 0;
     virtual void getSurfaceProperties(const Vector3f &, const Vector3f &, const uint32_t &, const Vector2f &, Vector3f &, Vector2f &) const = 0;
     virtual Vector3f evalDiffuseColor(const Vector2f &) const =0;
     virtual Bounds3 getBounds()=0;
+    // SBVH构建用: 图元位于box内的部分的包围盒, 默认取包围盒的交集, 没有交集时返回空包围盒
+    virtual Bounds3 getClippedBounds(const Bounds3 &box)
+    {
+        Bounds3 b = getBounds(), ret;
+        ret.pMin = Vector3f::Max(b.pMin, box.pMin);
+        ret.pMax = Vector3f::Min(b.pMax, box.pMax);
+        return ret;
+    }
     virtual float getArea()=0;
     virtual void Sample(Intersection &pos, float &pdf)=0;
     virtual bool hasEmit()=0;
+    virtual Vector3f getEmission()=0;
+
+    // 光源采样用: 图元法线的范围(锥轴axis与半角余弦cosTheta), 默认认为各个方向都可能
+    virtual void getNormalBounds(Vector3f &axis, float &cosTheta) { axis = Vector3f(0, 0, 1); cosTheta = -1; }
+    // 光源采样用: 将发光物体展开为参与采样的发光图元(如MeshTriangle展开为其中的三角形)
+    virtual void getEmitters(std::vector<Object*> &emitters) { if (hasEmit()) emitters.push_back(this); }
+    // k-d树构建用: 将物体展开为直接参与求交的图元(如MeshTriangle展开为其中的三角形与四边形)
+    virtual void getPrimitives(std::vector<Object*> &prims) { prims.push_back(this); }
+
+    const PrimitiveType primitiveType;
 };
 
 
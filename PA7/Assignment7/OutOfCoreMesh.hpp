@@ -0,0 +1,397 @@
+//
+// Out-of-core triangle mesh: clusters paged in from disk under a memory budget.
+//
+
+#ifndef RAYTRACING_OUTOFCOREMESH_H
+#define RAYTRACING_OUTOFCOREMESH_H
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <unistd.h>
+#include "Trace.hpp"
+#include "MeshTriangle.hpp"
+
+// 网格预先转换为簇文件: 三角形按空间位置分成若干簇, 每簇的顶点连续存放.
+// 渲染时只有簇的包围盒常驻内存, 顶层BVH遍历到某个簇时才从文件载入其三角形并建立簇内BVH,
+// 载入的簇按LRU保存在缓存中, 总大小超过memoryBudget时淘汰最久未使用的簇.
+// 簇数据用shared_ptr管理, 被淘汰时正在使用它的求交仍然持有引用, 用完后才释放.
+// 读文件与建立簇内BVH不持有锁, 多个线程可以同时载入不同的簇; 同一个簇只由一个线程载入, 其余线程等待
+//
+// 簇文件格式(小端):
+//   "PA7CLU01", uint32 簇数, uint32 三角形总数
+//   每个簇: uint64 数据偏移, uint32 三角形数, float 包围盒pMin[3], pMax[3], float 面积
+//   数据: 每个三角形9个float(三个顶点)
+class OutOfCoreMesh : public Object
+{
+public:
+    struct Stats {
+        size_t hits = 0;            // 访问时簇已在缓存中
+        size_t misses = 0;          // 访问时需要从文件载入
+        size_t evictions = 0;
+        size_t bytesLoaded = 0;
+        size_t residentBytes = 0;   // 缓存中簇的(估计)内存占用
+        size_t peakResidentBytes = 0;
+        size_t readErrors = 0;      // 读取失败的次数, 失败的簇不进入缓存, 下次访问时重新读取
+    };
+
+    // 把OBJ网格(经transform变换后)转换为簇文件, 每簇不超过maxTrianglesPerCluster个三角形.
+    // 簇由三角形质心沿最长轴递归对半划分得到, 相邻的三角形位于同一簇.
+    // 转换是一次性的离线步骤, 整个网格会读入内存; 只有渲染时是out-of-core的
+    static bool Convert(const std::string& objPath, const std::string& clusterPath,
+                        const Transform& transform = Transform(), int maxTrianglesPerCluster = 1024)
+    {
+        objl::Loader loader;
+        if (!loader.LoadFile(objPath) || loader.LoadedMeshes.size() != 1)
+            return false;
+        const auto& mesh = loader.LoadedMeshes[0];
+        std::vector<std::array<Vector3f, 3>> tris(mesh.Vertices.size() / 3);
+        for (size_t i = 0; i < tris.size(); ++i)
+            for (int j = 0; j < 3; ++j) {
+                const auto& p = mesh.Vertices[3 * i + j].Position;
+                tris[i][j] = transform.point(Vector3f(p.X, p.Y, p.Z));
+            }
+
+        std::vector<std::pair<size_t, size_t>> ranges;
+        splitClusters(tris, 0, tris.size(), std::max(1, maxTrianglesPerCluster), ranges);
+
+        FILE* fp = fopen(clusterPath.c_str(), "wb");
+        if (!fp)
+            return false;
+        uint32_t header[2] = {(uint32_t)ranges.size(), (uint32_t)tris.size()};
+        bool ok = fwrite(kMagic, 1, 8, fp) == 8 && fwrite(header, sizeof(uint32_t), 2, fp) == 2;
+        uint64_t offset = 16 + ranges.size() * kEntrySize;
+        for (auto& r : ranges) {
+            Bounds3 b;
+            float area = 0;
+            for (size_t i = r.first; i < r.second; ++i) {
+                b = Union(Union(Union(b, tris[i][0]), tris[i][1]), tris[i][2]);
+                area += crossProduct(tris[i][1] - tris[i][0], tris[i][2] - tris[i][0]).norm() * 0.5f;
+            }
+            uint32_t count = r.second - r.first;
+            float box[7] = {b.pMin.x, b.pMin.y, b.pMin.z, b.pMax.x, b.pMax.y, b.pMax.z, area};
+            ok = ok && fwrite(&offset, sizeof(uint64_t), 1, fp) == 1 && fwrite(&count, sizeof(uint32_t), 1, fp) == 1 &&
+                 fwrite(box, sizeof(float), 7, fp) == 7;
+            offset += count * 9 * sizeof(float);
+        }
+        for (size_t i = 0; ok && i < tris.size(); ++i) {
+            float v[9];
+            for (int j = 0; j < 3; ++j) {
+                v[3 * j] = tris[i][j].x;
+                v[3 * j + 1] = tris[i][j].y;
+                v[3 * j + 2] = tris[i][j].z;
+            }
+            ok = fwrite(v, sizeof(float), 9, fp) == 9;
+        }
+        return fclose(fp) == 0 && ok;
+    }
+
+    // 打开簇文件, 只读入簇表并在簇的包围盒上建立顶层BVH. memoryBudget为缓存中簇数据的字节数上限
+    OutOfCoreMesh(const std::string& clusterPath, Material* mt, size_t memoryBudget)
+        : m(mt), memoryBudget(memoryBudget)
+    {
+        file = fopen(clusterPath.c_str(), "rb");
+        if (file)
+            fd = fileno(file);
+        char magic[8];
+        uint32_t header[2];
+        if (!file || fread(magic, 1, 8, file) != 8 || memcmp(magic, kMagic, 8) != 0 ||
+            fread(header, sizeof(uint32_t), 2, file) != 2) {
+            std::cerr << "failed to open cluster file " << clusterPath << "\n";
+            return;
+        }
+        numTriangles = header[1];
+        clusters.reserve(header[0]);
+        for (uint32_t i = 0; i < header[0]; ++i) {
+            uint64_t offset;
+            uint32_t count;
+            float box[7];
+            if (fread(&offset, sizeof(uint64_t), 1, file) != 1 || fread(&count, sizeof(uint32_t), 1, file) != 1 ||
+                fread(box, sizeof(float), 7, file) != 7) {
+                std::cerr << "truncated cluster file " << clusterPath << "\n";
+                clusters.clear();
+                return;
+            }
+            clusters.emplace_back(new Cluster(this, i, offset, count,
+                                              Bounds3(Vector3f(box[0], box[1], box[2]), Vector3f(box[3], box[4], box[5])),
+                                              box[6]));
+            bounding_box = Union(bounding_box, clusters.back()->bounds);
+            area += box[6];
+        }
+
+        std::vector<Object*> ptrs;
+        for (auto& c : clusters)
+            ptrs.push_back(c.get());
+        bvh = std::make_unique<BVHAccel>(ptrs, 1, BVHAccel::SplitMethod::SAH);
+    }
+
+    ~OutOfCoreMesh()
+    {
+        if (file)
+            fclose(file);
+    }
+
+    Stats stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return cacheStats;
+    }
+    size_t clusterCount() const { return clusters.size(); }
+
+    bool intersect(const Ray& ray) { return true; }
+    bool intersect(const Ray& ray, float& tnear, uint32_t& index) const { return false; }
+    Intersection getIntersection(Ray ray)
+    {
+        HitRecord hit;
+        if (!intersectHit(ray, hit))
+            return Intersection();
+        return evalHit(ray, hit);
+    }
+    bool intersectHit(const Ray& ray, HitRecord& hit) { return bvh && bvh->IntersectHit(ray, hit); }
+    bool occluded(const Ray& ray) { return bvh && bvh->IntersectP(ray); }
+    // hit.prim总是某个簇
+    Intersection evalHit(const Ray& ray, const HitRecord& hit) { return hit.prim->evalHit(ray, hit); }
+    void getSurfaceProperties(const Vector3f&, const Vector3f&, const uint32_t&, const Vector2f&, Vector3f&,
+                              Vector2f&) const {}
+    Vector3f evalDiffuseColor(const Vector2f&) const { return Vector3f(0.5f); }
+    Bounds3 getBounds() { return bounding_box; }
+    float getArea() { return area; }
+    void Sample(Intersection& pos, float& pdf)
+    {
+        bvh->Sample(pos, pdf);
+        pos.emit = m->getEmission();
+    }
+    bool hasEmit() { return m->hasEmission(); }
+    Vector3f getEmission() { return m->getEmission(); }
+
+    Bounds3 bounding_box;
+    uint32_t numTriangles = 0;
+    float area = 0;
+    Material* m;
+
+private:
+    static constexpr char kMagic[8] = {'P', 'A', '7', 'C', 'L', 'U', '0', '1'};
+    static constexpr size_t kEntrySize = sizeof(uint64_t) + sizeof(uint32_t) + 7 * sizeof(float);
+
+    // 载入内存的簇: 三角形与簇内BVH
+    struct ClusterData {
+        std::vector<Triangle> triangles;
+        std::unique_ptr<BVHAccel> bvh;
+        size_t bytes = 0;
+    };
+
+    // 常驻内存的簇代理, 作为顶层BVH的图元; 求交时通过所属网格的缓存取得簇数据.
+    // 命中时hit.prim为簇本身, hit.primID为簇内三角形的编号, 簇数据被淘汰后仍可以重新载入计算交点属性
+    class Cluster : public Object
+    {
+    public:
+        Cluster(OutOfCoreMesh* mesh, uint32_t id, uint64_t offset, uint32_t count, const Bounds3& bounds, float area)
+            : mesh(mesh), id(id), offset(offset), count(count), bounds(bounds), area(area) {}
+
+        bool intersect(const Ray& ray) { return true; }
+        bool intersect(const Ray& ray, float& tnear, uint32_t& index) const { return false; }
+        Intersection getIntersection(Ray ray)
+        {
+            HitRecord hit;
+            if (!intersectHit(ray, hit))
+                return Intersection();
+            return evalHit(ray, hit);
+        }
+        bool intersectHit(const Ray& ray, HitRecord& hit)
+        {
+            std::shared_ptr<ClusterData> data = mesh->acquire(*this);
+            HitRecord local = hit;
+            local.prim = nullptr;
+            if (!data->bvh->IntersectHit(ray, local))
+                return false;
+            hit = local;
+            hit.primID = static_cast<Triangle*>(local.prim) - data->triangles.data();
+            hit.prim = this;
+            return true;
+        }
+        bool occluded(const Ray& ray) { return mesh->acquire(*this)->bvh->IntersectP(ray); }
+        Intersection evalHit(const Ray& ray, const HitRecord& hit)
+        {
+            std::shared_ptr<ClusterData> data = mesh->acquire(*this);
+            Triangle& tri = data->triangles[hit.primID];
+            HitRecord local = hit;
+            local.prim = &tri;
+            Intersection inter = tri.evalHit(ray, local);
+            // 三角形可能随簇一起被淘汰, 交点只引用常驻的簇
+            inter.obj = this;
+            return inter;
+        }
+        void getSurfaceProperties(const Vector3f&, const Vector3f&, const uint32_t&, const Vector2f&, Vector3f&,
+                                  Vector2f&) const {}
+        Vector3f evalDiffuseColor(const Vector2f&) const { return Vector3f(0.5f); }
+        Bounds3 getBounds() { return bounds; }
+        float getArea() { return area; }
+        // 在簇内按面积均匀采样
+        void Sample(Intersection& pos, float& pdf)
+        {
+            std::shared_ptr<ClusterData> data = mesh->acquire(*this);
+            if (data->triangles.empty()) {
+                // 读取失败的空簇: 采样点不发光, 不贡献直接光照
+                pos = Intersection();
+                pos.obj = this;
+                pdf = 1.0f / area;
+                return;
+            }
+            float p = get_random_float() * area;
+            Triangle* tri = &data->triangles.back();
+            for (auto& t : data->triangles) {
+                if (p < t.area) {
+                    tri = &t;
+                    break;
+                }
+                p -= t.area;
+            }
+            tri->Sample(pos, pdf);
+            pos.obj = this;
+            pdf = 1.0f / area;
+        }
+        bool hasEmit() { return mesh->hasEmit(); }
+        Vector3f getEmission() { return mesh->getEmission(); }
+
+        OutOfCoreMesh* mesh;
+        uint32_t id;
+        uint64_t offset;
+        uint32_t count;
+        Bounds3 bounds;
+        float area;
+        // 缓存状态, 由mesh->mutex保护. loading为true时有线程正在载入该簇
+        bool loading = false;
+        bool readFailed = false;
+        std::shared_ptr<ClusterData> resident;
+        std::list<uint32_t>::iterator lruEntry;
+    };
+
+    static void splitClusters(std::vector<std::array<Vector3f, 3>>& tris, size_t begin, size_t end, int maxCount,
+                              std::vector<std::pair<size_t, size_t>>& ranges)
+    {
+        if (end - begin <= (size_t)maxCount) {
+            ranges.emplace_back(begin, end);
+            return;
+        }
+        Bounds3 centroids;
+        for (size_t i = begin; i < end; ++i)
+            centroids = Union(centroids, (tris[i][0] + tris[i][1] + tris[i][2]) / 3);
+        int axis = centroids.maxExtent();
+        size_t mid = begin + (end - begin) / 2;
+        std::nth_element(tris.begin() + begin, tris.begin() + mid, tris.begin() + end,
+                         [axis](const std::array<Vector3f, 3>& a, const std::array<Vector3f, 3>& b) {
+                             return (a[0] + a[1] + a[2])[axis] < (b[0] + b[1] + b[2])[axis];
+                         });
+        splitClusters(tris, begin, mid, maxCount, ranges);
+        splitClusters(tris, mid, end, maxCount, ranges);
+    }
+
+    // 取得簇数据: 在缓存中时移到LRU队首, 否则从文件载入, 并淘汰最久未使用的簇直到不超过内存预算.
+    // 刚载入的簇即使单独超过预算也会被返回. 锁只保护缓存状态, 读文件与建立BVH在锁外进行.
+    // 读取失败时计入readErrors并返回本次使用的空簇, 失败的结果不进入缓存
+    std::shared_ptr<ClusterData> acquire(Cluster& c)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        // 其他线程正在载入这个簇时等它完成; 载入失败时由本线程重新读取
+        loaded.wait(lock, [&c] { return !c.loading; });
+        if (c.resident) {
+            ++cacheStats.hits;
+            lru.splice(lru.begin(), lru, c.lruEntry);
+            return c.resident;
+        }
+        ++cacheStats.misses;
+        c.loading = true;
+        lock.unlock();
+
+        std::shared_ptr<ClusterData> data = load(c);
+
+        lock.lock();
+        c.loading = false;
+        if (!data) {
+            ++cacheStats.readErrors;
+            // 每个簇只报告第一次失败
+            bool report = !c.readFailed;
+            c.readFailed = true;
+            lock.unlock();
+            loaded.notify_all();
+            if (report)
+                fprintf(stderr, "failed to read cluster %u\n", c.id);
+            return emptyCluster();
+        }
+        cacheStats.bytesLoaded += c.count * 9 * sizeof(float);
+        while (!lru.empty() && cacheStats.residentBytes + data->bytes > memoryBudget) {
+            Cluster& victim = *clusters[lru.back()];
+            cacheStats.residentBytes -= victim.resident->bytes;
+            victim.resident.reset();
+            lru.pop_back();
+            ++cacheStats.evictions;
+        }
+        c.resident = data;
+        lru.push_front(c.id);
+        c.lruEntry = lru.begin();
+        cacheStats.residentBytes += data->bytes;
+        cacheStats.peakResidentBytes = std::max(cacheStats.peakResidentBytes, cacheStats.residentBytes);
+        lock.unlock();
+        loaded.notify_all();
+        return data;
+    }
+
+    // 从文件读入簇的三角形并建立簇内BVH, 不访问缓存状态. 用pread读取, 多个线程可以同时读同一个文件;
+    // off_t为64位(_FILE_OFFSET_BITS=64), 超过2GB的偏移也能定位. 读取失败时返回空指针
+    std::shared_ptr<ClusterData> load(const Cluster& c) const
+    {
+        TRACE_SCOPE("load cluster", c.id);
+        std::vector<float> v(c.count * 9);
+        char* dst = reinterpret_cast<char*>(v.data());
+        size_t remaining = v.size() * sizeof(float);
+        off_t offset = (off_t)c.offset;
+        while (remaining > 0) {
+            ssize_t n = pread(fd, dst, remaining, offset);
+            if (n <= 0)
+                return nullptr;
+            dst += n;
+            remaining -= n;
+            offset += n;
+        }
+
+        auto data = std::make_shared<ClusterData>();
+        data->triangles.reserve(c.count);
+        for (uint32_t i = 0; i < c.count; ++i)
+            data->triangles.emplace_back(Vector3f(v[9 * i], v[9 * i + 1], v[9 * i + 2]),
+                                         Vector3f(v[9 * i + 3], v[9 * i + 4], v[9 * i + 5]),
+                                         Vector3f(v[9 * i + 6], v[9 * i + 7], v[9 * i + 8]), m);
+        std::vector<Object*> ptrs;
+        for (auto& tri : data->triangles)
+            ptrs.push_back(&tri);
+        data->bvh = std::make_unique<BVHAccel>(ptrs, 1, BVHAccel::SplitMethod::NAIVE, false);
+        // 估计的内存占用: 三角形, 约2n个BVH节点与图元指针
+        data->bytes = c.count * (sizeof(Triangle) + 2 * sizeof(BVHBuildNode) + sizeof(Object*));
+        return data;
+    }
+
+    // 读取失败时本次查询使用的空簇: 没有三角形, 不会被命中
+    static std::shared_ptr<ClusterData> emptyCluster()
+    {
+        auto data = std::make_shared<ClusterData>();
+        data->bvh = std::make_unique<BVHAccel>(std::vector<Object*>(), 1, BVHAccel::SplitMethod::NAIVE, false);
+        return data;
+    }
+
+    FILE* file = nullptr;
+    int fd = -1;                // file的文件描述符, 供load中的pread使用
+    std::vector<std::unique_ptr<Cluster>> clusters;
+    std::unique_ptr<BVHAccel> bvh;
+    size_t memoryBudget;
+    mutable std::mutex mutex;
+    std::condition_variable loaded;     // 某个簇载入结束(成功或失败)时通知等待的线程
+    std::list<uint32_t> lru;    // 队首为最近使用的簇
+    Stats cacheStats;
+};
+
+#endif //RAYTRACING_OUTOFCOREMESH_H
@@ -0,0 +1,34 @@
+//
+// Leaf primitive tests shared by the acceleration structures.
+//
+
+#ifndef RAYTRACING_PRIMITIVEDISPATCH_H
+#define RAYTRACING_PRIMITIVEDISPATCH_H
+
+#include "Object.hpp"
+#include "Quad.hpp"
+#include "Sphere.hpp"
+#include "Triangle.hpp"
+
+// 叶子图元的求交按类型分派: Triangle, Quad与Sphere是final类, static_cast之后的调用不经过虚函数表并可以内联
+inline bool intersectPrimitive(Object *prim, const Ray &ray, HitRecord &hit)
+{
+    switch (prim->primitiveType) {
+        case PrimitiveType::TRIANGLE: return static_cast<Triangle*>(prim)->intersectHit(ray, hit);
+        case PrimitiveType::QUAD: return static_cast<Quad*>(prim)->intersectHit(ray, hit);
+        case PrimitiveType::SPHERE: return static_cast<Sphere*>(prim)->intersectHit(ray, hit);
+        default: return prim->intersectHit(ray, hit);
+    }
+}
+
+inline bool occludedPrimitive(Object *prim, const Ray &ray)
+{
+    switch (prim->primitiveType) {
+        case PrimitiveType::TRIANGLE: return static_cast<Triangle*>(prim)->occluded(ray);
+        case PrimitiveType::QUAD: return static_cast<Quad*>(prim)->occluded(ray);
+        case PrimitiveType::SPHERE: return static_cast<Sphere*>(prim)->occluded(ray);
+        default: return prim->occluded(ray);
+    }
+}
+
+#endif //RAYTRACING_PRIMITIVEDISPATCH_H
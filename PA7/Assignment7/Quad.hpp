@@ -0,0 +1,172 @@
+//
+// Parallelogram primitive, used for planar faces that come in as two triangles.
+//
+
+#ifndef RAYTRACING_QUAD_H
+#define RAYTRACING_QUAD_H
+
+#include <array>
+#include <map>
+#include <vector>
+#include "Object.hpp"
+#include "Intersection.hpp"
+#include "Material.hpp"
+#include "RayCounters.hpp"
+
+// 平行四边形, 四个顶点为p0, p0+ea, p0+ea+eb, p0+eb. 与Triangle一样是单面的, 法线为ea x eb的方向
+class Quad final : public Object
+{
+public:
+    Vector3f p0, ea, eb;
+    Vector3f normal;
+    float area;
+    Material* m;
+
+    Quad(const Vector3f& p0, const Vector3f& ea, const Vector3f& eb, Material* m = nullptr)
+        : Object(PrimitiveType::QUAD), m(m)
+    {
+        setVertices(p0, ea, eb);
+    }
+
+    void setVertices(const Vector3f& _p0, const Vector3f& _ea, const Vector3f& _eb)
+    {
+        p0 = _p0;
+        ea = _ea;
+        eb = _eb;
+        Vector3f n = crossProduct(ea, eb);
+        area = n.norm();
+        normal = n / area;
+    }
+
+    bool intersect(const Ray& ray) override { return true; }
+    bool intersect(const Ray& ray, float& tnear, uint32_t& index) const override { return false; }
+
+    Intersection getIntersection(Ray ray) override
+    {
+        HitRecord hit;
+        if (!intersectHit(ray, hit))
+            return {};
+        return evalHit(ray, hit);
+    }
+
+    // 与三角形相同的Moller-Trumbore算法, 只是重心坐标的范围变为u, v各自在[0, 1]内
+    bool intersectHit(const Ray& ray, HitRecord& hit) override
+    {
+        ++rayCounters.triangles;
+        if (dotProduct(ray.direction, normal) > 0)
+            return false;
+        Vector3f pvec = crossProduct(ray.direction, eb);
+        double det = dotProduct(ea, pvec);
+        if (fabs(det) < EPSILON)
+            return false;
+
+        double det_inv = 1. / det;
+        Vector3f tvec = ray.origin - p0;
+        double u = dotProduct(tvec, pvec) * det_inv;
+        if (u < 0 || u > 1)
+            return false;
+        Vector3f qvec = crossProduct(tvec, ea);
+        double v = dotProduct(ray.direction, qvec) * det_inv;
+        if (v < 0 || v > 1)
+            return false;
+        double t = dotProduct(eb, qvec) * det_inv;
+        if (t < ray.t_min || t >= hit.t)
+            return false;
+
+        hit.t = t;
+        hit.prim = this;
+        hit.u = u;
+        hit.v = v;
+        return true;
+    }
+
+    bool occluded(const Ray& ray) override
+    {
+        HitRecord hit;
+        hit.t = ray.t_max;
+        return intersectHit(ray, hit);
+    }
+
+    Intersection evalHit(const Ray& ray, const HitRecord& hit) override
+    {
+        Intersection inter;
+        inter.distance = hit.t;
+        inter.coords = ray(hit.t);
+        inter.happened = true;
+        inter.m = m;
+        inter.normal = normal;
+        inter.obj = this;
+        return inter;
+    }
+
+    void getSurfaceProperties(const Vector3f& P, const Vector3f& I, const uint32_t& index, const Vector2f& uv,
+                              Vector3f& N, Vector2f& st) const override
+    {
+        N = normal;
+    }
+    Vector3f evalDiffuseColor(const Vector2f&) const override { return Vector3f(0.5, 0.5, 0.5); }
+
+    Bounds3 getBounds() override { return Union(Union(Bounds3(p0, p0 + ea), p0 + eb), p0 + ea + eb); }
+
+    Bounds3 getClippedBounds(const Bounds3& box) override
+    {
+        Vector3f poly[4] = {p0, p0 + ea, p0 + ea + eb, p0 + eb};
+        return ClipPolygonBounds(poly, 4, box);
+    }
+
+    // 在平行四边形上均匀采样
+    void Sample(Intersection& pos, float& pdf) override
+    {
+        pos.coords = p0 + ea * get_random_float() + eb * get_random_float();
+        pos.normal = normal;
+        pos.emit = m->getEmission();
+        pdf = 1.0f / area;
+    }
+    float getArea() override { return area; }
+    bool hasEmit() override { return m->hasEmission(); }
+    Vector3f getEmission() override { return m->getEmission(); }
+    void getNormalBounds(Vector3f& axis, float& cosTheta) override
+    {
+        axis = normal;
+        cosTheta = 1;
+    }
+};
+
+// 把共享一条边且合起来恰好是平行四边形的三角形对合并为四边形. 两个三角形的绕序必须一致(共享边方向相反),
+// 第四个顶点与平行四边形的偏差超过边长的1e-4时不合并, 这样只有真正的平行四边形会被替换, 几何形状不变.
+// 被合并的三角形从faces中移除, 合并结果以(p0, p0+ea, p0+eb)三个点追加到quads
+inline void MergeTrianglePairs(std::vector<std::array<Vector3f, 3>>& faces, std::vector<std::array<Vector3f, 3>>& quads)
+{
+    auto key = [](const Vector3f& a, const Vector3f& b) { return std::array<float, 6>{a.x, a.y, a.z, b.x, b.y, b.z}; };
+    // 有向边 -> (三角形, 边在三角形中的序号)
+    std::map<std::array<float, 6>, std::pair<int, int>> edges;
+    for (int f = 0; f < (int)faces.size(); ++f)
+        for (int e = 0; e < 3; ++e)
+            edges.emplace(key(faces[f][e], faces[f][(e + 1) % 3]), std::make_pair(f, e));
+
+    std::vector<bool> merged(faces.size(), false);
+    for (int f = 0; f < (int)faces.size(); ++f) {
+        for (int e = 0; e < 3 && !merged[f]; ++e) {
+            const Vector3f &p = faces[f][e], &q = faces[f][(e + 1) % 3], &r = faces[f][(e + 2) % 3];
+            auto it = edges.find(key(q, p));
+            if (it == edges.end() || it->second.first == f || merged[it->second.first])
+                continue;
+            int g = it->second.first;
+            const Vector3f &s = faces[g][(it->second.second + 2) % 3];
+            // 共享边pq是平行四边形rpsq的对角线
+            Vector3f ea = p - r, eb = q - r;
+            float tolerance = 1e-4f * (ea.norm() + eb.norm());
+            if ((s - (r + ea + eb)).norm() > tolerance || crossProduct(ea, eb).norm() == 0)
+                continue;
+            quads.push_back({r, p, q});
+            merged[f] = merged[g] = true;
+        }
+    }
+    std::vector<std::array<Vector3f, 3>> rest;
+    for (int f = 0; f < (int)faces.size(); ++f)
+        if (!merged[f])
+            rest.push_back(faces[f]);
+    faces.swap(rest);
+}
+
+#endif //RAYTRACING_QUAD_H
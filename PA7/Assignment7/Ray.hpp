@@ -25,4 +25,19 @@ struct Ray{
         return os;
     }
 };
+
+// 批量查询(Scene::intersect/occluded)用的紧凑光线, 只在(tMin, tMax)内求交
+struct RayDesc{
+    Vector3f origin;
+    Vector3f direction;
+    float tMin = 0;
+    float tMax = std::numeric_limits<float>::infinity();
+
+    Ray toRay() const {
+        Ray ray(origin, direction);
+        ray.t_min = tMin;
+        ray.t_max = tMax;
+        return ray;
+    }
+};
 #endif //RAYTRACING_RAY_H
@@ -0,0 +1,20 @@
+//
+// Per-thread counters of traversal and shading work.
+//
+
+#ifndef RAYTRACING_RAYCOUNTERS_H
+#define RAYTRACING_RAYCOUNTERS_H
+
+#include <cstdint>
+
+// 每个线程独立累加的开销计数器, 不需要同步. Renderer在每个像素前后读取差值得到该像素的开销
+struct RayCounters
+{
+    uint64_t nodes = 0;         // BVH节点的包围盒测试次数
+    uint64_t triangles = 0;     // 光线与三角形(及四边形)求交次数
+    uint64_t pathVertices = 0;  // 路径与场景的交点数(即路径长度之和)
+};
+
+inline thread_local RayCounters rayCounters;
+
+#endif //RAYTRACING_RAYCOUNTERS_H
@@ -0,0 +1,223 @@
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "RenderServer.hpp"
+
+namespace {
+
+// 从文件描述符中按行读取(stdin与套接字通用)
+class LineReader
+{
+public:
+    explicit LineReader(int fd) : fd(fd) {}
+
+    bool next(std::string &line)
+    {
+        while (true) {
+            size_t newline = buffer.find('\n');
+            if (newline != std::string::npos) {
+                line = buffer.substr(0, newline);
+                buffer.erase(0, newline + 1);
+                if (!line.empty() && line.back() == '\r')
+                    line.pop_back();
+                return true;
+            }
+            char chunk[4096];
+            ssize_t n = read(fd, chunk, sizeof(chunk));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                // 最后一行可能没有换行符
+                if (buffer.empty())
+                    return false;
+                line.swap(buffer);
+                buffer.clear();
+                return true;
+            }
+            buffer.append(chunk, n);
+        }
+    }
+
+private:
+    int fd;
+    std::string buffer;
+};
+
+void writeAll(int fd, const std::string &text)
+{
+    for (size_t done = 0; done < text.size();) {
+        ssize_t n = write(fd, text.data() + done, text.size() - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;     // 对端已关闭, 应答直接丢弃
+        done += n;
+    }
+}
+
+}
+
+bool RenderServer::Serve(int inFd, int outFd)
+{
+    std::mutex outputMutex;
+    auto send = [&](const std::string &message) {
+        std::lock_guard<std::mutex> lock(outputMutex);
+        writeAll(outFd, message + "\n");
+    };
+
+    // 最多只保留一个待渲染的请求: 新请求直接替换尚未开始的旧请求, 并取消正在渲染的请求
+    std::mutex mutex;
+    std::condition_variable wake;
+    RenderOptions pending;
+    int pendingId = 0;
+    bool hasPending = false, closing = false;
+    std::atomic<bool> cancel{false};
+
+    std::thread worker([&] {
+        Renderer renderer;
+        while (true) {
+            RenderOptions job;
+            int id;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return hasPending || closing; });
+                if (!hasPending)
+                    return;
+                job = pending;
+                id = pendingId;
+                hasPending = false;
+                cancel = false;
+            }
+            int lastPercent = -1;
+            job.cancel = &cancel;
+            job.onProgress = [&](float done) {
+                int percent = int(done * 100);
+                if (percent != lastPercent) {
+                    lastPercent = percent;
+                    send("progress " + std::to_string(id) + " " + std::to_string(percent));
+                }
+            };
+            auto start = std::chrono::steady_clock::now();
+            bool ok = renderer.Render(scene, job);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            if (ok)
+                send("done " + std::to_string(id) + " " + job.imagePath + " " + std::to_string(int(ms)));
+            else
+                send((cancel ? "cancelled " : "failed ") + std::to_string(id));
+        }
+    });
+
+    send("ready");
+    LineReader reader(inFd);
+    std::string line;
+    bool quit = false;
+    int nextId = 1;
+    while (reader.next(line)) {
+        size_t first = line.find_first_not_of(" \t");
+        if (first == std::string::npos || line[first] == '#')
+            continue;
+        std::istringstream in(line);
+        std::string command;
+        in >> command;
+        if (command == "quit") {
+            quit = true;
+            break;
+        }
+        if (command == "cancel") {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (hasPending)
+                send("cancelled " + std::to_string(pendingId));
+            hasPending = false;
+            cancel = true;
+            continue;
+        }
+
+        RenderOptions job = defaults;
+        std::string error;
+        in.clear();
+        in.seekg(0);
+        if (!Renderer::ParseOptions(in, job, error)) {
+            send("error " + error);
+            continue;
+        }
+        if (costAOV)
+            job.costPrefix = job.imagePath.substr(0, job.imagePath.rfind('.'));
+        int id = nextId++;
+        send("accepted " + std::to_string(id));
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (hasPending)
+                send("cancelled " + std::to_string(pendingId));
+            pending = job;
+            pendingId = id;
+            hasPending = true;
+            cancel = true;
+        }
+        wake.notify_one();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing = true;
+        if (quit) {
+            hasPending = false;
+            cancel = true;
+        }
+    }
+    wake.notify_one();
+    worker.join();
+    return !quit;
+}
+
+bool RenderServer::ServeSocket(const std::string &path)
+{
+    // 客户端中途断开时写应答不应终止进程
+    signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "socket path too long: " << path << "\n";
+        return false;
+    }
+    strcpy(address.sun_path, path.c_str());
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        std::cerr << "socket: " << strerror(errno) << "\n";
+        return false;
+    }
+    unlink(path.c_str());
+    if (bind(listener, (sockaddr*)&address, sizeof(address)) < 0 || listen(listener, 8) < 0) {
+        std::cerr << "failed to listen on " << path << ": " << strerror(errno) << "\n";
+        close(listener);
+        return false;
+    }
+    std::cout << "Listening on " << path << std::endl;
+
+    while (true) {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "accept: " << strerror(errno) << "\n";
+            break;
+        }
+        bool keepServing = Serve(client, client);
+        close(client);
+        if (!keepServing)
+            break;
+    }
+    close(listener);
+    unlink(path.c_str());
+    return true;
+}
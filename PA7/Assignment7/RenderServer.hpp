@@ -0,0 +1,41 @@
+//
+// Long-lived render process that keeps one scene resident and serves render requests.
+//
+
+#ifndef RAYTRACING_RENDERSERVER_H
+#define RAYTRACING_RENDERSERVER_H
+
+#include <string>
+#include "Renderer.hpp"
+
+// 常驻渲染服务: 场景与BVH只构建一次, 之后按行接收渲染请求, 每行的格式与批量任务文件相同(见Renderer::ParseOptions),
+// 未给出的项取defaults. 请求在一个后台线程中依次渲染, 新的请求到达时正在渲染的请求被取消.
+// 应答每行一条:
+//   ready                    开始接收请求
+//   accepted ID              请求已收到, ID从1开始编号
+//   progress ID PERCENT      渲染进度(整数百分比变化时发送)
+//   done ID PATH MS          渲染完成, 图像写到PATH, 用时MS毫秒
+//   cancelled ID             请求被更新的请求或cancel命令取消, 不输出图像
+//   failed ID                图像写入失败
+//   error MESSAGE            请求格式错误
+// 除渲染请求外还接受两个命令: cancel取消当前请求, quit结束服务
+class RenderServer
+{
+public:
+    // costAOV为true时每个请求同时输出开销AOV, 文件名前缀取该请求的输出图像路径去掉扩展名(见RenderOptions::costPrefix)
+    RenderServer(const Scene& scene, const RenderOptions& defaults, bool costAOV = false)
+        : scene(scene), defaults(defaults), costAOV(costAOV) {}
+
+    // 从inFd读取请求, 应答写到outFd. 读到EOF时等待已收到的请求渲染完再返回true, 收到quit时取消渲染并返回false
+    bool Serve(int inFd, int outFd);
+
+    // 在Unix域套接字path上监听, 依次服务每个连接(同一时刻只服务一个连接, 其余连接排队), 直到某个连接发送quit
+    bool ServeSocket(const std::string& path);
+
+private:
+    const Scene& scene;
+    RenderOptions defaults;
+    bool costAOV;
+};
+
+#endif //RAYTRACING_RENDERSERVER_H
@@ -2,57 +2,261 @@
 // Created by goksu on 2/25/20.
 //
 
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
 #include <fstream>
+#include <istream>
+#include <memory>
 #include "Scene.hpp"
 #include "Renderer.hpp"
+#include "Framebuffer.hpp"
+#include "RayCounters.hpp"
+#include "Trace.hpp"
 
 
 inline float deg2rad(const float& deg) { return deg * M_PI / 180.0; }
 
 const float EPSILON = 0.00001;
 
+// 每个像素的开销, 各项为该像素所有采样之和(path为每个采样的平均路径长度)
+struct CostBuffers
+{
+    std::vector<float> time, nodes, triangles, path;
+
+    explicit CostBuffers(int pixels) : time(pixels), nodes(pixels), triangles(pixels), path(pixels) {}
+};
+
+// 输出每个通道的.pfm与伪彩色.ppm(以99百分位数为上限, 避免个别像素压暗整张图), 并统计tile之间的耗时差异.
+// 统计只包括渲染了的像素(count > 0). 有文件写入失败时返回false
+static bool writeCost(const std::string &prefix, int width, int height, const CostBuffers &cost,
+                      const std::vector<uint32_t> &count, int tileSize)
+{
+    std::vector<float> path(cost.path.size());
+    for (size_t i = 0; i < path.size(); ++i)
+        path[i] = count[i] ? cost.path[i] / count[i] : 0;
+
+    // 没有渲染任何像素时不输出
+    if (std::none_of(count.begin(), count.end(), [](uint32_t c) { return c > 0; }))
+        return true;
+
+    bool ok = true;
+    std::pair<const char*, const std::vector<float>*> channels[] = {
+            {"time", &cost.time}, {"nodes", &cost.nodes}, {"tris", &cost.triangles}, {"path", &path}};
+    for (auto &channel : channels) {
+        const std::vector<float> &values = *channel.second;
+        std::vector<float> rendered;
+        double total = 0;
+        size_t maxIndex = 0;
+        for (size_t i = 0; i < values.size(); ++i)
+            if (count[i]) {
+                if (rendered.empty() || values[i] > values[maxIndex])
+                    maxIndex = i;
+                rendered.push_back(values[i]);
+                total += values[i];
+            }
+        std::nth_element(rendered.begin(), rendered.begin() + rendered.size() * 99 / 100, rendered.end());
+        float p99 = rendered[rendered.size() * 99 / 100];
+
+        std::string base = prefix + "_" + channel.first;
+        if (!writePFM(base + ".pfm", width, height, values) || !writeFalseColor(base + ".ppm", width, height, values, p99)) {
+            std::cerr << "failed to write " << base << ".pfm/.ppm\n";
+            ok = false;
+        }
+        printf("Cost %-5s: mean %.1f, p99 %.1f, max %.1f at (%zu, %zu)%s\n", channel.first, total / rendered.size(), p99,
+               values[maxIndex], maxIndex % width, maxIndex / width, channel.second == &cost.time ? " us" : "");
+    }
+
+    // 各tile的耗时, 最大值与平均值之比反映了按tile分配任务时的负载不均衡程度
+    int tilesX = (width + tileSize - 1) / tileSize;
+    std::vector<double> tileTime(Renderer::TileCount(width, height, tileSize));
+    for (int j = 0; j < height; ++j)
+        for (int i = 0; i < width; ++i)
+            tileTime[(j / tileSize) * tilesX + i / tileSize] += cost.time[j * width + i];
+    double sum = 0, maxTime = 0;
+    int rendered = 0;
+    for (double t : tileTime)
+        if (t > 0) {
+            sum += t;
+            maxTime = std::max(maxTime, t);
+            ++rendered;
+        }
+    if (rendered > 0)
+        printf("Tile time: mean %.1f ms, max %.1f ms (%.2fx mean) over %d tiles\n", sum / rendered / 1e3,
+               maxTime / 1e3, maxTime * rendered / sum, rendered);
+    return ok;
+}
+
+int Renderer::TileCount(int width, int height, int tileSize)
+{
+    int tilesX = (width + tileSize - 1) / tileSize;
+    int tilesY = (height + tileSize - 1) / tileSize;
+    return tilesX * tilesY;
+}
+
+bool Renderer::ParseOptions(std::istream& in, RenderOptions& options, std::string& error)
+{
+    std::string key;
+    while (in >> key) {
+        Camera &c = options.camera;
+        bool ok = key == "eye" ? bool(in >> c.position.x >> c.position.y >> c.position.z) :
+                  key == "lookat" ? bool(in >> c.lookAt.x >> c.lookAt.y >> c.lookAt.z) :
+                  key == "up" ? bool(in >> c.up.x >> c.up.y >> c.up.z) :
+                  key == "fov" ? bool(in >> c.fov) :
+                  key == "size" ? bool(in >> options.width >> options.height) :
+                  key == "spp" ? bool(in >> options.spp) :
+                  key == "region" ? bool(in >> options.regionX0 >> options.regionY0 >> options.regionX1 >> options.regionY1) :
+                  key == "output" ? bool(in >> options.imagePath) : false;
+        if (!ok) {
+            error = "bad value for '" + key + "'";
+            return false;
+        }
+    }
+    return true;
+}
+
 // The main render function. This where we iterate over all pixels in the image,
 // generate primary rays and cast these rays into the scene. The content of the
 // framebuffer is saved to a file.
-void Renderer::Render(const Scene& scene)
+// 渲染被options.cancel取消或写文件失败时返回false
+bool Renderer::Render(const Scene& scene, const RenderOptions& options)
 {
-    std::vector<Vector3f> framebuffer(scene.width * scene.height);
+    TRACE_SCOPE("Render");
+    int width = options.width > 0 ? options.width : scene.width;
+    int height = options.height > 0 ? options.height : scene.height;
+    AccumulationBuffer accum(width, height);
 
-    float scale = tan(deg2rad(scene.fov * 0.5));
-    float imageAspectRatio = scene.width / (float)scene.height;
-    Vector3f eye_pos(278, 273, -800);
-    int m = 0;
+    Camera camera = options.camera;
+    camera.computeBasis();
+    float scale = tan(deg2rad(camera.fov * 0.5));
+    float imageAspectRatio = width / (float)height;
+    Vector3f eye_pos = camera.position;
 
-    // change the spp value to change sample ammount
+    // change the spp value (Scene::spp or RenderOptions::spp) to change sample ammount
     // spp: samples per pixel
-    int spp = 16;
-    std::cout << "SPP: " << spp << "\n";
-    for (uint32_t j = 0; j < scene.height; ++j) {
-        for (uint32_t i = 0; i < scene.width; ++i) {
-            // generate primary ray direction
-            float x = (2 * (i + 0.5) / (float)scene.width - 1) *
-                      imageAspectRatio * scale;
-            float y = (1 - 2 * (j + 0.5) / (float)scene.height) * scale;
-
-            Vector3f dir = normalize(Vector3f(-x, y, 1));
-            for (int k = 0; k < spp; k++){
-                framebuffer[m] += scene.castRay(Ray(eye_pos, dir), 0) / spp;  
+    int spp = options.spp > 0 ? options.spp : scene.spp;
+    if (options.progress)
+        std::cout << "SPP: " << spp << "\n";
+
+    // 图像按tileSize*tileSize划分为tile, 按行优先编号, 只渲染[tileBegin, tileEnd)
+    int tileSize = options.tileSize;
+    int tilesX = (width + tileSize - 1) / tileSize;
+    int tileCount = TileCount(width, height, tileSize);
+    int tileBegin = std::max(0, options.tileBegin);
+    int tileEnd = options.tileEnd < 0 ? tileCount : std::min(options.tileEnd, tileCount);
+    if (options.progress && (tileBegin > 0 || tileEnd < tileCount))
+        std::cout << "Tiles: [" << tileBegin << ", " << tileEnd << ") of " << tileCount << "\n";
+
+    // 只渲染区域[regionX0, regionX1) x [regionY0, regionY1)内的像素, 其余像素在图像中为黑色
+    int rx0 = std::max(0, options.regionX0), ry0 = std::max(0, options.regionY0);
+    int rx1 = options.regionX1 < 0 ? width : std::min(options.regionX1, width);
+    int ry1 = options.regionY1 < 0 ? height : std::min(options.regionY1, height);
+
+    // 进度按已完成的采样数计算, 包括路径引导的训练轮
+    int guidingPasses = scene.guide ? scene.guidingPasses : 0;
+    double totalWork = (double)(spp + (1 << guidingPasses) - 1) * std::max(1, tileEnd - tileBegin);
+    double doneWork = 0;
+    std::unique_ptr<CostBuffers> cost;
+    if (!options.costPrefix.empty())
+        cost = std::make_unique<CostBuffers>(width * height);
+    auto cancelled = [&] { return options.cancel && options.cancel->load(std::memory_order_relaxed); };
+
+    auto renderPass = [&](AccumulationBuffer &target, int passSpp) {
+        TRACE_SCOPE("render pass", passSpp);
+        for (int tile = tileBegin; tile < tileEnd; ++tile) {
+            TRACE_SCOPE("tile", tile);
+            int x0 = std::max((tile % tilesX) * tileSize, rx0), y0 = std::max((tile / tilesX) * tileSize, ry0);
+            int x1 = std::min((tile % tilesX) * tileSize + tileSize, rx1);
+            int y1 = std::min((tile / tilesX) * tileSize + tileSize, ry1);
+            for (int j = y0; j < y1 && !cancelled(); ++j) {
+                for (int i = x0; i < x1; ++i) {
+                    // generate primary ray direction
+                    float x = (2 * (i + 0.5) / (float)width - 1) *
+                              imageAspectRatio * scale;
+                    float y = (1 - 2 * (j + 0.5) / (float)height) * scale;
+
+                    Vector3f dir = camera.direction(x, y);
+                    int m = j * width + i;
+                    RayCounters before = rayCounters;
+                    auto pixelStart = cost ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+                    for (int k = 0; k < passSpp; k++){
+                        target.sum[m] += scene.castRay(Ray(eye_pos, dir), 0);
+                    }
+                    target.count[m] += passSpp;
+                    if (cost) {
+                        cost->time[m] += std::chrono::duration<float, std::micro>(
+                                std::chrono::steady_clock::now() - pixelStart).count();
+                        cost->nodes[m] += rayCounters.nodes - before.nodes;
+                        cost->triangles[m] += rayCounters.triangles - before.triangles;
+                        cost->path[m] += rayCounters.pathVertices - before.pathVertices;
+                    }
+                }
             }
-            m++;
+            if (cancelled())
+                break;
+            doneWork += passSpp;
+            if (options.progress)
+                UpdateProgress((tile - tileBegin + 1) / (float)(tileEnd - tileBegin));
+            if (options.onProgress)
+                options.onProgress(doneWork / totalWork);
         }
-        UpdateProgress(j / (float)scene.height);
+        if (options.progress) {
+            UpdateProgress(1.f);
+            std::cout << "\n";
+        }
+    };
+
+    // 路径引导的训练: 第k轮用2^k spp渲染并记录入射radiance, 结束后细分SD-tree.
+    // 每一轮都是无偏的估计, 直接累加到最终结果中, 图像的总采样数为 spp + 2^guidingPasses - 1
+    if (scene.guide) {
+        auto start = std::chrono::steady_clock::now();
+        scene.guide->reset();
+        scene.guide->recording = true;
+        for (int pass = 0; pass < scene.guidingPasses && !cancelled(); ++pass) {
+            if (options.progress)
+                std::cout << "Guiding pass " << pass << " (" << (1 << pass) << " spp)\n";
+            renderPass(accum, 1 << pass);
+            scene.guide->refine(pass);
+        }
+        scene.guide->recording = false;
+        auto stop = std::chrono::steady_clock::now();
+        if (options.progress)
+            std::cout << "Guiding training: " << scene.guidingPasses << " passes, " << scene.guide->leafCount()
+                      << " spatial leaves, " << std::chrono::duration<double>(stop - start).count() << " s\n";
+    }
+
+    // 辐照度缓存只对当前场景有效, 每次渲染前清空
+    if (scene.irradianceCache)
+        scene.irradianceCache->clear();
+
+    auto start = std::chrono::steady_clock::now();
+    renderPass(accum, spp);
+    auto stop = std::chrono::steady_clock::now();
+    // 被取消的渲染不输出任何文件
+    if (cancelled())
+        return false;
+    if (scene.guide && options.progress)
+        std::cout << "Guided render: " << std::chrono::duration<double>(stop - start).count() << " s\n";
+    if (scene.irradianceCache && options.progress) {
+        const IrradianceCache &cache = *scene.irradianceCache;
+        std::cout << "Irradiance cache: " << cache.size() << " records, " << cache.hits << "/" << cache.lookups
+                  << " lookups interpolated, " << std::chrono::duration<double>(stop - start).count() << " s\n";
+    }
+
+    TRACE_SCOPE("write output");
+    bool ok = true;
+    if (cost && !writeCost(options.costPrefix, width, height, *cost, accum.count, tileSize))
+        ok = false;
+    // save accumulation (sum and sample count per pixel) for merging
+    if (!options.accumPath.empty() && !accum.save(options.accumPath)) {
+        std::cerr << "failed to write " << options.accumPath << "\n";
+        ok = false;
     }
-    UpdateProgress(1.f);
 
     // save framebuffer to file
-    FILE* fp = fopen("binary.ppm", "wb");
-    (void)fprintf(fp, "P6\n%d %d\n255\n", scene.width, scene.height);
-    for (auto i = 0; i < scene.height * scene.width; ++i) {
-        static unsigned char color[3];
-        color[0] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].x), 0.6f));
-        color[1] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].y), 0.6f));
-        color[2] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].z), 0.6f));
-        fwrite(color, 1, 3, fp);
+    if (!options.imagePath.empty() && !writePPM(options.imagePath, width, height, accum.resolve())) {
+        std::cerr << "failed to write " << options.imagePath << "\n";
+        ok = false;
     }
-    fclose(fp);    
+    return ok;
 }
@@ -1,7 +1,11 @@
 //
 // Created by goksu on 2/25/20.
 //
+#include <atomic>
+#include <functional>
+#include <string>
 #include "Scene.hpp"
+#include "Camera.hpp"
 
 #pragma once
 struct hit_payload
@@ -12,10 +16,41 @@ struct hit_payload
     Object* hit_obj;
 };
 
+// 渲染选项. 一帧可以拆分到多个独立进程: 每个进程渲染一段tile(按行优先编号)或只渲染一部分采样,
+// 把结果写入累积文件(accumPath), 再由MergeAccum按采样数加权合并成最终图像.
+// 相机与分辨率也在这里指定, 同一个场景可以按不同的RenderOptions渲染多次(也可以在多个线程中同时渲染)
+struct RenderOptions
+{
+    Camera camera;
+    int width = 0, height = 0;              // 0表示使用Scene::width/height
+    int spp = 0;                            // 0表示使用Scene::spp
+    bool progress = true;                   // 是否输出进度条等信息
+    // 只渲染像素区域[regionX0, regionX1) x [regionY0, regionY1), -1表示到图像边界
+    int regionX0 = 0, regionY0 = 0, regionX1 = -1, regionY1 = -1;
+    // 每完成一个tile调用一次, 参数为已完成的比例. 可能在渲染线程中调用
+    std::function<void(float)> onProgress;
+    // 不为空时每渲染一行像素检查一次, 被置为true后渲染尽快结束且不输出文件
+    const std::atomic<bool> *cancel = nullptr;
+    // 不为空时输出每个像素的开销: <costPrefix>_time/_nodes/_tris/_path, 各有原始数值的.pfm与伪彩色的.ppm
+    std::string costPrefix;
+
+    int tileSize = 32;
+    int tileBegin = 0;
+    int tileEnd = -1;                       // [tileBegin, tileEnd), -1表示到最后一个tile
+    std::string imagePath = "binary.ppm";   // 为空时不输出图像
+    std::string accumPath;                  // 为空时不输出累积文件
+};
+
 class Renderer
 {
 public:
-    void Render(const Scene& scene);
+    bool Render(const Scene& scene, const RenderOptions& options = RenderOptions());
+
+    // 从in中读取"关键字 值"形式的渲染参数(eye, lookat, up, fov, size, spp, region, output), 写入options.
+    // 遇到未知关键字或值格式错误时返回false, error中为错误信息
+    static bool ParseOptions(std::istream& in, RenderOptions& options, std::string& error);
+
+    static int TileCount(int width, int height, int tileSize);
 
 private:
 };
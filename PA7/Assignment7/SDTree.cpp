@@ -0,0 +1,224 @@
+#include <algorithm>
+#include <cmath>
+#include "SDTree.hpp"
+#include "global.hpp"
+
+namespace {
+
+// 方向与[0,1]^2的等面积映射: u = (cosθ + 1) / 2, v = φ / 2π
+Vector2f dirToCanonical(const Vector3f &d)
+{
+    float cosTheta = clamp(-1, 1, d.z);
+    float phi = std::atan2(d.y, d.x);
+    if (phi < 0)
+        phi += 2 * M_PI;
+    return Vector2f(clamp(0, 1, (cosTheta + 1) * 0.5f), clamp(0, 1, phi / (2 * M_PI)));
+}
+
+Vector3f canonicalToDir(float u, float v)
+{
+    float cosTheta = 2 * u - 1;
+    float sinTheta = std::sqrt(std::max(0.f, 1 - cosTheta * cosTheta));
+    float phi = 2 * M_PI * v;
+    return Vector3f(sinTheta * std::cos(phi), sinTheta * std::sin(phi), cosTheta);
+}
+
+// 把随机数u按概率p二选一后重新映射回[0,1)
+int choose(float &u, float p)
+{
+    if (u < p) {
+        u = std::min(u / p, 0.99999994f);
+        return 0;
+    }
+    u = std::min((u - p) / (1 - p), 0.99999994f);
+    return 1;
+}
+
+}
+
+void DTree::record(const Vector3f &dir, float value)
+{
+    // 没有radiance的记录同样计入记录次数
+    if (!std::isfinite(value))
+        return;
+    weight += 1;
+    if (value <= 0)
+        return;
+    Vector2f c = dirToCanonical(dir);
+    int node = 0;
+    while (true) {
+        int x = c.x >= 0.5f, y = c.y >= 0.5f;
+        int i = x + 2 * y;
+        nodes[node].sum[i] += value;
+        if (!nodes[node].child[i])
+            break;
+        node = nodes[node].child[i];
+        c = Vector2f(c.x * 2 - x, c.y * 2 - y);
+    }
+}
+
+Vector3f DTree::sample(float u1, float u2) const
+{
+    Vector2f origin(0, 0);
+    float size = 1;
+    int node = 0;
+    while (true) {
+        const float *s = nodes[node].sum;
+        float total = s[0] + s[1] + s[2] + s[3];
+        if (total <= 0)
+            break;
+        // 先选左右两列, 再在选中的列里选上下
+        int x = choose(u1, (s[0] + s[2]) / total);
+        int y = choose(u2, s[x] / (s[x] + s[x + 2]));
+        int i = x + 2 * y;
+        size *= 0.5f;
+        origin = origin + Vector2f(x * size, y * size);
+        if (!nodes[node].child[i])
+            break;
+        node = nodes[node].child[i];
+    }
+    return canonicalToDir(origin.x + u1 * size, origin.y + u2 * size);
+}
+
+float DTree::pdf(const Vector3f &dir) const
+{
+    Vector2f c = dirToCanonical(dir);
+    float p = 1;
+    int node = 0;
+    while (true) {
+        const float *s = nodes[node].sum;
+        float total = s[0] + s[1] + s[2] + s[3];
+        if (total <= 0)
+            break;
+        int x = c.x >= 0.5f, y = c.y >= 0.5f;
+        int i = x + 2 * y;
+        p *= 4 * s[i] / total;
+        if (!nodes[node].child[i] || p == 0)
+            break;
+        node = nodes[node].child[i];
+        c = Vector2f(c.x * 2 - x, c.y * 2 - y);
+    }
+    return p / (4 * M_PI);
+}
+
+void DTree::refine(const DTree &prev, float threshold)
+{
+    nodes.assign(1, Node());
+    weight = 0;
+    float total = prev.total();
+    if (total > 0)
+        refineNode(0, prev, 0, prev.nodes[0].sum, total, threshold, 1);
+}
+
+void DTree::refineNode(int node, const DTree &prev, int prevNode, const float energy[4], float total,
+                       float threshold, int depth)
+{
+    constexpr int maxDepth = 20;
+    for (int i = 0; i < 4; ++i) {
+        if (energy[i] / total <= threshold || depth >= maxDepth)
+            continue;
+        // 上一轮已经细分过的象限沿用子节点的统计量, 否则认为能量在四个子象限中均匀分布
+        int prevChild = prevNode >= 0 ? prev.nodes[prevNode].child[i] : 0;
+        float childEnergy[4];
+        for (int k = 0; k < 4; ++k)
+            childEnergy[k] = prevChild ? prev.nodes[prevChild].sum[k] : energy[i] / 4;
+        int child = nodes.size();
+        nodes.emplace_back();
+        nodes[node].child[i] = child;
+        refineNode(child, prev, prevChild ? prevChild : -1, childEnergy, total, threshold, depth + 1);
+    }
+}
+
+SDTree::SDTree(const Bounds3 &b)
+{
+    // 用包围场景的立方体, 每层依次沿x, y, z轴对半划分
+    Vector3f center = 0.5 * b.pMin + 0.5 * b.pMax;
+    Vector3f d = b.Diagonal();
+    float half = 0.5f * std::max(d.x, std::max(d.y, d.z)) * 1.01f + 1e-3f;
+    bounds = Bounds3(center - Vector3f(half), center + Vector3f(half));
+    reset();
+}
+
+void SDTree::reset()
+{
+    nodes.assign(1, Node());
+    leaves.assign(1, Leaf());
+    iterations = 0;
+}
+
+int SDTree::lookup(const Vector3f &p) const
+{
+    Vector3f o = bounds.Offset(p);
+    int node = 0, axis = 0;
+    while (nodes[node].child[0]) {
+        float &x = o[axis];
+        x = clamp(0, 1, x) * 2;
+        int c = x >= 1;
+        x -= c;
+        node = nodes[node].child[c];
+        axis = (axis + 1) % 3;
+    }
+    return nodes[node].leaf;
+}
+
+int SDTree::normalBin(const Vector3f &N)
+{
+    Vector3f a(std::fabs(N.x), std::fabs(N.y), std::fabs(N.z));
+    int axis = a.x > a.y && a.x > a.z ? 0 : (a.y > a.z ? 1 : 2);
+    return axis * 2 + (N[axis] < 0);
+}
+
+float SDTree::Leaf::weight() const
+{
+    float w = 0;
+    for (auto &t : building)
+        w += t.weight;
+    return w;
+}
+
+void SDTree::record(const Vector3f &p, const Vector3f &N, const Vector3f &wi, const Vector3f &Li, float pdf)
+{
+    if (!(pdf > 0))
+        return;
+    // 按亮度(三个通道的平均)学习方向分布
+    leaves[lookup(p)].building[normalBin(N)].record(wi, (Li.x + Li.y + Li.z) / 3 / pdf);
+}
+
+void SDTree::splitLeaves(int node, int depth, float threshold)
+{
+    constexpr int maxDepth = 24;
+    if (nodes[node].child[0]) {
+        splitLeaves(nodes[node].child[0], depth + 1, threshold);
+        splitLeaves(nodes[node].child[1], depth + 1, threshold);
+        return;
+    }
+    int leaf = nodes[node].leaf;
+    if (leaves[leaf].weight() <= threshold || depth >= maxDepth)
+        return;
+
+    // 两个子节点都继承父节点记录的分布, 记录次数各分一半
+    for (auto &t : leaves[leaf].building)
+        t.weight *= 0.5f;
+    int newLeaf = leaves.size();
+    leaves.push_back(leaves[leaf]);
+    int c0 = nodes.size(), c1 = c0 + 1;
+    nodes.resize(nodes.size() + 2);
+    nodes[c0].leaf = leaf;
+    nodes[c1].leaf = newLeaf;
+    nodes[node].child[0] = c0;
+    nodes[node].child[1] = c1;
+    splitLeaves(c0, depth + 1, threshold);
+    splitLeaves(c1, depth + 1, threshold);
+}
+
+void SDTree::refine(int iteration)
+{
+    splitLeaves(0, 0, spatialThreshold * std::sqrt(std::pow(2.f, (float)iteration)));
+    for (auto &leaf : leaves) {
+        for (int i = 0; i < 6; ++i) {
+            leaf.sampling[i] = leaf.building[i];
+            leaf.building[i].refine(leaf.sampling[i], directionalThreshold);
+        }
+    }
+    ++iterations;
+}
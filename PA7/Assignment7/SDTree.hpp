@@ -0,0 +1,90 @@
+//
+// Spatial-directional tree for path guiding.
+//
+
+#ifndef RAYTRACING_SDTREE_H
+#define RAYTRACING_SDTREE_H
+
+#include <vector>
+#include "Bounds3.hpp"
+#include "Vector.hpp"
+
+// 方向四叉树: 单位球面按(cosθ, φ)等面积映射到[0,1]^2后递归四等分, 每个节点记录四个象限内入射radiance的积分估计
+// 参考 Müller et al., "Practical Path Guiding for Efficient Light-Transport Simulation"
+class DTree {
+public:
+    DTree() : nodes(1) {}
+
+    // 记录一次方向dir上的入射radiance估计(已除以采样pdf)
+    void record(const Vector3f &dir, float value);
+    // 按记录的分布采样方向, u1, u2为[0,1)内的随机数
+    Vector3f sample(float u1, float u2) const;
+    // 立体角测度下的概率密度
+    float pdf(const Vector3f &dir) const;
+
+    // 按另一棵树记录的能量分布细分: 能量占比超过threshold的象限继续四等分, 新树的统计量清零
+    void refine(const DTree &prev, float threshold);
+
+    float total() const { const Node &n = nodes[0]; return n.sum[0] + n.sum[1] + n.sum[2] + n.sum[3]; }
+    float weight = 0;   // 记录次数, 用于决定空间上是否继续细分
+
+private:
+    struct Node {
+        float sum[4] = {0, 0, 0, 0};
+        int child[4] = {0, 0, 0, 0};   // 0表示该象限为叶子(根节点0不会是任何节点的子节点)
+    };
+    std::vector<Node> nodes;
+
+    void refineNode(int node, const DTree &prev, int prevNode, const float energy[4], float total,
+                    float threshold, int depth);
+};
+
+// 空间二叉树(kd-tree)的每个叶子保存方向四叉树: sampling为上一轮训练的结果, 用于采样;
+// building为本轮正在记录的树, 一轮结束后成为新的sampling.
+// 空间叶子较大时其中常有朝向不同的表面(墙角、盒子侧面), 各自的入射分布差别很大且多半位于对方的背面,
+// 因此每个叶子再按着色法线的主轴方向(±x, ±y, ±z)分成6组方向树
+class SDTree {
+public:
+    explicit SDTree(const Bounds3 &bounds);
+
+    // 清空所有训练结果
+    void reset();
+    // 已完成至少一轮训练, 可以用于采样
+    bool canSample() const { return iterations > 0; }
+    // 着色点p(法线N)处用于采样的方向分布
+    const DTree &samplingTree(const Vector3f &p, const Vector3f &N) const
+    { return leaves[lookup(p)].sampling[normalBin(N)]; }
+    // 在着色点p(法线N)记录方向wi上的入射radiance Li, pdf为采样wi的概率密度
+    void record(const Vector3f &p, const Vector3f &N, const Vector3f &wi, const Vector3f &Li, float pdf);
+    // 一轮训练结束: 按本轮的记录细分空间与方向, 并把本轮结果用于下一轮的采样
+    // iteration为这一轮的编号(从0开始), 空间细分的阈值随采样数增加按sqrt(2^iteration)增长
+    void refine(int iteration);
+
+    bool recording = false;        // 渲染时是否记录入射radiance(训练阶段)
+    float bsdfFraction = 0.5f;     // 采样时按BSDF采样的比例, 其余按学习到的分布采样
+    float spatialThreshold = 4000; // 空间叶子的记录次数超过 spatialThreshold * sqrt(2^iteration) 时一分为二
+    float directionalThreshold = 0.01f;  // 方向象限的能量占比超过该值时继续四等分
+
+    int leafCount() const { return leaves.size(); }
+
+private:
+    struct Leaf {
+        DTree sampling[6], building[6];
+        float weight() const;
+    };
+    struct Node {
+        int child[2] = {0, 0};  // 0表示叶子
+        int leaf = 0;           // 叶子在leaves中的下标
+    };
+
+    Bounds3 bounds;
+    std::vector<Node> nodes;
+    std::vector<Leaf> leaves;
+    int iterations = 0;
+
+    int lookup(const Vector3f &p) const;
+    static int normalBin(const Vector3f &N);
+    void splitLeaves(int node, int depth, float threshold);
+};
+
+#endif //RAYTRACING_SDTREE_H
@@ -3,18 +3,104 @@
 //
 
 #include "Scene.hpp"
+#include "RayCounters.hpp"
+#include "ThreadPool.hpp"
+#include "Trace.hpp"
 
 
 void Scene::buildBVH() {
+    TRACE_SCOPE("scene build");
     printf(" - Generating BVH...\n\n");
-    this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::NAIVE);
+    this->bvh = new BVHAccel(objects, 1, splitMethod);
+    if (accelerator == Accelerator::KDTREE) {
+        printf(" - Generating k-d tree...\n\n");
+        this->kdtree = new KDTreeAccel(objects);
+    }
+
+    std::vector<Object*> emitters;
+    for (auto object : objects)
+        object->getEmitters(emitters);
+    printf(" - Generating light BVH (%zu emitters)...\n\n", emitters.size());
+    this->lightBVH = new LightBVH(emitters);
+}
+
+bool Scene::updateBVH() {
+    TRACE_SCOPE("scene update");
+    bool rebuilt = this->bvh->Update(bvhRebuildThreshold);
+    if (this->kdtree) {
+        delete this->kdtree;
+        this->kdtree = new KDTreeAccel(objects, false);
+    }
+
+    // 光源数量通常很少, 直接重建光源BVH
+    std::vector<Object*> emitters = std::move(this->lightBVH->emitters);
+    delete this->lightBVH;
+    this->lightBVH = new LightBVH(emitters);
+    return rebuilt;
 }
 
 Intersection Scene::intersect(const Ray &ray) const
 {
+    if (this->kdtree)
+        return this->kdtree->Intersect(ray);
     return this->bvh->Intersect(ray);
 }
 
+namespace {
+
+// 把rays[0, count)按BVHAccel::kStreamSize条一组交给fn(组内Ray数组, 组的起始下标, 组的大小)
+template <typename F>
+void forEachStream(const RayDesc *rays, size_t count, bool parallel, F fn)
+{
+    constexpr int kStream = BVHAccel::kStreamSize;
+    auto run = [&](size_t begin, size_t end) {
+        TRACE_SCOPE("ray batch", end - begin);
+        std::vector<Ray> stream;
+        stream.reserve(kStream);
+        for (size_t first = begin; first < end; first += kStream) {
+            int n = std::min<size_t>(kStream, end - first);
+            stream.clear();
+            for (int i = 0; i < n; ++i)
+                stream.push_back(rays[first + i].toRay());
+            fn(stream.data(), first, n);
+        }
+    };
+    // 每个任务处理若干组, 兼顾负载均衡与调度开销
+    if (parallel)
+        ThreadPool::global().parallelFor(count, 4 * kStream, run);
+    else
+        run(0, count);
+}
+
+}
+
+void Scene::intersect(const RayDesc *rays, HitRecord *hits, size_t count, const RayQueryOptions &options) const
+{
+    forEachStream(rays, count, options.parallel, [&](const Ray *stream, size_t first, int n) {
+        // k-d树没有成组遍历, 总是逐条光线查询
+        if (kdtree) {
+            for (int i = 0; i < n; ++i) {
+                hits[first + i] = HitRecord();
+                kdtree->IntersectHit(stream[i], hits[first + i]);
+            }
+            return;
+        }
+        bvh->IntersectBatch(stream, hits + first, n, options.stream);
+    });
+}
+
+void Scene::occluded(const RayDesc *rays, uint8_t *occluded, size_t count, const RayQueryOptions &options) const
+{
+    forEachStream(rays, count, options.parallel, [&](const Ray *stream, size_t first, int n) {
+        if (kdtree) {
+            for (int i = 0; i < n; ++i)
+                occluded[first + i] = kdtree->IntersectP(stream[i]);
+            return;
+        }
+        bvh->OccludedBatch(stream, occluded + first, n, options.stream);
+    });
+}
+
 void Scene::sampleLight(Intersection &pos, float &pdf) const
 {
     float emit_area_sum = 0;
@@ -25,6 +111,7 @@ void Scene::sampleLight(Intersection &pos, float &pdf) const
         }
     }
     // Gong: 随机生成一个浮点数 * 光源面积和 ???
+    float total_area = emit_area_sum;
     float p = get_random_float() * emit_area_sum;
     emit_area_sum = 0;
     for (uint32_t k = 0; k < objects.size(); ++k) {
@@ -32,13 +119,23 @@ void Scene::sampleLight(Intersection &pos, float &pdf) const
             emit_area_sum += objects[k]->getArea();
             // Gong: 仅对光源面积和大于p时进行采样 ???
             if (p <= emit_area_sum){
+                // 选中该光源的概率为 面积/光源面积和, 乘上光源内按面积采样的pdf
                 objects[k]->Sample(pos, pdf);
+                pdf *= objects[k]->getArea() / total_area;
                 break;
             }
         }
     }
 }
 
+void Scene::sampleLight(const Vector3f &p, const Vector3f &N, Intersection &pos, float &pdf) const
+{
+    if (lightSampling == LightSampling::LIGHT_BVH && lightBVH)
+        lightBVH->Sample(p, N, pos, pdf);
+    else
+        sampleLight(pos, pdf);
+}
+
 bool Scene::trace(
         const Ray &ray,
         const std::vector<Object*> &objects,
@@ -66,8 +163,14 @@ Vector3f Scene::castRay(const Ray& ray, int depth) const
     // TO DO Implement Path Tracing Algorithm here
 
     //求入射光线wo的交点
-    Intersection intersection = intersect(ray);
+    return shade(ray, intersect(ray), depth);
+}
+
+Vector3f Scene::shade(const Ray& ray, const Intersection& intersection, int depth) const
+{
     Vector3f hitcolor = Vector3f(0);
+    if (intersection.happened)
+        ++rayCounters.pathVertices;
 
     //判断是不是直接采样到光源了
     if (intersection.emit.norm() > 0)
@@ -83,7 +186,7 @@ Vector3f Scene::castRay(const Ray& ray, int depth) const
         // Gong: 如何采样？？？
         float pdf_light = 0.0f;
         Intersection inter;
-        sampleLight(inter, pdf_light);     //光源内随机采样一个点
+        sampleLight(p, N, inter, pdf_light);     //光源内随机采样一个点, pdf_light为0表示没有光源能照亮该点
         Vector3f x = inter.coords;
         Vector3f ws = normalize(x - p);
         Vector3f NN = normalize(inter.normal);
@@ -91,21 +194,76 @@ Vector3f Scene::castRay(const Ray& ray, int depth) const
         Vector3f L_dir = Vector3f(0.0f);
 
         //求直接光照
-        if ((intersect(Ray(p, ws)).coords - x).norm() < 0.01) //判断灯光有没有遮挡
+        if (pdf_light > 0 && (intersect(Ray(p, ws)).coords - x).norm() < 0.01) //判断灯光有没有遮挡
         {
             L_dir = inter.emit * intersection.m->eval(wo, ws, N) * dotProduct(ws, N) * dotProduct(-ws, NN)/ (((x - p).norm() * (x - p).norm()) * pdf_light);
         }
 
         //求间接光照
         Vector3f L_indir = Vector3f(0);
-        float P_RR = get_random_float();
-        if (P_RR < Scene::RussianRoulette)
+        if (irradianceCache && depth == 0) {
+            // 相机光线的交点上用缓存插值的辐照度代替逐像素的递归采样, 漫反射的出射radiance为 Kd/π * E
+            Vector3f E;
+            if (!irradianceCache->lookup(p, N, E)) {
+                float harmonicDist;
+                E = sampleIrradiance(p, N, depth, harmonicDist);
+                irradianceCache->insert(p, N, E, harmonicDist);
+            }
+            L_indir = E * intersection.m->eval(N, wo, N);
+        }
+        else if (get_random_float() < Scene::RussianRoulette)
         {
             //采样一个漫反射方向
-            Vector3f wi = intersection.m->sample(wo, N);
-            L_indir = castRay(Ray(p, wi), depth) * intersection.m->eval(wi, wo, N) * dotProduct(wi, N) / (intersection.m->pdf(wi, wo, N) * Scene::RussianRoulette);
+            Vector3f wi;
+            float pdf_wi;
+            if (guide && guide->canSample()) {
+                // 按BSDF与guide的混合分布采样, pdf为两者的加权和
+                const DTree &dtree = guide->samplingTree(p, N);
+                float alpha = guide->bsdfFraction;
+                wi = get_random_float() < alpha ? intersection.m->sample(wo, N)
+                                                : dtree.sample(get_random_float(), get_random_float());
+                float bsdf_pdf = dotProduct(wi, N) > 0 ? intersection.m->pdf(wi, wo, N) : 0;
+                pdf_wi = alpha * bsdf_pdf + (1 - alpha) * dtree.pdf(wi);
+            } else {
+                wi = intersection.m->sample(wo, N);
+                pdf_wi = intersection.m->pdf(wi, wo, N);
+            }
+            // guide采样的方向可能位于表面背面, 没有贡献
+            if (pdf_wi > 0 && dotProduct(wi, N) > 0) {
+                Vector3f Li = castRay(Ray(p, wi), depth + 1);
+                L_indir = Li * intersection.m->eval(wi, wo, N) * dotProduct(wi, N) / (pdf_wi * Scene::RussianRoulette);
+                if (guide && guide->recording)
+                    guide->record(p, N, wi, Li, pdf_wi);
+            }
         }
         hitcolor = L_indir + L_dir;
     }
     return hitcolor;
 }
+
+Vector3f Scene::sampleIrradiance(const Vector3f &p, const Vector3f &N, int depth, float &harmonicDist) const
+{
+    // 以N为z轴的局部坐标系
+    Vector3f T = std::fabs(N.x) > std::fabs(N.y) ? Vector3f(N.z, 0, -N.x) : Vector3f(0, N.z, -N.y);
+    T = normalize(T);
+    Vector3f B = crossProduct(N, T);
+
+    // 按cosθ分层重要性采样半球, E = ∫L cosθ dω ≈ π/M * ΣL
+    int n = std::max(1, (int)std::sqrt((float)irradianceCache->samples));
+    Vector3f E(0);
+    float invDistSum = 0;
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < n; ++j) {
+            float u1 = (i + get_random_float()) / n, u2 = (j + get_random_float()) / n;
+            float r = std::sqrt(u1), phi = 2 * M_PI * u2;
+            Vector3f wi = normalize(T * (r * std::cos(phi)) + B * (r * std::sin(phi)) + N * std::sqrt(std::max(0.f, 1 - u1)));
+            Ray ray(p, wi);
+            Intersection hit = intersect(ray);
+            if (hit.happened)
+                invDistSum += 1 / std::max((float)hit.distance, 1e-4f);
+            E += shade(ray, hit, depth + 1);
+        }
+    }
+    harmonicDist = invDistSum > 0 ? n * n / invDistSum : std::numeric_limits<float>::infinity();
+    return E * (M_PI / (n * n));
+}
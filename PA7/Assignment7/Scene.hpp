@@ -10,8 +10,18 @@
 #include "Light.hpp"
 #include "AreaLight.hpp"
 #include "BVH.hpp"
+#include "KDTree.hpp"
+#include "LightBVH.hpp"
+#include "SDTree.hpp"
+#include "IrradianceCache.hpp"
 #include "Ray.hpp"
 
+// 批量查询(Scene::intersect/occluded)的选项
+struct RayQueryOptions {
+    // 一组光线一起遍历BVH, 否则逐条遍历. 包围盒测试仍是逐条光线的标量计算, 目前只在光线高度相干时接近逐条遍历的速度
+    bool stream = false;
+    bool parallel = true;   // 使用ThreadPool::global(), 否则在调用线程中完成
+};
 
 class Scene
 {
@@ -23,6 +33,26 @@ public:
     Vector3f backgroundColor = Vector3f(0.235294, 0.67451, 0.843137);
     int maxDepth = 1;
     float RussianRoulette = 0.8;
+    int spp = 16;   // samples per pixel
+    float bvhRebuildThreshold = 1.5f;  // 动画中BVH的SAH代价增长超过该倍数时重建, 否则只做refit
+    BVHAccel::SplitMethod splitMethod = BVHAccel::SplitMethod::NAIVE;  // 场景(顶层)BVH的划分方式
+
+    // 场景求交使用的加速结构: BVH为两层的BVH(场景BVH与各网格的三角形BVH), KDTREE为建立在全部图元上的一棵k-d树.
+    // 两种方式都会构建场景BVH, 场景包围盒等仍由它提供
+    enum class Accelerator { BVH, KDTREE };
+    Accelerator accelerator = Accelerator::BVH;
+
+    // 光源采样方式: AREA按光源面积采样, LIGHT_BVH按光源对着色点的估计贡献采样
+    enum class LightSampling { AREA, LIGHT_BVH };
+    LightSampling lightSampling = LightSampling::LIGHT_BVH;
+
+    // 路径引导: guide不为空时, Renderer先用1, 2, 4, ...spp渲染guidingPasses轮训练guide(结果同样计入图像), 再按spp渲染,
+    // castRay中的间接光方向按BSDF与guide学习到的入射radiance分布混合采样
+    SDTree *guide = nullptr;
+    int guidingPasses = 5;
+
+    // 辐照度缓存: 不为空时相机光线交点处的间接光由缓存中相邻记录插值得到, 没有可用记录时才采样半球计算新记录
+    IrradianceCache *irradianceCache = nullptr;
 
     Scene(int w, int h) : width(w), height(h)
     {}
@@ -33,10 +63,26 @@ public:
     const std::vector<Object*>& get_objects() const { return objects; }
     const std::vector<std::unique_ptr<Light> >&  get_lights() const { return lights; }
     Intersection intersect(const Ray& ray) const;
+
+    // 批量查询: rays与结果均为长度count的连续数组, 按kStreamSize条一组分给线程池中的线程处理.
+    // intersect写入最近交点的紧凑记录(t, 图元, 重心坐标), hits[i].prim为nullptr表示未命中,
+    // 需要位置、法线、材质时调用hits[i].prim->evalHit; occluded只判断(tMin, tMax)内是否有任意交点
+    void intersect(const RayDesc *rays, HitRecord *hits, size_t count, const RayQueryOptions &options = {}) const;
+    void occluded(const RayDesc *rays, uint8_t *occluded, size_t count, const RayQueryOptions &options = {}) const;
     BVHAccel *bvh;
+    KDTreeAccel *kdtree = nullptr;  // accelerator为KDTREE时构建
+    LightBVH *lightBVH = nullptr;
     void buildBVH();
+    // 物体移动后更新场景BVH(refit或重建)与光源BVH, 返回场景BVH是否被重建. k-d树不支持refit, 每次都重建
+    bool updateBVH();
+    // depth为路径的弹射次数, 相机光线为0
     Vector3f castRay(const Ray &ray, int depth) const;
+    // 计算光线ray在交点intersection处的出射radiance
+    Vector3f shade(const Ray &ray, const Intersection &intersection, int depth) const;
+    // 对(p, N)处的半球做分层采样估计入射的间接辐照度, harmonicDist返回采样光线击中距离的调和平均
+    Vector3f sampleIrradiance(const Vector3f &p, const Vector3f &N, int depth, float &harmonicDist) const;
     void sampleLight(Intersection &pos, float &pdf) const;
+    void sampleLight(const Vector3f &p, const Vector3f &N, Intersection &pos, float &pdf) const;
     bool trace(const Ray &ray, const std::vector<Object*> &objects, float &tNear, uint32_t &index, Object **hitObject);
     std::tuple<Vector3f, Vector3f> HandleAreaLight(const AreaLight &light, const Vector3f &hitPoint, const Vector3f &N,
                                                    const Vector3f &shadowPointOrig,
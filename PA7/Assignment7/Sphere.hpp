@@ -10,13 +10,13 @@
 #include "Bounds3.hpp"
 #include "Material.hpp"
 
-class Sphere : public Object{
+class Sphere final : public Object{
 public:
     Vector3f center;
     float radius, radius2;
     Material *m;
     float area;
-    Sphere(const Vector3f &c, const float &r, Material* mt = new Material()) : center(c), radius(r), radius2(r * r), m(mt), area(4 * M_PI *r *r) {}
+    Sphere(const Vector3f &c, const float &r, Material* mt = new Material()) : Object(PrimitiveType::SPHERE), center(c), radius(r), radius2(r * r), m(mt), area(4 * M_PI *r *r) {}
     bool intersect(const Ray& ray) {
         // analytic solution
         Vector3f L = ray.origin - center;
@@ -47,25 +47,33 @@ public:
         return true;
     }
     Intersection getIntersection(Ray ray){
-        Intersection result;
-        result.happened = false;
+        HitRecord hit;
+        if (!intersectHit(ray, hit)) return Intersection();
+        return evalHit(ray, hit);
+    }
+    bool intersectHit(const Ray& ray, HitRecord& hit){
         Vector3f L = ray.origin - center;
         float a = dotProduct(ray.direction, ray.direction);
         float b = 2 * dotProduct(ray.direction, L);
         float c = dotProduct(L, L) - radius2;
         float t0, t1;
-        if (!solveQuadratic(a, b, c, t0, t1)) return result;
-        if (t0 < 0) t0 = t1;
-        if (t0 < 0) return result;
+        if (!solveQuadratic(a, b, c, t0, t1)) return false;
+        if (t0 < ray.t_min) t0 = t1;
+        if (t0 < ray.t_min || t0 >= hit.t) return false;
+        hit.t = t0;
+        hit.prim = this;
+        return true;
+    }
+    Intersection evalHit(const Ray& ray, const HitRecord& hit){
+        Intersection result;
         result.happened=true;
 
-        result.coords = Vector3f(ray.origin + ray.direction * t0);
+        result.coords = Vector3f(ray.origin + ray.direction * hit.t);
         result.normal = normalize(Vector3f(result.coords - center));
         result.m = this->m;
         result.obj = this;
-        result.distance = t0;
+        result.distance = hit.t;
         return result;
-
     }
     void getSurfaceProperties(const Vector3f &P, const Vector3f &I, const uint32_t &index, const Vector2f &uv, Vector3f &N, Vector2f &st) const
     { N = normalize(P - center); }
@@ -91,6 +99,9 @@ public:
     bool hasEmit(){
         return m->hasEmission();
     }
+    Vector3f getEmission(){
+        return m->getEmission();
+    }
 };
 
 
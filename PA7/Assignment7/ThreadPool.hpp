@@ -0,0 +1,125 @@
+//
+// Fixed-size worker pool for data-parallel loops.
+//
+
+#ifndef RAYTRACING_THREADPOOL_H
+#define RAYTRACING_THREADPOOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// 常驻的工作线程, 只提供parallelFor: 区间[0, count)按grain切块, 各线程(包括调用线程)用原子计数器领取块,
+// 全部完成后返回. 多个线程同时调用时依次执行; 在parallelFor的块内(工作线程或调用线程中)再次调用时直接在当前线程中
+// 顺序执行, 不会等待正在执行外层块的线程而死锁
+class ThreadPool {
+public:
+    explicit ThreadPool(int threads = 0)
+    {
+        if (threads <= 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        // 调用线程本身也参与计算, 额外只需threads - 1个工作线程
+        for (int i = 1; i < threads; ++i)
+            workers.emplace_back([this] { workerLoop(); });
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &w : workers)
+            w.join();
+    }
+
+    int size() const { return workers.size() + 1; }
+
+    // 对[0, count)的每个块[begin, end)调用fn(begin, end)
+    void parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)> &fn)
+    {
+        grain = std::max<size_t>(1, grain);
+        if (workers.empty() || count <= grain || insideJob) {
+            for (size_t begin = 0; begin < count; begin += grain)
+                fn(begin, std::min(count, begin + grain));
+            return;
+        }
+        std::lock_guard<std::mutex> call(callMutex);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &fn;
+            jobCount = count;
+            jobGrain = grain;
+            next = 0;
+            busy = workers.size();
+            ++generation;
+        }
+        wake.notify_all();
+        insideJob = true;
+        runChunks(fn, count, grain);
+        insideJob = false;
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return busy == 0; });
+        job = nullptr;
+    }
+
+    // 进程内共享的线程池, 线程数为硬件线程数
+    static ThreadPool &global()
+    {
+        static ThreadPool pool;
+        return pool;
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::mutex callMutex;   // 同一时刻只有一个调用者使用job/next/busy
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    const std::function<void(size_t, size_t)> *job = nullptr;
+    size_t jobCount = 0, jobGrain = 1;
+    std::atomic<size_t> next{0};
+    size_t busy = 0;
+    size_t generation = 0;
+    bool stopping = false;
+    // 当前线程正在执行某个parallelFor的块(工作线程始终为true)
+    static inline thread_local bool insideJob = false;
+
+    void runChunks(const std::function<void(size_t, size_t)> &fn, size_t count, size_t grain)
+    {
+        for (size_t begin = next.fetch_add(grain); begin < count; begin = next.fetch_add(grain))
+            fn(begin, std::min(count, begin + grain));
+    }
+
+    void workerLoop()
+    {
+        insideJob = true;
+        size_t seen = 0;
+        while (true) {
+            const std::function<void(size_t, size_t)> *fn;
+            size_t count, grain;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping)
+                    return;
+                seen = generation;
+                fn = job;
+                count = jobCount;
+                grain = jobGrain;
+            }
+            runChunks(*fn, count, grain);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                --busy;
+            }
+            done.notify_one();
+        }
+    }
+};
+
+#endif //RAYTRACING_THREADPOOL_H
@@ -0,0 +1,168 @@
+//
+// Scoped timeline events exported in the Chrome trace format.
+//
+
+#ifndef RAYTRACING_TRACE_H
+#define RAYTRACING_TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// 时间线事件记录: 每个线程把事件写入自己的环形缓冲区(写入时不加锁, 缓冲区满后覆盖最旧的事件),
+// Trace::Start之后程序退出时导出为Chrome/Perfetto可以打开的JSON(chrome://tracing或ui.perfetto.dev).
+// 未调用Start时TRACE_SCOPE只有一次原子读的开销
+class Trace
+{
+public:
+    struct Event
+    {
+        const char *name;   // 必须是字符串字面量, 记录时不复制
+        int64_t arg;        // 附加的整数参数(如tile编号), -1表示没有
+        int64_t begin;      // 相对Start的纳秒数
+        int64_t duration;
+    };
+
+    // 开始记录, 程序正常退出时写到path
+    static void Start(const std::string &path, size_t eventsPerThread = 1 << 16)
+    {
+        State &s = state();
+        s.path = path;
+        s.capacity = eventsPerThread;
+        s.origin = std::chrono::steady_clock::now();
+        s.enabled.store(true, std::memory_order_release);
+        std::atexit([] { Export(); });
+    }
+
+    static bool Enabled() { return state().enabled.load(std::memory_order_relaxed); }
+
+    static int64_t Now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+                                                                    state().origin).count();
+    }
+
+    static void Record(const char *name, int64_t arg, int64_t begin, int64_t end)
+    {
+        Buffer &b = threadBuffer();
+        uint64_t i = b.written.load(std::memory_order_relaxed);
+        b.events[i % b.events.size()] = {name, arg, begin, end - begin};
+        b.written.store(i + 1, std::memory_order_release);
+    }
+
+    // 写出JSON, 调用时其他线程不应再记录事件(线程池的工作线程此时处于空闲状态)
+    static bool Export()
+    {
+        State &s = state();
+        if (!s.enabled.exchange(false))
+            return true;
+        FILE *fp = fopen(s.path.c_str(), "w");
+        if (!fp) {
+            fprintf(stderr, "failed to write trace %s\n", s.path.c_str());
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(s.mutex);
+        fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        bool first = true;
+        size_t total = 0, dropped = 0;
+        for (auto &b : s.buffers) {
+            fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+                    first ? "" : ",\n", b->tid, b->tid == 0 ? "main" : "worker", b->tid);
+            first = false;
+            uint64_t written = b->written.load(std::memory_order_acquire);
+            uint64_t capacity = b->events.size();
+            uint64_t begin = written > capacity ? written - capacity : 0;
+            dropped += begin;
+            for (uint64_t i = begin; i < written; ++i) {
+                const Event &e = b->events[i % capacity];
+                fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f", e.name,
+                        b->tid, e.begin / 1e3, e.duration / 1e3);
+                if (e.arg >= 0)
+                    fprintf(fp, ",\"args\":{\"value\":%lld}", (long long)e.arg);
+                fprintf(fp, "}");
+                ++total;
+            }
+        }
+        fprintf(fp, "\n]}\n");
+        bool ok = fclose(fp) == 0;
+        printf("Trace: %zu events from %zu threads written to %s", total, s.buffers.size(), s.path.c_str());
+        if (dropped > 0)
+            printf(" (%zu oldest events overwritten)", dropped);
+        printf("\n");
+        return ok;
+    }
+
+private:
+    struct Buffer
+    {
+        int tid;
+        std::vector<Event> events;
+        std::atomic<uint64_t> written{0};
+    };
+
+    struct State
+    {
+        std::atomic<bool> enabled{false};
+        std::string path;
+        size_t capacity = 0;
+        std::chrono::steady_clock::time_point origin;
+        std::mutex mutex;   // 只在线程第一次记录(注册缓冲区)与导出时使用
+        std::vector<std::unique_ptr<Buffer>> buffers;
+    };
+
+    static State &state()
+    {
+        static State s;
+        return s;
+    }
+
+    // 缓冲区由State持有, 线程退出后其中的事件仍会被导出
+    static Buffer &threadBuffer()
+    {
+        thread_local Buffer *buffer = nullptr;
+        if (!buffer) {
+            State &s = state();
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.buffers.push_back(std::make_unique<Buffer>());
+            buffer = s.buffers.back().get();
+            buffer->tid = s.buffers.size() - 1;
+            buffer->events.resize(s.capacity);
+        }
+        return *buffer;
+    }
+};
+
+// 记录从构造到析构的一段时间
+class TraceScope
+{
+public:
+    explicit TraceScope(const char *name, int64_t arg = -1)
+        : name(Trace::Enabled() ? name : nullptr), arg(arg), begin(this->name ? Trace::Now() : 0) {}
+
+    ~TraceScope()
+    {
+        if (name)
+            Trace::Record(name, arg, begin, Trace::Now());
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope &operator=(const TraceScope&) = delete;
+
+private:
+    const char *name;
+    int64_t arg;
+    int64_t begin;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+// TRACE_SCOPE("name")或TRACE_SCOPE("name", 整数参数), 记录当前作用域的耗时
+#define TRACE_SCOPE(...) TraceScope TRACE_CONCAT(traceScope_, __LINE__)(__VA_ARGS__)
+
+#endif //RAYTRACING_TRACE_H
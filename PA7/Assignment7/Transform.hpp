@@ -0,0 +1,66 @@
+//
+// Affine object transform for animated scenes.
+//
+
+#ifndef RAYTRACING_TRANSFORM_H
+#define RAYTRACING_TRANSFORM_H
+
+#include "Vector.hpp"
+#include "global.hpp"
+
+// 仿射变换 p' = M * p + t, 用于逐帧改变物体的位置与朝向
+struct Transform
+{
+    float m[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+    Vector3f t;
+
+    static Transform Translate(const Vector3f &d)
+    {
+        Transform ret;
+        ret.t = d;
+        return ret;
+    }
+
+    static Transform Scale(float s)
+    {
+        Transform ret;
+        for (int i = 0; i < 3; ++i)
+            ret.m[i][i] = s;
+        return ret;
+    }
+
+    // 绕单位轴axis旋转deg度(Rodrigues公式)
+    static Transform Rotate(const Vector3f &axis, float deg)
+    {
+        Vector3f a = normalize(axis);
+        float theta = deg * M_PI / 180.f;
+        float c = std::cos(theta), s = std::sin(theta), k = 1 - c;
+        Transform ret;
+        ret.m[0][0] = c + a.x * a.x * k;       ret.m[0][1] = a.x * a.y * k - a.z * s; ret.m[0][2] = a.x * a.z * k + a.y * s;
+        ret.m[1][0] = a.y * a.x * k + a.z * s; ret.m[1][1] = c + a.y * a.y * k;       ret.m[1][2] = a.y * a.z * k - a.x * s;
+        ret.m[2][0] = a.z * a.x * k - a.y * s; ret.m[2][1] = a.z * a.y * k + a.x * s; ret.m[2][2] = c + a.z * a.z * k;
+        return ret;
+    }
+
+    Vector3f vector(const Vector3f &v) const
+    {
+        return Vector3f(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                        m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                        m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+    }
+
+    Vector3f point(const Vector3f &p) const { return vector(p) + t; }
+
+    // 复合变换: 先做rhs再做*this
+    Transform operator*(const Transform &rhs) const
+    {
+        Transform ret;
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 3; ++j)
+                ret.m[i][j] = m[i][0] * rhs.m[0][j] + m[i][1] * rhs.m[1][j] + m[i][2] * rhs.m[2][j];
+        ret.t = point(rhs.t);
+        return ret;
+    }
+};
+
+#endif //RAYTRACING_TRANSFORM_H
@@ -1,19 +1,328 @@
 #include "Renderer.hpp"
+#include "RenderServer.hpp"
 #include "Scene.hpp"
-#include "Triangle.hpp"
+#include "MeshTriangle.hpp"
+#include "OutOfCoreMesh.hpp"
 #include "Sphere.hpp"
+#include "ThreadPool.hpp"
+#include "Trace.hpp"
 #include "Vector.hpp"
 #include "global.hpp"
 #include <chrono>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+
+// 生成many-lights测试场景: 在cornell box的天花板与墙面上随机放置若干朝向盒内的小方形光源(每个由两个三角形组成)
+static void addManyLights(std::vector<Triangle> &lightTris, int count)
+{
+    std::mt19937 rng(101);
+    std::uniform_real_distribution<float> dist(0.f, 1.f);
+    float size = 12.f;
+    lightTris.reserve(count * 2);
+    for (int i = 0; i < count; ++i) {
+        Vector3f c, n, t;
+        float u = dist(rng), v = dist(rng);
+        switch (i % 4) {
+            case 0: c = Vector3f(20 + u * 516, 548.3f, 20 + v * 519); n = Vector3f(0, -1, 0); t = Vector3f(1, 0, 0); break;
+            case 1: c = Vector3f(20 + u * 516, 20 + v * 508, 558.7f); n = Vector3f(0, 0, -1); t = Vector3f(1, 0, 0); break;
+            case 2: c = Vector3f(0.5f, 20 + u * 508, 20 + v * 519); n = Vector3f(1, 0, 0); t = Vector3f(0, 1, 0); break;
+            default: c = Vector3f(549.f, 20 + u * 508, 20 + v * 519); n = Vector3f(-1, 0, 0); t = Vector3f(0, 1, 0); break;
+        }
+        // 取b使得 t x b = n, 三角形(c, c+t, c+b)的法线即为n
+        Vector3f b = crossProduct(n, t);
+        Vector3f color(0.3f + 0.7f * dist(rng), 0.3f + 0.7f * dist(rng), 0.3f + 0.7f * dist(rng));
+        Material* mt = new Material(DIFFUSE, 600.f / count * 47.f * color);
+        mt->Kd = Vector3f(0.65f);
+        Vector3f p0 = c - t * (size / 2) - b * (size / 2);
+        lightTris.emplace_back(p0, p0 + t * size, p0 + b * size, mt);
+        lightTris.emplace_back(p0 + t * size, p0 + t * size + b * size, p0 + b * size, mt);
+    }
+}
+
+// 双面四边形(a, b, c, d按顺序相邻), 由四个三角形组成
+static void addQuad(std::vector<Triangle> &tris, const Vector3f &a, const Vector3f &b, const Vector3f &c,
+                    const Vector3f &d, Material *mt)
+{
+    tris.emplace_back(a, b, c, mt);
+    tris.emplace_back(a, c, d, mt);
+    tris.emplace_back(a, c, b, mt);
+    tris.emplace_back(a, d, c, mt);
+}
+
+// 生成间接光照测试场景: 用白色的灯罩(底面与三个侧面)罩住光源, 只在朝向红墙(+x)的一侧开口,
+// 房间主要被开口照到的墙面与地面反射的光照亮
+static void addLampShade(std::vector<Triangle> &tris, Material *mt)
+{
+    float x0 = 183.f, x1 = 373.f, y0 = 450.f, y1 = 548.7f, z0 = 197.f, z1 = 362.f;
+    addQuad(tris, Vector3f(x0, y0, z0), Vector3f(x1, y0, z0), Vector3f(x1, y0, z1), Vector3f(x0, y0, z1), mt);
+    addQuad(tris, Vector3f(x0, y0, z0), Vector3f(x0, y1, z0), Vector3f(x0, y1, z1), Vector3f(x0, y0, z1), mt);
+    addQuad(tris, Vector3f(x0, y0, z0), Vector3f(x1, y0, z0), Vector3f(x1, y1, z0), Vector3f(x0, y1, z0), mt);
+    addQuad(tris, Vector3f(x0, y0, z1), Vector3f(x1, y0, z1), Vector3f(x1, y1, z1), Vector3f(x0, y1, z1), mt);
+}
+
+// 批量查询接口的测试与吞吐量对比: count条相机光线(相干)与count条盒内随机位置、随机方向的光线(不相干),
+// 分别逐条调用BVHAccel(构建了k-d树时还有KDTreeAccel)与使用Scene::intersect/occluded的批量接口, 检查结果一致并输出Mrays/s
+static void benchRayQueries(const Scene &scene, int count)
+{
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> dist(0.f, 1.f);
+    std::vector<RayDesc> coherent(count), incoherent(count);
+    int side = std::max(1, (int)std::sqrt((float)count));
+    float scale = std::tan(scene.fov * 0.5f * M_PI / 180.f);
+    for (int i = 0; i < count; ++i) {
+        float x = (2 * ((i % side) + 0.5f) / side - 1) * scale, y = (1 - 2 * ((i / side % side) + 0.5f) / side) * scale;
+        coherent[i].origin = Vector3f(278, 273, -800);
+        coherent[i].direction = normalize(Vector3f(-x, y, 1));
+        incoherent[i].origin = Vector3f(20 + 516 * dist(rng), 20 + 508 * dist(rng), 20 + 519 * dist(rng));
+        float z = 1 - 2 * dist(rng), r = std::sqrt(std::max(0.f, 1 - z * z)), phi = 2 * M_PI * dist(rng);
+        incoherent[i].direction = Vector3f(r * std::cos(phi), r * std::sin(phi), z);
+        // 遮挡查询用有限的距离, 相当于连向光源的阴影光线
+        incoherent[i].tMax = 300 * dist(rng);
+    }
+
+    auto ms = [](std::chrono::steady_clock::time_point a, std::chrono::steady_clock::time_point b) {
+        return std::chrono::duration<double, std::milli>(b - a).count();
+    };
+    for (auto *set : {&coherent, &incoherent}) {
+        const std::vector<RayDesc> &rays = *set;
+        std::vector<HitRecord> ref(count), hits(count);
+        std::vector<uint8_t> refOcc(count), occ(count);
+
+        // 先预热一遍缓存
+        for (int i = 0; i < count; ++i)
+            scene.bvh->IntersectHit(rays[i].toRay(), ref[i]);
+        std::fill(ref.begin(), ref.end(), HitRecord());
+        auto t0 = std::chrono::steady_clock::now();
+        for (int i = 0; i < count; ++i)
+            scene.bvh->IntersectHit(rays[i].toRay(), ref[i]);
+        auto t1 = std::chrono::steady_clock::now();
+        for (int i = 0; i < count; ++i)
+            refOcc[i] = scene.bvh->IntersectP(rays[i].toRay());
+        auto t2 = std::chrono::steady_clock::now();
+        printf("%s rays: single intersect %.2f Mrays/s, single occluded %.2f Mrays/s\n",
+               set == &coherent ? "coherent" : "incoherent", count / ms(t0, t1) / 1e3, count / ms(t1, t2) / 1e3);
+
+        if (scene.kdtree) {
+            auto k0 = std::chrono::steady_clock::now();
+            for (int i = 0; i < count; ++i) {
+                hits[i] = HitRecord();
+                scene.kdtree->IntersectHit(rays[i].toRay(), hits[i]);
+            }
+            auto k1 = std::chrono::steady_clock::now();
+            for (int i = 0; i < count; ++i)
+                occ[i] = scene.kdtree->IntersectP(rays[i].toRay());
+            auto k2 = std::chrono::steady_clock::now();
+            int mismatches = 0;
+            for (int i = 0; i < count; ++i)
+                mismatches += hits[i].prim != ref[i].prim || (hits[i].prim && hits[i].t != ref[i].t) || occ[i] != refOcc[i];
+            printf("  k-d tree: single intersect %.2f Mrays/s, single occluded %.2f Mrays/s, %d mismatches\n",
+                   count / ms(k0, k1) / 1e3, count / ms(k1, k2) / 1e3, mismatches);
+        }
+
+        for (bool stream : {false, true}) {
+            RayQueryOptions options;
+            options.stream = stream;
+            auto b0 = std::chrono::steady_clock::now();
+            scene.intersect(rays.data(), hits.data(), count, options);
+            auto b1 = std::chrono::steady_clock::now();
+            scene.occluded(rays.data(), occ.data(), count, options);
+            auto b2 = std::chrono::steady_clock::now();
+            int mismatches = 0;
+            for (int i = 0; i < count; ++i)
+                mismatches += hits[i].prim != ref[i].prim || (hits[i].prim && hits[i].t != ref[i].t) || occ[i] != refOcc[i];
+            printf("  batch (%s, %d threads): intersect %.2f Mrays/s, occluded %.2f Mrays/s, %d mismatches\n",
+                   stream ? "stream" : "per-ray", ThreadPool::global().size(),
+                   count / ms(b0, b1) / 1e3, count / ms(b1, b2) / 1e3, mismatches);
+        }
+    }
+}
+
+// 读取批量渲染的任务文件: 每行一个任务, 由若干"关键字 值"组成(见Renderer::ParseOptions), 未给出的项使用defaults中的值,
+// #开头的行为注释. 例如:
+//   eye 278 273 -800 lookat 278 273 0 fov 40 size 256 256 spp 16 output view.ppm
+static bool loadJobs(const std::string &path, const RenderOptions &defaults, std::vector<RenderOptions> &jobs)
+{
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "failed to open " << path << "\n";
+        return false;
+    }
+    std::string line;
+    for (int lineNo = 1; std::getline(file, line); ++lineNo) {
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#')
+            continue;
+        RenderOptions job = defaults;
+        job.imagePath = "view_" + std::to_string(jobs.size()) + ".ppm";
+        std::istringstream in(line);
+        std::string error;
+        if (!Renderer::ParseOptions(in, job, error)) {
+            std::cerr << path << ":" << lineNo << ": " << error << "\n";
+            return false;
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
 
 // In the main function of the program, we create the scene (create objects and
 // lights) as well as set the options for the render (image width and height,
 // maximum recursion depth, field-of-view, etc.). We then call the render
 // function().
+//
+// 命令行参数:
+//   --scene cornell|manylights|bunny|occluded  选择场景(默认cornell, bunny为用兔子替换两个盒子,
+//                                 occluded为光源罩在只有一侧开口的灯罩里, 房间主要靠间接光照亮)
+//   --guiding N                   路径引导: 先训练N轮(1, 2, 4, ...spp, 训练结果也计入图像)再按--spp渲染, 0表示不使用(默认)
+//   --irradiance-cache A          相机光线交点的间接光使用辐照度缓存, A为允许的插值误差(如0.2), 0表示不使用(默认)
+//   --ic-samples N                计算一条缓存记录的半球采样数(默认256)
+//   --out-of-core MB              bunny场景中的兔子改为out-of-core网格: 先转换为簇文件bunny.clusters, 渲染时按需载入簇,
+//                                 载入的簇最多占用MB兆字节(不参与动画). 只有渲染是out-of-core的:
+//                                 转换簇文件时整个OBJ仍读入内存
+//   --cluster-size N              转换簇文件时每簇的三角形数(默认1024)
+//   --ray-bench N                 不渲染, 用N条相机光线与N条随机光线测试批量求交接口的正确性与吞吐量
+//   --lights N                    manylights场景中的光源数量(默认256)
+//   --light-sampling area|bvh     光源采样方式(默认bvh)
+//   --merge-quads                 载入网格时把拼成平行四边形的三角形对合并为一个四边形图元
+//   --split naive|sah|sbvh        BVH的划分方式(默认naive)
+//   --accel bvh|kdtree            场景求交使用的加速结构(默认bvh), kdtree为建立在全部图元上的SAH k-d树
+//   --bvh-layout tree|float|q16|q8  BVH遍历使用的节点布局: 指针树(默认), 或扁平数组中保存float/16位/8位量化的子节点包围盒
+//   --spp N                       每个像素的采样数(默认16)
+//   --trace FILE                  记录载入, BVH构建, 渲染(每个pass与tile)与输出各阶段的时间线, 退出时写为Chrome trace格式的JSON
+//   --cost-aov                    输出每个像素的开销(耗时, BVH节点数, 三角形求交数, 路径长度), 文件名以输出图像去掉扩展名为前缀,
+//                                 如binary_time.pfm与伪彩色的binary_time.ppm
+//   --size N                      图像分辨率N*N(默认784)
+//
+// 批量渲染: 场景只载入并构建一次BVH, 再依次渲染任务文件中的每个视角(格式见loadJobs)
+//   --jobs FILE                   任务文件, 未指定的分辨率/spp取--size/--spp
+//   --parallel-jobs               各任务在线程池中同时渲染(每个任务单线程), 与路径引导/辐照度缓存不兼容
+//
+// 常驻渲染服务(协议见RenderServer.hpp), 请求的格式与任务文件的一行相同, 另可指定region X0 Y0 X1 Y1只渲染部分像素:
+//   --serve                       从stdin读取请求, 应答写到stdout
+//   --serve-socket PATH           在Unix域套接字PATH上接收请求
+//
+// 多进程渲染同一帧(结果用MergeAccum合并):
+//   --tiles B E                   只渲染编号在[B, E)内的tile
+//   --tile-size N                 tile边长(默认32)
+//   --accum FILE                  输出累积文件(radiance之和与采样数), 此时默认不输出图像
+//   --output FILE                 输出图像路径(默认binary.ppm)
+//
+// 动画序列(转台): 场景中的物体(cornell的两个盒子, bunny场景中的兔子)逐帧绕y轴旋转一周
+//   --frames N                    渲染N帧, 输出frame_000.ppm, frame_001.ppm, ...
+//   --rebuild-threshold X         BVH的SAH代价增长超过X倍时重建, 否则只做refit(默认1.5, 0表示每帧都重建)
 int main(int argc, char** argv)
 {
+    auto setupStart = std::chrono::steady_clock::now();
+    int frames = 0;
+    std::string jobsPath;
+    bool parallelJobs = false;
+    bool costAOV = false;
+    bool mergeQuads = false;
+    bool serveStdin = false;
+    std::string socketPath;
+    int guidingPasses = 0;
+    float cacheAccuracy = 0;
+    int cacheSamples = 256;
+    int rayBench = 0;
+    float outOfCoreMB = 0;
+    int clusterSize = 1024;
+    float rebuildThreshold = 1.5f;
+    RenderOptions options;
+    bool outputSet = false;
+    std::string sceneName = "cornell";
+    int lightCount = 256;
+    int size = 784;
+    int spp = 16;
+    Scene::LightSampling lightSampling = Scene::LightSampling::LIGHT_BVH;
+    BVHAccel::SplitMethod splitMethod = BVHAccel::SplitMethod::NAIVE;
+    BVHAccel::NodeLayout nodeLayout = BVHAccel::NodeLayout::TREE;
+    Scene::Accelerator accelerator = Scene::Accelerator::BVH;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--scene") && i + 1 < argc) sceneName = argv[++i];
+        else if (!strcmp(argv[i], "--lights") && i + 1 < argc) lightCount = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--spp") && i + 1 < argc) spp = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--size") && i + 1 < argc) size = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--tiles") && i + 2 < argc) {
+            options.tileBegin = atoi(argv[++i]);
+            options.tileEnd = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--tile-size") && i + 1 < argc) options.tileSize = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--accum") && i + 1 < argc) options.accumPath = argv[++i];
+        else if (!strcmp(argv[i], "--output") && i + 1 < argc) {
+            options.imagePath = argv[++i];
+            outputSet = true;
+        }
+        else if (!strcmp(argv[i], "--frames") && i + 1 < argc) frames = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--jobs") && i + 1 < argc) jobsPath = argv[++i];
+        else if (!strcmp(argv[i], "--parallel-jobs")) parallelJobs = true;
+        else if (!strcmp(argv[i], "--cost-aov")) costAOV = true;
+        else if (!strcmp(argv[i], "--merge-quads")) mergeQuads = true;
+        else if (!strcmp(argv[i], "--trace") && i + 1 < argc) Trace::Start(argv[++i]);
+        else if (!strcmp(argv[i], "--serve")) serveStdin = true;
+        else if (!strcmp(argv[i], "--serve-socket") && i + 1 < argc) socketPath = argv[++i];
+        else if (!strcmp(argv[i], "--guiding") && i + 1 < argc) guidingPasses = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--irradiance-cache") && i + 1 < argc) cacheAccuracy = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--out-of-core") && i + 1 < argc) outOfCoreMB = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--cluster-size") && i + 1 < argc) clusterSize = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--ray-bench") && i + 1 < argc) rayBench = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--ic-samples") && i + 1 < argc) cacheSamples = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--rebuild-threshold") && i + 1 < argc) rebuildThreshold = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--split") && i + 1 < argc) {
+            ++i;
+            splitMethod = !strcmp(argv[i], "sbvh") ? BVHAccel::SplitMethod::SBVH :
+                          !strcmp(argv[i], "sah") ? BVHAccel::SplitMethod::SAH : BVHAccel::SplitMethod::NAIVE;
+        }
+        else if (!strcmp(argv[i], "--accel") && i + 1 < argc)
+            accelerator = !strcmp(argv[++i], "kdtree") ? Scene::Accelerator::KDTREE : Scene::Accelerator::BVH;
+        else if (!strcmp(argv[i], "--bvh-layout") && i + 1 < argc) {
+            ++i;
+            nodeLayout = !strcmp(argv[i], "q8") ? BVHAccel::NodeLayout::QUANT8 :
+                         !strcmp(argv[i], "q16") ? BVHAccel::NodeLayout::QUANT16 :
+                         !strcmp(argv[i], "float") ? BVHAccel::NodeLayout::FLOAT : BVHAccel::NodeLayout::TREE;
+        }
+        else if (!strcmp(argv[i], "--light-sampling") && i + 1 < argc)
+            lightSampling = !strcmp(argv[++i], "area") ? Scene::LightSampling::AREA : Scene::LightSampling::LIGHT_BVH;
+        else {
+            std::cerr << "unknown argument: " << argv[i] << "\n";
+            return 1;
+        }
+    }
+    if (!options.accumPath.empty() && !outputSet)
+        options.imagePath.clear();
+    if (costAOV) {
+        const std::string &path = options.imagePath.empty() ? options.accumPath : options.imagePath;
+        options.costPrefix = path.substr(0, path.rfind('.'));
+    }
+
+    // 任务文件先于场景读取, 格式错误时不必等待场景构建
+    std::vector<RenderOptions> jobs;
+    if (!jobsPath.empty()) {
+        if (frames > 0 || !options.accumPath.empty() || options.tileBegin > 0 || options.tileEnd >= 0) {
+            std::cerr << "--jobs cannot be combined with --frames, --accum or --tiles\n";
+            return 1;
+        }
+        RenderOptions defaults;
+        defaults.width = defaults.height = size;
+        defaults.spp = spp;
+        defaults.tileSize = options.tileSize;
+        if (!loadJobs(jobsPath, defaults, jobs))
+            return 1;
+        // 开销AOV的文件名与各任务的输出图像对应, 与--frames相同
+        if (costAOV)
+            for (auto &job : jobs)
+                job.costPrefix = job.imagePath.substr(0, job.imagePath.rfind('.'));
+    }
+
     // Change the definition here to change resolution
-    Scene scene(784, 784);
+    Scene scene(size, size);
+    scene.spp = spp;
+    scene.lightSampling = lightSampling;
+    scene.bvhRebuildThreshold = rebuildThreshold;
+    scene.splitMethod = splitMethod;
+    scene.accelerator = accelerator;
 
     // 参数类型: 材质类型 自发光量
     // kd: 漫发射系数
@@ -26,32 +335,225 @@ int main(int argc, char** argv)
     Material* light = new Material(DIFFUSE, (8.0f * Vector3f(0.747f+0.058f, 0.747f+0.258f, 0.747f) + 15.6f * Vector3f(0.740f+0.287f,0.740f+0.160f,0.740f) + 18.4f *Vector3f(0.737f+0.642f,0.737f+0.159f,0.737f)));
     light->Kd = Vector3f(0.65f);
 
-    MeshTriangle floor("../models/cornellbox/floor.obj", white);
-    MeshTriangle shortbox("../models/cornellbox/shortbox.obj", white);
-    MeshTriangle tallbox("../models/cornellbox/tallbox.obj", white);
-    MeshTriangle left("../models/cornellbox/left.obj", red);
-    MeshTriangle right("../models/cornellbox/right.obj", green);
-    MeshTriangle light_("../models/cornellbox/light.obj", light);
+    MeshTriangle floor("../models/cornellbox/floor.obj", white, splitMethod, mergeQuads);
+    MeshTriangle shortbox("../models/cornellbox/shortbox.obj", white, splitMethod, mergeQuads);
+    MeshTriangle tallbox("../models/cornellbox/tallbox.obj", white, splitMethod, mergeQuads);
+    MeshTriangle left("../models/cornellbox/left.obj", red, splitMethod, mergeQuads);
+    MeshTriangle right("../models/cornellbox/right.obj", green, splitMethod, mergeQuads);
+    MeshTriangle light_("../models/cornellbox/light.obj", light, splitMethod, mergeQuads);
+
+    // 动画物体(只在--frames时使用), 第f帧绕过pivot的竖直轴旋转360*f/frames度, 第0帧为载入时的位置
+    struct Animated { MeshTriangle* mesh; Vector3f pivot; };
+    std::vector<Animated> animated;
+    std::unique_ptr<MeshTriangle> bunny;
+    std::unique_ptr<OutOfCoreMesh> outOfCoreBunny;
 
     scene.Add(&floor);
-    scene.Add(&shortbox);
-    scene.Add(&tallbox);
+    // 兔子放大后放在场景中央, out-of-core的兔子不做动画
+    const Vector3f bunnyPivot(278, -50, 280);
+    const Transform bunnyTransform = Transform::Translate(bunnyPivot) * Transform::Scale(1500);
+    if (sceneName == "bunny" && outOfCoreMB > 0) {
+        if (!OutOfCoreMesh::Convert("../models/bunny/bunny.obj", "bunny.clusters", bunnyTransform, clusterSize)) {
+            std::cerr << "failed to write bunny.clusters\n";
+            return 1;
+        }
+        outOfCoreBunny = std::make_unique<OutOfCoreMesh>("bunny.clusters", white, size_t(outOfCoreMB * 1024 * 1024));
+        printf("Out-of-core bunny: %u triangles in %zu clusters, budget %.2f MB\n", outOfCoreBunny->numTriangles,
+               outOfCoreBunny->clusterCount(), outOfCoreMB);
+        scene.Add(outOfCoreBunny.get());
+    }
+    else if (sceneName == "bunny") {
+        bunny = std::make_unique<MeshTriangle>("../models/bunny/bunny.obj", white, splitMethod, mergeQuads, bunnyTransform);
+        if (frames > 0)
+            animated.push_back({bunny.get(), bunnyPivot});
+        scene.Add(bunny.get());
+    }
+    else {
+        if (frames > 0) {
+            animated.push_back({&shortbox, shortbox.bounding_box.Centroid()});
+            animated.push_back({&tallbox, tallbox.bounding_box.Centroid()});
+        }
+        scene.Add(&shortbox);
+        scene.Add(&tallbox);
+    }
     scene.Add(&left);
     scene.Add(&right);
-    scene.Add(&light_);
+    auto pose = [&](float deg) {
+        bool rebuilt = false;
+        for (auto& a : animated)
+            rebuilt |= a.mesh->setTransform(Transform::Translate(a.pivot) * Transform::Rotate(Vector3f(0, 1, 0), deg) *
+                                                Transform::Translate(-a.pivot),
+                                            rebuildThreshold);
+        return rebuilt;
+    };
+
+    std::vector<Triangle> lightTris;
+    if (sceneName == "manylights") {
+        addManyLights(lightTris, lightCount);
+        for (auto& tri : lightTris)
+            scene.Add(&tri);
+    }
+    else
+        scene.Add(&light_);
+
+    std::vector<Triangle> blockerTris;
+    if (sceneName == "occluded") {
+        addLampShade(blockerTris, white);
+        for (auto& tri : blockerTris)
+            scene.Add(&tri);
+    }
+
+    if (mergeQuads) {
+        size_t triangles = 0, quads = 0;
+        for (auto object : scene.get_objects())
+            if (auto mesh = dynamic_cast<MeshTriangle*>(object)) {
+                triangles += mesh->triangles.size();
+                quads += mesh->quads.size();
+            }
+        printf("Merged triangle pairs: %zu quads + %zu triangles\n", quads, triangles);
+    }
 
     scene.buildBVH();
 
+    // 场景BVH与各个网格的三角形BVH使用同样的节点布局
+    std::vector<BVHAccel*> bvhs{scene.bvh};
+    for (auto object : scene.get_objects())
+        if (auto mesh = dynamic_cast<MeshTriangle*>(object))
+            bvhs.push_back(mesh->bvh);
+    size_t nodeMemory = 0;
+    for (auto bvh : bvhs) {
+        bvh->SetLayout(nodeLayout);
+        nodeMemory += bvh->NodeMemory();
+    }
+    printf("BVH node memory: %.1f KB in %zu BVHs\n", nodeMemory / 1024.0, bvhs.size());
+    if (scene.kdtree)
+        printf("k-d tree node memory: %.1f KB\n", scene.kdtree->NodeMemory() / 1024.0);
+
+    std::unique_ptr<SDTree> guide;
+    if (guidingPasses > 0) {
+        guide = std::make_unique<SDTree>(scene.bvh->root->bounds);
+        scene.guide = guide.get();
+        scene.guidingPasses = guidingPasses;
+    }
+
+    std::unique_ptr<IrradianceCache> irradianceCache;
+    if (cacheAccuracy > 0) {
+        irradianceCache = std::make_unique<IrradianceCache>(scene.bvh->root->bounds, cacheAccuracy);
+        irradianceCache->samples = cacheSamples;
+        scene.irradianceCache = irradianceCache.get();
+    }
+
+    if (rayBench > 0) {
+        benchRayQueries(scene, rayBench);
+        return 0;
+    }
+
+    if (serveStdin || !socketPath.empty()) {
+        RenderOptions defaults;
+        defaults.width = defaults.height = size;
+        defaults.spp = spp;
+        defaults.tileSize = options.tileSize;
+        defaults.imagePath = options.imagePath;
+        defaults.progress = false;
+        printf("Scene setup: %.1f ms\n", std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - setupStart).count());
+        std::cout.flush();
+        RenderServer server(scene, defaults, costAOV);
+        if (!socketPath.empty())
+            return server.ServeSocket(socketPath) ? 0 : 1;
+        server.Serve(0, 1);
+        return 0;
+    }
+
     Renderer r;
 
+    if (!jobs.empty()) {
+        // 场景只在这里构建了一次, 之后每个任务只付出渲染本身的时间
+        auto ms = [](std::chrono::steady_clock::time_point a, std::chrono::steady_clock::time_point b) {
+            return std::chrono::duration<double, std::milli>(b - a).count();
+        };
+        auto t0 = std::chrono::steady_clock::now();
+        printf("Scene setup: %.1f ms (paid once for %zu jobs)\n", ms(setupStart, t0), jobs.size());
+
+        // 路径引导与辐照度缓存在渲染过程中会修改场景中的共享状态, 只能逐个渲染
+        if (parallelJobs && (scene.guide || scene.irradianceCache)) {
+            std::cerr << "--parallel-jobs is ignored with --guiding/--irradiance-cache\n";
+            parallelJobs = false;
+        }
+        std::vector<double> jobMs(jobs.size());
+        std::vector<char> jobOk(jobs.size());
+        auto renderJob = [&](size_t i) {
+            TRACE_SCOPE("job", i);
+            auto start = std::chrono::steady_clock::now();
+            jobOk[i] = r.Render(scene, jobs[i]);
+            jobMs[i] = ms(start, std::chrono::steady_clock::now());
+        };
+        if (parallelJobs) {
+            for (auto &job : jobs)
+                job.progress = false;
+            ThreadPool::global().parallelFor(jobs.size(), 1, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i)
+                    renderJob(i);
+            });
+        }
+        else {
+            for (size_t i = 0; i < jobs.size(); ++i)
+                renderJob(i);
+        }
+        int failed = 0;
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            printf("Job %zu: %dx%d, %d spp -> %s, %.1f ms%s\n", i, jobs[i].width, jobs[i].height, jobs[i].spp,
+                   jobs[i].imagePath.c_str(), jobMs[i], jobOk[i] ? "" : " (failed)");
+            failed += !jobOk[i];
+        }
+        printf("Batch: %zu jobs in %.1f ms (%s, %d threads)\n", jobs.size(), ms(t0, std::chrono::steady_clock::now()),
+               parallelJobs ? "parallel" : "sequential", parallelJobs ? ThreadPool::global().size() : 1);
+        // 有任务输出失败时以非0状态退出
+        return failed ? 1 : 0;
+    }
+
+    if (frames > 0) {
+        double updateTotal = 0;
+        bool ok = true;
+        for (int f = 0; f < frames; ++f) {
+            auto t0 = std::chrono::steady_clock::now();
+            bool meshRebuilt = pose(360.f * f / frames);
+            bool sceneRebuilt = scene.updateBVH();
+            auto t1 = std::chrono::steady_clock::now();
+
+            char path[64];
+            snprintf(path, sizeof(path), "frame_%03d.ppm", f);
+            options.imagePath = path;
+            if (costAOV)
+                options.costPrefix = options.imagePath.substr(0, options.imagePath.rfind('.'));
+            ok = r.Render(scene, options) && ok;
+            auto t2 = std::chrono::steady_clock::now();
+
+            double updateMs = std::chrono::duration<double, std::milli>(t1 - t0).count();
+            updateTotal += updateMs;
+            printf("Frame %d: BVH update %.3f ms (%s), render %.1f ms\n", f, updateMs,
+                   meshRebuilt || sceneRebuilt ? "rebuild" : "refit",
+                   std::chrono::duration<double, std::milli>(t2 - t1).count());
+        }
+        printf("Average BVH update: %.3f ms/frame\n", updateTotal / frames);
+        return ok ? 0 : 1;
+    }
+
     auto start = std::chrono::system_clock::now();
-    r.Render(scene);
+    bool ok = r.Render(scene, options);
     auto stop = std::chrono::system_clock::now();
 
+    if (outOfCoreBunny) {
+        OutOfCoreMesh::Stats stats = outOfCoreBunny->stats();
+        printf("Cluster cache: %zu hits, %zu misses (%.2f%% hit rate), %zu evictions, %.2f MB read, peak %.2f MB resident, %zu read errors\n",
+               stats.hits, stats.misses, 100.0 * stats.hits / std::max<size_t>(1, stats.hits + stats.misses),
+               stats.evictions, stats.bytesLoaded / 1048576.0, stats.peakResidentBytes / 1048576.0, stats.readErrors);
+    }
+
     std::cout << "Render complete: \n";
     std::cout << "Time taken: " << std::chrono::duration_cast<std::chrono::hours>(stop - start).count() << " hours\n";
     std::cout << "          : " << std::chrono::duration_cast<std::chrono::minutes>(stop - start).count() << " minutes\n";
     std::cout << "          : " << std::chrono::duration_cast<std::chrono::seconds>(stop - start).count() << " seconds\n";
 
-    return 0;
+    return ok ? 0 : 1;
 }
\ No newline at end of file
@@ -0,0 +1,61 @@
+//
+// Merge accumulation files written by independent RayTracing processes.
+//
+
+#include <cstring>
+#include <iostream>
+#include "Framebuffer.hpp"
+
+// 用法: MergeAccum [-o image.ppm] [-a merged.acc] part0.acc part1.acc ...
+// 各部分可以是不同的tile范围, 也可以是同一范围的不同采样, 每个像素按采样数加权平均
+int main(int argc, char** argv)
+{
+    std::string imagePath = "binary.ppm", accumPath;
+    std::vector<std::string> parts;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-o") && i + 1 < argc) imagePath = argv[++i];
+        else if (!strcmp(argv[i], "-a") && i + 1 < argc) accumPath = argv[++i];
+        else parts.push_back(argv[i]);
+    }
+    if (parts.empty()) {
+        std::cerr << "usage: " << argv[0] << " [-o image.ppm] [-a merged.acc] part.acc...\n";
+        return 1;
+    }
+
+    AccumulationBuffer merged;
+    for (size_t i = 0; i < parts.size(); ++i) {
+        AccumulationBuffer part;
+        if (!part.load(parts[i])) {
+            std::cerr << "failed to read " << parts[i] << "\n";
+            return 1;
+        }
+        if (i == 0)
+            merged = std::move(part);
+        else if (!merged.merge(part)) {
+            std::cerr << parts[i] << ": resolution " << part.width << "x" << part.height
+                      << " does not match " << merged.width << "x" << merged.height << "\n";
+            return 1;
+        }
+    }
+
+    size_t empty = 0;
+    uint64_t samples = 0;
+    for (auto c : merged.count) {
+        empty += c == 0;
+        samples += c;
+    }
+    std::cout << "Merged " << parts.size() << " parts, " << samples << " samples";
+    if (empty)
+        std::cout << ", " << empty << " pixels without samples";
+    std::cout << "\n";
+
+    if (!accumPath.empty() && !merged.save(accumPath)) {
+        std::cerr << "failed to write " << accumPath << "\n";
+        return 1;
+    }
+    if (!imagePath.empty() && !writePPM(imagePath, merged.width, merged.height, merged.resolve())) {
+        std::cerr << "failed to write " << imagePath << "\n";
+        return 1;
+    }
+    return 0;
+}